@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * Read-only walker for the postgres B-tree indexes, this is enough to find
+ * the heap tuples matching a key in the catalog indexes without scanning the
+ * catalog itself.
+ *
+ * Only indexes on Oid columns are supported (pg_class_oid_index,
+ * pg_class_tblspc_relfilenode_index). The index is read from disk while
+ * postgres may be splitting its pages, like postgres itself we move right
+ * when the key we're looking for is past the high key of a page.
+ *
+ * Since postgres 13, the leaf tuples of equal keys can be merged in a single
+ * posting list tuple. The format is decoded here whatever the headers we are
+ * built with, an index of a newer release may still be walked.
+ */
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include <postgres.h>
+#include <access/nbtree.h>
+#include <storage/bufpage.h>
+
+#include "xmalloc.h"
+#include "utils.h"
+#include "pg.h"
+#include "btree.h"
+
+
+/*
+ * A leaf tuple with INDEX_ALT_TID_MASK and BT_IS_POSTING in the offset of its
+ * TID is a posting list (13+): the block of its TID is the offset of the list
+ * of heap TIDs within the tuple, the rest of the offset is their count.
+ */
+#ifndef INDEX_ALT_TID_MASK
+#define INDEX_ALT_TID_MASK	INDEX_AM_RESERVED_BIT
+#endif
+#ifndef BT_IS_POSTING
+#define BT_IS_POSTING		0x2000
+#endif
+#ifndef BT_OFFSET_MASK
+#define BT_OFFSET_MASK		0x0FFF
+#endif
+
+
+/*
+ * Compare an index tuple with the key we're looking for. The key columns
+ * missing from the tuple (the "minus infinity" first item of internal pages,
+ * truncated pivot tuples) compare lower than anything.
+ *
+ * Returns <0, 0 or >0 if the tuple is lower, equal or greater than the key.
+ */
+int
+_btree_compare(IndexTuple itup, Oid *keys, int nkeys)
+{
+	Oid value;
+	size_t offset, size;
+	int i;
+
+	offset = IndexInfoFindDataOffset(itup->t_info);
+	size = itup->t_info & INDEX_SIZE_MASK;
+
+	for (i = 0; i < nkeys; i++) {
+		if (offset + (i + 1) * sizeof(Oid) > size)
+			return -1;
+
+		memcpy(&value, (char *)itup + offset + i * sizeof(Oid),
+				sizeof(value));
+		if (value < keys[i])
+			return -1;
+		if (value > keys[i])
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Return the index tuple at 'offnum', NULL if it points outside the page.
+ */
+IndexTuple
+_btree_get_tuple(char *page, OffsetNumber offnum)
+{
+	ItemIdData *itemid;
+
+	itemid = PageGetItemId(page, offnum);
+	if (itemid->lp_off + sizeof(IndexTupleData) > BLCKSZ ||
+			itemid->lp_off + itemid->lp_len > BLCKSZ)
+		return NULL;
+
+	return (IndexTuple)PageGetItem(page, itemid);
+}
+
+
+/*
+ * Add the heap TIDs of a leaf tuple to 'tids' (up to 'max', 'count' are
+ * there already), the one of a plain tuple or all those of a posting list.
+ *
+ * Returns the new count (which can be above 'max'), -1 if the posting list
+ * doesn't fit in the tuple.
+ */
+int
+_btree_add_tids(IndexTuple itup, ItemPointerData *tids, int count, int max)
+{
+	ItemPointerData *posting;
+	size_t offset, size;
+	uint16 info;
+	int i, n;
+
+	info = ItemPointerGetOffsetNumber(&itup->t_tid);
+	if (!(itup->t_info & INDEX_ALT_TID_MASK) || !(info & BT_IS_POSTING)) {
+		if (count < max)
+			tids[count] = itup->t_tid;
+		return count + 1;
+	}
+
+	n = info & BT_OFFSET_MASK;
+	offset = ItemPointerGetBlockNumber(&itup->t_tid);
+	size = itup->t_info & INDEX_SIZE_MASK;
+	if (offset < sizeof(IndexTupleData) ||
+			offset + n * sizeof(ItemPointerData) > size)
+		return -1;
+
+	posting = (ItemPointerData *)((char *)itup + offset);
+	for (i = 0; i < n; i++, count++)
+		if (count < max)
+			memcpy(&tids[count], &posting[i],
+					sizeof(ItemPointerData));
+
+	return count;
+}
+
+
+/*
+ * Make sure a page we just read looks like a B-tree page.
+ */
+int
+_btree_page_is_valid(char *page)
+{
+	PageHeaderData *ph = (PageHeaderData *)page;
+
+	if (PageGetPageSize(page) != BLCKSZ)
+		return 0;
+
+	if (ph->pd_lower < SizeOfPageHeaderData || ph->pd_lower > BLCKSZ ||
+			ph->pd_special + sizeof(BTPageOpaqueData) > BLCKSZ)
+		return 0;
+
+	return 1;
+}
+
+
+/*
+ * Read the metapage of an index, returns the block number of the root, or
+ * P_NONE if the index is empty or if this is not a B-tree.
+ */
+BlockNumber
+_btree_get_root(char *filepath, char *page)
+{
+	BTMetaPageData *meta;
+
+	if (pg_read_block(filepath, BTREE_METAPAGE, page) == -1)
+		return P_NONE;
+
+	if (!_btree_page_is_valid(page))
+		return P_NONE;
+
+	meta = BTPageGetMeta(page);
+	if (meta->btm_magic != BTREE_MAGIC)
+		return P_NONE;
+
+	return meta->btm_root;
+}
+
+
+/*
+ * Check if the file is a B-tree index we can walk.
+ */
+int
+btree_check(char *filepath)
+{
+	char *page;
+	BTMetaPageData *meta;
+	int valid;
+
+	page = xmalloc(BLCKSZ);
+
+	valid = (_btree_get_root(filepath, page) != P_NONE);
+	if (valid) {
+		meta = BTPageGetMeta(page);
+		debug("btree: %s version %u, root %u at level %u\n", filepath,
+				meta->btm_version, meta->btm_root,
+				meta->btm_level);
+	}
+
+	xfree(page);
+
+	return valid;
+}
+
+
+/*
+ * Find the heap tuples matching 'keys' in the index stored at 'filepath'.
+ * Up to 'max' matching TIDs are stored in 'tids'.
+ *
+ * Returns the number of matches, -1 if the index couldn't be walked.
+ */
+int
+btree_lookup(char *filepath, Oid *keys, int nkeys, ItemPointerData *tids,
+		int max)
+{
+	char *page;
+	BTPageOpaque opaque;
+	IndexTuple itup;
+	BlockNumber blkno, child;
+	OffsetNumber offnum, maxoff;
+	int cmp, visited, count = 0, done = 0;
+
+	if (nkeys < 1 || nkeys > BTREE_MAX_KEYS)
+		errx(1, "btree_lookup: unsupported number of keys (%d)", nkeys);
+
+	page = xmalloc(BLCKSZ);
+
+	blkno = _btree_get_root(filepath, page);
+	if (blkno == P_NONE)
+		goto fail;
+
+	for (visited = 0; !done; visited++) {
+		if (visited == BTREE_MAX_PAGES || blkno == P_NONE)
+			goto fail;
+
+		if (pg_read_block(filepath, blkno, page) == -1 ||
+				!_btree_page_is_valid(page))
+			goto fail;
+
+		opaque = (BTPageOpaque)PageGetSpecialPointer(page);
+		maxoff = PageGetMaxOffsetNumber(page);
+
+		/* Deleted pages can still be reached, their right link is
+		 * valid. */
+		if (P_IGNORE(opaque)) {
+			blkno = opaque->btpo_next;
+			continue;
+		}
+
+		/* The page was split since its parent was read, what we're
+		 * looking for is on the right. */
+		if (!P_RIGHTMOST(opaque) && maxoff >= P_HIKEY) {
+			itup = _btree_get_tuple(page, P_HIKEY);
+			if (itup == NULL)
+				goto fail;
+			if (_btree_compare(itup, keys, nkeys) < 0) {
+				blkno = opaque->btpo_next;
+				continue;
+			}
+		}
+
+		/*
+		 * Internal page: follow the last downlink lower than the key,
+		 * the first item is always "minus infinity".
+		 */
+		if (!P_ISLEAF(opaque)) {
+			child = P_NONE;
+			for (offnum = P_FIRSTDATAKEY(opaque); offnum <= maxoff;
+					offnum++) {
+				itup = _btree_get_tuple(page, offnum);
+				if (itup == NULL)
+					goto fail;
+				if (offnum > P_FIRSTDATAKEY(opaque) &&
+						_btree_compare(itup, keys,
+							nkeys) >= 0)
+					break;
+				child = ItemPointerGetBlockNumber(
+						&itup->t_tid);
+			}
+			blkno = child;
+			continue;
+		}
+
+		/*
+		 * Leaf page: collect the matches. Like _bt_readpage(), we are
+		 * only done once we see a greater item: the matches can
+		 * continue on the next page, or all be there when the key is
+		 * equal to the separator we came down by (its heap TID was
+		 * truncated, the items equal to it are on the right).
+		 */
+		done = 1;
+		cmp = -1;
+		for (offnum = P_FIRSTDATAKEY(opaque); offnum <= maxoff;
+				offnum++) {
+			itup = _btree_get_tuple(page, offnum);
+			if (itup == NULL)
+				goto fail;
+
+			cmp = _btree_compare(itup, keys, nkeys);
+			if (cmp < 0)
+				continue;
+			if (cmp > 0)
+				break;
+
+			count = _btree_add_tids(itup, tids, count, max);
+			if (count == -1)
+				goto fail;
+		}
+
+		if (cmp <= 0 && !P_RIGHTMOST(opaque)) {
+			blkno = opaque->btpo_next;
+			done = 0;
+		}
+	}
+
+	xfree(page);
+
+	return MIN(count, max);
+
+fail:
+	debug("btree: unable to walk %s\n", filepath);
+	xfree(page);
+
+	return -1;
+}
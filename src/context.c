@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * Per-process contexts, one per traced process.
+ *
+ * Most of the code works on the process whose event is being handled: its
+ * file descriptors (pfd_cache.c) are globals. Switching to another process
+ * saves them in the context of the current one and restores those of the
+ * next, the cost is a few pointers whatever the number of processes. What is
+ * not per-process (the cluster, the catalogs of its databases, the counters)
+ * is shared by all the contexts.
+ */
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+
+#include <postgres.h>
+
+#include "pfd.h"
+#include "pfd_cache.h"
+#include "context.h"
+#include "utils.h"
+#include "xmalloc.h"
+
+
+extern pfd_t *pfd_pool;
+extern int pfd_pool_size;
+
+/* Realloc'd array of context pointers, a context never moves. */
+context **context_pool = NULL;
+int context_count = 0;
+int context_pool_size = 0;
+
+/* Context whose state is in the globals, NULL if none. */
+context *current_context = NULL;
+
+
+/*
+ * Create the context of a new process and switch to it, its pfd_cache is
+ * empty.
+ */
+context *
+context_add(pid_t pid)
+{
+	context *c;
+
+	if (context_get(pid) != NULL)
+		errx(1, "context_add: pid %d is already traced", (int)pid);
+
+	if (context_count == context_pool_size) {
+		context_pool_size += MAX(context_pool_size, CONTEXT_GROWTH);
+		context_pool = xrealloc(context_pool, context_pool_size,
+				sizeof(context *));
+	}
+
+	c = xmalloc(sizeof(context));
+	memset(c, 0, sizeof(context));
+	c->pid = pid;
+	context_pool[context_count++] = c;
+
+	context_switch(c);
+
+	debug("context: tracing pid %d (%d processes)\n", (int)pid,
+			context_count);
+
+	return c;
+}
+
+
+/*
+ * Returns the context of a process, NULL if it is not traced.
+ */
+context *
+context_get(pid_t pid)
+{
+	int i;
+
+	if (current_context != NULL && current_context->pid == pid)
+		return current_context;
+
+	for (i = 0; i < context_count; i++)
+		if (context_pool[i]->pid == pid)
+			return context_pool[i];
+
+	return NULL;
+}
+
+
+/*
+ * Make 'c' the current context, the state of the previous one is saved.
+ */
+void
+context_switch(context *c)
+{
+	if (c == current_context)
+		return;
+
+	if (current_context != NULL) {
+		current_context->pfd_pool = pfd_pool;
+		current_context->pfd_pool_size = pfd_pool_size;
+	}
+
+	pfd_pool = c->pfd_pool;
+	pfd_pool_size = c->pfd_pool_size;
+
+	current_context = c;
+}
+
+
+/*
+ * Forget about a process that is gone, with all its file descriptors.
+ */
+void
+context_remove(pid_t pid)
+{
+	context *c;
+	int i;
+
+	c = context_get(pid);
+	if (c == NULL)
+		return;
+
+	context_switch(c);
+	pfd_cache_clear();
+	if (pfd_pool != NULL)
+		xfree(pfd_pool);
+	pfd_pool = NULL;
+	pfd_pool_size = 0;
+	current_context = NULL;
+
+	for (i = 0; i < context_count; i++) {
+		if (context_pool[i] == c) {
+			context_pool[i] = context_pool[--context_count];
+			break;
+		}
+	}
+
+	if (c->pwd != NULL)
+		xfree(c->pwd);
+	xfree(c);
+
+	debug("context: pid %d is gone (%d processes)\n", (int)pid,
+			context_count);
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/* Minimum growth of the pool. */
+#define CONTEXT_GROWTH		8
+
+
+/*
+ * State of one traced process. While its events are handled, its file
+ * descriptors are in the pfd_cache globals, they are only saved here when
+ * another process takes over (see context_switch()).
+ */
+typedef struct _context {
+	pid_t		 pid;
+	char		*pwd;
+	pfd_t		*pfd_pool;
+	int		 pfd_pool_size;
+} context;
+
+
+context		*context_add(pid_t);
+context		*context_get(pid_t);
+void		 context_switch(context *);
+void		 context_remove(pid_t);
@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * Discovery of the processes of a cluster. The postmaster is found from the
+ * postmaster.pid of the data directory, all the other processes are its
+ * children and postgres tells us what each of them does in its process title
+ * (the "postgres: ..." seen in ps), e.g.:
+ *
+ *	postgres: checkpointer
+ *	postgres: alice shop [local] SELECT
+ *	postgres: autovacuum worker shop
+ *	postgres: parallel worker for PID 1234
+ *	postgres: walsender replicator 10.0.0.2(41352) streaming 0/3000060
+ *
+ * Older versions add " process" to the auxiliary processes and a cluster_name
+ * is shown before the rest, both are skipped.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include <postgres.h>
+
+#include "discover.h"
+#include "proc.h"
+#include "strlcpy.h"
+#include "utils.h"
+#include "xmalloc.h"
+
+
+/*
+ * Titles of the processes not running queries, matched on their beginning.
+ * The names of the roles are those used on the command line, in the same
+ * order as enum discover_role.
+ */
+struct discover_title {
+	char			*prefix;
+	enum discover_role	 role;
+} discover_titles[] = {
+	{ "autovacuum launcher",		ROLE_AUTOVACUUM_LAUNCHER },
+	{ "autovacuum worker",			ROLE_AUTOVACUUM },
+	{ "parallel worker for PID",		ROLE_PARALLEL },
+	{ "checkpointer",			ROLE_CHECKPOINTER },
+	{ "background writer",			ROLE_BGWRITER },
+	{ "writer process",			ROLE_BGWRITER },
+	{ "walwriter",				ROLE_WALWRITER },
+	{ "wal writer",				ROLE_WALWRITER },
+	{ "walreceiver",			ROLE_WALRECEIVER },
+	{ "wal receiver",			ROLE_WALRECEIVER },
+	{ "archiver",				ROLE_ARCHIVER },
+	{ "stats collector",			ROLE_STATS },
+	{ "logger",				ROLE_LOGGER },
+	{ "startup",				ROLE_STARTUP },
+	{ "logical replication",		ROLE_BGWORKER },
+	{ NULL,					ROLE_OTHER }
+};
+
+char *discover_role_names[ROLE_COUNT] = {
+	"backend",
+	"autovacuum",
+	"autovacuum-launcher",
+	"parallel",
+	"checkpointer",
+	"bgwriter",
+	"walwriter",
+	"walsender",
+	"walreceiver",
+	"archiver",
+	"stats",
+	"logger",
+	"startup",
+	"bgworker",
+	"other"
+};
+
+/* Children found by the last discover_children(), realloc'd. */
+discover_process *discover_pool = NULL;
+int discover_count = 0;
+int discover_pool_size = 0;
+
+
+/*
+ * Return the name of a role, as given to -r.
+ */
+char *
+discover_role_name(enum discover_role role)
+{
+	if (role < 0 || role >= ROLE_COUNT)
+		return "?";
+
+	return discover_role_names[role];
+}
+
+
+/*
+ * Add the roles of a comma-separated list to the filter.
+ */
+void
+discover_parse_roles(discover_filter *filter, char *list)
+{
+	char *copy, *p, *name;
+	int role;
+
+	p = copy = xstrdup(list);
+
+	while ((name = strsep(&p, ",")) != NULL) {
+		for (role = 0; role < ROLE_COUNT; role++)
+			if (strcmp(name, discover_role_names[role]) == 0)
+				break;
+		if (role == ROLE_COUNT)
+			errx(1, "unknown role: %s", name);
+		filter->roles |= 1 << role;
+	}
+
+	xfree(copy);
+}
+
+
+/*
+ * Copy the next word of 's' to 'buf' and move 's' past it. Returns 0 when
+ * there is nothing left.
+ */
+int
+_discover_next_word(char **s, char *buf, size_t size)
+{
+	char *c = *s;
+	size_t len;
+
+	while (*c == ' ')
+		c++;
+
+	len = strcspn(c, " ");
+	if (len == 0)
+		return 0;
+
+	strlcpy(buf, c, MIN(len + 1, size));
+	*s = c + len;
+
+	return 1;
+}
+
+
+/*
+ * Check if a word is the client address of a connection, "[local]" for the
+ * unix sockets or "host(port)".
+ */
+int
+_discover_is_address(char *word)
+{
+	size_t len = strlen(word);
+
+	if (strcmp(word, "[local]") == 0)
+		return 1;
+
+	return len > 0 && word[len - 1] == ')' && strchr(word, '(') != NULL;
+}
+
+
+/*
+ * Read the "user [database] address" of a connection, used for the backends
+ * and the walsenders (only the logical ones have a database). Returns 0 if
+ * the title doesn't look like that.
+ */
+int
+_discover_read_connection(discover_process *dp, char *s)
+{
+	char word[DISCOVER_TITLE_LENGTH];
+
+	if (!_discover_next_word(&s, dp->user, sizeof(dp->user)))
+		return 0;
+	if (!_discover_next_word(&s, word, sizeof(word)))
+		return 0;
+	if (_discover_is_address(word))
+		return 1;
+
+	strlcpy(dp->database, word, sizeof(dp->database));
+	if (!_discover_next_word(&s, word, sizeof(word)))
+		return 0;
+
+	return _discover_is_address(word);
+}
+
+
+/*
+ * Guess the role of a process from its title.
+ */
+void
+discover_classify(discover_process *dp, char *title)
+{
+	struct discover_title *dt;
+	char word[DISCOVER_TITLE_LENGTH], *s = title;
+	size_t len;
+
+	strlcpy(dp->title, title, sizeof(dp->title));
+	dp->role = ROLE_OTHER;
+	dp->leader = 0;
+	dp->user[0] = '\0';
+	dp->database[0] = '\0';
+
+	/* "postgres:", then maybe the cluster_name, also followed by ':'. */
+	if (!_discover_next_word(&s, word, sizeof(word)) ||
+			word[strlen(word) - 1] != ':')
+		return;
+	while (*s == ' ')
+		s++;
+	len = strcspn(s, " ");
+	if (len > 1 && s[len - 1] == ':') {
+		s += len;
+		while (*s == ' ')
+			s++;
+	}
+
+	/*
+	 * The connections first, a user could be named after an auxiliary
+	 * process.
+	 */
+	if (strncmp(s, "walsender ", 10) == 0 ||
+			strncmp(s, "wal sender process ", 19) == 0) {
+		s = strstr(s, "sender") + 6;
+		if (strncmp(s, " process", 8) == 0)
+			s += 8;
+		dp->role = ROLE_WALSENDER;
+		if (!_discover_read_connection(dp, s))
+			dp->user[0] = dp->database[0] = '\0';
+		return;
+	}
+
+	if (_discover_read_connection(dp, s) && dp->database[0] != '\0') {
+		dp->role = ROLE_BACKEND;
+		return;
+	}
+	dp->user[0] = dp->database[0] = '\0';
+
+	for (dt = discover_titles; dt->prefix != NULL; dt++) {
+		len = strlen(dt->prefix);
+		if (strncmp(s, dt->prefix, len) == 0 &&
+				(s[len] == '\0' || s[len] == ' '))
+			break;
+	}
+	if (dt->prefix == NULL)
+		return;
+	dp->role = dt->role;
+	s += len;
+
+	if (dp->role == ROLE_PARALLEL) {
+		dp->leader = strtol(s, NULL, 10);
+	} else if (dp->role == ROLE_AUTOVACUUM) {
+		if (strncmp(s, " process", 8) == 0)
+			s += 8;
+		if (!_discover_next_word(&s, dp->database,
+					sizeof(dp->database)))
+			dp->database[0] = '\0';
+	}
+}
+
+
+/*
+ * Read the title of a process and guess what it does. A parallel worker works
+ * for the user and on the database of its leader.
+ *
+ * Returns -1 if the process is gone.
+ */
+int
+discover_read(pid_t pid, discover_process *dp)
+{
+	discover_process leader;
+	char title[DISCOVER_TITLE_LENGTH];
+
+	if (proc_read_cmdline(pid, title, sizeof(title)) == -1)
+		return -1;
+
+	dp->pid = pid;
+	discover_classify(dp, title);
+
+	if (dp->role == ROLE_PARALLEL && dp->leader > 0 &&
+			proc_read_cmdline(dp->leader, title,
+				sizeof(title)) != -1) {
+		discover_classify(&leader, title);
+		strlcpy(dp->user, leader.user, sizeof(dp->user));
+		strlcpy(dp->database, leader.database, sizeof(dp->database));
+	}
+
+	return 0;
+}
+
+
+/*
+ * Add a child of the postmaster to the pool, called by proc_read_children().
+ * The processes exiting while we look are skipped.
+ */
+void
+_discover_add_child(pid_t pid)
+{
+	if (discover_count == discover_pool_size) {
+		discover_pool_size += DISCOVER_GROWTH;
+		discover_pool = xrealloc(discover_pool, discover_pool_size,
+				sizeof(discover_process));
+	}
+
+	if (discover_read(pid, discover_pool + discover_count) == 0)
+		discover_count++;
+}
+
+
+/*
+ * Find all the children of the postmaster and guess what they do. The list
+ * is kept until the next call, it is not for the caller to free.
+ *
+ * Returns the number of processes found.
+ */
+int
+discover_children(pid_t postmaster, discover_process **list)
+{
+	discover_count = 0;
+
+	if (proc_read_children(postmaster, _discover_add_child) == -1)
+		err(1, "unable to read /proc");
+
+	*list = discover_pool;
+
+	return discover_count;
+}
+
+
+/*
+ * Check if a process matches the filter.
+ */
+int
+discover_match(discover_process *dp, discover_filter *filter)
+{
+	if (filter->roles != 0 && (filter->roles & (1 << dp->role)) == 0)
+		return 0;
+
+	if (filter->user != NULL && strcmp(filter->user, dp->user) != 0)
+		return 0;
+
+	if (filter->database != NULL &&
+			strcmp(filter->database, dp->database) != 0)
+		return 0;
+
+	if (filter->title != NULL && strstr(dp->title, filter->title) == NULL)
+		return 0;
+
+	return 1;
+}
+
+
+/*
+ * Find the postmaster of the cluster in 'datadir'. The pid in postmaster.pid
+ * can be left over by a crash and reused by another process, the postmaster
+ * lives in its data directory.
+ */
+pid_t
+discover_postmaster(char *datadir)
+{
+	FILE *fp;
+	char path[MAXPATHLEN], line[MAX_LINE_LENGTH], *real, *cwd;
+	pid_t pid;
+
+	snprintf(path, sizeof(path), "%s/postmaster.pid", datadir);
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		err(1, "unable to open %s, is the cluster running?", path);
+
+	if (fgets(line, sizeof(line), fp) == NULL)
+		errx(1, "%s is empty", path);
+	fclose(fp);
+
+	line[strcspn(line, "\n")] = '\0';
+	pid = xatoi_or_zero(line);
+	if (pid <= 0)
+		errx(1, "invalid pid in %s", path);
+
+	real = realpath(datadir, NULL);
+	if (real == NULL)
+		err(1, "%s", datadir);
+
+	cwd = proc_get_cwd(pid);
+	if (cwd == NULL || strcmp(cwd, real) != 0)
+		errx(1, "postmaster %d of %s is not running", pid, datadir);
+
+	debug("discover: postmaster of %s is %d\n", real, pid);
+
+	free(real);
+	xfree(cwd);
+
+	return pid;
+}
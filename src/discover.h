@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/* Longest process title we keep. */
+#define DISCOVER_TITLE_LENGTH	256
+
+/* Minimum growth of the list of processes. */
+#define DISCOVER_GROWTH		32
+
+
+/*
+ * What a child of the postmaster does, guessed from its process title. Used
+ * as bits in the role mask of a filter.
+ */
+enum discover_role {
+	ROLE_BACKEND,
+	ROLE_AUTOVACUUM,
+	ROLE_AUTOVACUUM_LAUNCHER,
+	ROLE_PARALLEL,
+	ROLE_CHECKPOINTER,
+	ROLE_BGWRITER,
+	ROLE_WALWRITER,
+	ROLE_WALSENDER,
+	ROLE_WALRECEIVER,
+	ROLE_ARCHIVER,
+	ROLE_STATS,
+	ROLE_LOGGER,
+	ROLE_STARTUP,
+	ROLE_BGWORKER,
+	ROLE_OTHER,
+	ROLE_COUNT
+};
+
+
+/*
+ * One child of the postmaster. 'leader' is the backend a parallel worker
+ * works for, the user and database are empty when the title doesn't have
+ * them.
+ */
+typedef struct _discover_process {
+	pid_t			 pid;
+	enum discover_role	 role;
+	pid_t			 leader;
+	char			 user[NAMEDATALEN];
+	char			 database[NAMEDATALEN];
+	char			 title[DISCOVER_TITLE_LENGTH];
+} discover_process;
+
+
+/*
+ * Which processes to trace, a NULL user, database or title matches anything,
+ * so does an empty role mask. 'title' is matched on any part of the title.
+ */
+typedef struct _discover_filter {
+	unsigned int	 roles;
+	char		*user;
+	char		*database;
+	char		*title;
+} discover_filter;
+
+
+pid_t		 discover_postmaster(char *);
+int		 discover_children(pid_t, discover_process **);
+int		 discover_read(pid_t, discover_process *);
+void		 discover_classify(discover_process *, char *);
+int		 discover_match(discover_process *, discover_filter *);
+void		 discover_parse_roles(discover_filter *, char *);
+char		*discover_role_name(enum discover_role);
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * Route each system call to the handlers registered for it.
+ *
+ * Function names coming from a text tracer (strace, dtruss) are mapped once
+ * to their trace_func by dispatch_lookup(), the native tracers already give
+ * us a trace_func (sysent.c). From there, finding the handlers is an array
+ * lookup, whatever the number of functions we know.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+
+#include "trace.h"
+#include "dispatch.h"
+
+
+/* Name of each trace_func, as printed by strace. */
+char *dispatch_names[TRACE_FUNC_COUNT] = {
+	[TRACE_FUNC_READ] = "read",
+	[TRACE_FUNC_WRITE] = "write",
+	[TRACE_FUNC_OPEN] = "open",
+	[TRACE_FUNC_CLOSE] = "close",
+	[TRACE_FUNC_LSEEK] = "lseek",
+	[TRACE_FUNC_OPENAT] = "openat",
+	[TRACE_FUNC_PREAD] = "pread64",
+	[TRACE_FUNC_PWRITE] = "pwrite64",
+	[TRACE_FUNC_PREADV] = "preadv",
+	[TRACE_FUNC_PWRITEV] = "pwritev",
+	[TRACE_FUNC_FSYNC] = "fsync",
+	[TRACE_FUNC_FDATASYNC] = "fdatasync",
+	[TRACE_FUNC_FTRUNCATE] = "ftruncate",
+	[TRACE_FUNC_DUP] = "dup",
+	[TRACE_FUNC_DUP2] = "dup2",
+	[TRACE_FUNC_DUP3] = "dup3",
+	[TRACE_FUNC_FCNTL] = "fcntl",
+	[TRACE_FUNC_OTHER] = "other",
+};
+
+dispatch_handler dispatch_handlers[TRACE_FUNC_COUNT][DISPATCH_MAX_HANDLERS];
+int dispatch_handler_count[TRACE_FUNC_COUNT];
+
+
+/*
+ * Map a function name to its trace_func, TRACE_FUNC_OTHER if we don't handle
+ * it. A switch on the first character leaves at most a few names to compare.
+ */
+enum trace_func
+dispatch_lookup(char *name)
+{
+	switch (name[0]) {
+	case 'c':
+		if (strcmp(name, "close") == 0)
+			return TRACE_FUNC_CLOSE;
+		break;
+	case 'd':
+		if (strcmp(name, "dup") == 0)
+			return TRACE_FUNC_DUP;
+		if (strcmp(name, "dup2") == 0)
+			return TRACE_FUNC_DUP2;
+		if (strcmp(name, "dup3") == 0)
+			return TRACE_FUNC_DUP3;
+		break;
+	case 'f':
+		if (strcmp(name, "fsync") == 0)
+			return TRACE_FUNC_FSYNC;
+		if (strcmp(name, "fdatasync") == 0)
+			return TRACE_FUNC_FDATASYNC;
+		if (strcmp(name, "ftruncate") == 0)
+			return TRACE_FUNC_FTRUNCATE;
+		if (strcmp(name, "fcntl") == 0)
+			return TRACE_FUNC_FCNTL;
+		break;
+	case 'l':
+		if (strcmp(name, "lseek") == 0)
+			return TRACE_FUNC_LSEEK;
+		break;
+	case 'o':
+		if (strcmp(name, "open") == 0)
+			return TRACE_FUNC_OPEN;
+		if (strcmp(name, "openat") == 0)
+			return TRACE_FUNC_OPENAT;
+		break;
+	case 'p':
+		if (strcmp(name, "pread64") == 0)
+			return TRACE_FUNC_PREAD;
+		if (strcmp(name, "pwrite64") == 0)
+			return TRACE_FUNC_PWRITE;
+		if (strcmp(name, "preadv") == 0 ||
+				strcmp(name, "preadv2") == 0)
+			return TRACE_FUNC_PREADV;
+		if (strcmp(name, "pwritev") == 0 ||
+				strcmp(name, "pwritev2") == 0)
+			return TRACE_FUNC_PWRITEV;
+		break;
+	case 'r':
+		if (strcmp(name, "read") == 0)
+			return TRACE_FUNC_READ;
+		break;
+	case 'w':
+		if (strcmp(name, "write") == 0)
+			return TRACE_FUNC_WRITE;
+		break;
+	}
+
+	return TRACE_FUNC_OTHER;
+}
+
+
+/*
+ * Name of a trace_func.
+ */
+char *
+dispatch_get_name(enum trace_func func)
+{
+	return dispatch_names[func];
+}
+
+
+/*
+ * Add a handler for a function, handlers are called in the order they were
+ * registered. TRACE_FUNC_OTHER handlers get all the functions we don't know.
+ */
+void
+dispatch_register(enum trace_func func, dispatch_handler handler)
+{
+	if (dispatch_handler_count[func] == DISPATCH_MAX_HANDLERS)
+		errx(1, "dispatch_register: too many handlers for %s",
+				dispatch_names[func]);
+
+	dispatch_handlers[func][dispatch_handler_count[func]] = handler;
+	dispatch_handler_count[func]++;
+}
+
+
+/*
+ * Pass a system call to its handlers.
+ */
+void
+dispatch_event(trace_event *ev)
+{
+	int i;
+
+	for (i = 0; i < dispatch_handler_count[ev->func]; i++)
+		dispatch_handlers[ev->func][i](ev);
+}
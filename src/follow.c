@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * Follow the new children of the postmaster through the proc connector of
+ * Linux, the kernel tells us about every fork as it happens. A new child has
+ * the title of the postmaster until it knows what it does (a backend only
+ * after reading the startup packet of its client), its title is read every
+ * few milliseconds until then and it is matched against the filters of -D.
+ *
+ * The proc connector is read by its own thread, the processes matching are
+ * handed over to the tracing thread, the only one allowed to ptrace. That one
+ * spends its time in waitpid(), we wake it up with FOLLOW_WAKEUP_SIGNAL (its
+ * handler does nothing, waitpid() returns EINTR). The signal is only sent
+ * while it is in waitpid(), and sent again every FOLLOW_INTERVAL until it
+ * took the processes: a signal received right before waitpid() is lost.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <err.h>
+
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+
+#include <postgres.h>
+
+#include "discover.h"
+#include "follow.h"
+#include "trace.h"
+#include "utils.h"
+#include "xmalloc.h"
+
+
+/*
+ * A new child of the postmaster we're waiting on, 'since' is when it was
+ * forked.
+ */
+struct follow_pending {
+	pid_t		 pid;
+	double		 since;
+};
+
+int follow_socket = -1;
+pid_t follow_postmaster = 0;
+discover_filter *follow_filter = NULL;
+
+/* Children not classified yet, only touched by the follower thread. */
+struct follow_pending *follow_pending = NULL;
+int follow_pending_count = 0;
+int follow_pending_size = 0;
+
+/*
+ * Processes to attach, filled by the follower and swapped with 'taken' by the
+ * tracing thread, under the mutex.
+ */
+pthread_mutex_t follow_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t follow_cond = PTHREAD_COND_INITIALIZER;
+pid_t *follow_ready = NULL;
+int follow_ready_count = 0;
+int follow_ready_size = 0;
+pid_t *follow_taken = NULL;
+int follow_taken_size = 0;
+
+/* The tracing thread, the one that started following. */
+pthread_t follow_tracer;
+
+extern volatile sig_atomic_t trace_interrupted;
+extern int ptrace_waiting;
+
+
+/*
+ * FOLLOW_WAKEUP_SIGNAL only has to interrupt waitpid().
+ */
+void
+_follow_wakeup_handler(int sig)
+{
+}
+
+
+/*
+ * Interrupt the waitpid() of the tracing thread if it has processes to take.
+ * Returns 1 while some are left, we have to try again later.
+ */
+int
+_follow_wake_tracer(void)
+{
+	int count;
+
+	pthread_mutex_lock(&follow_mutex);
+	count = follow_ready_count;
+	pthread_mutex_unlock(&follow_mutex);
+
+	if (count > 0 && __atomic_load_n(&ptrace_waiting, __ATOMIC_SEQ_CST))
+		pthread_kill(follow_tracer, FOLLOW_WAKEUP_SIGNAL);
+
+	return count > 0;
+}
+
+
+/*
+ * Start waiting on a new child of the postmaster.
+ */
+void
+_follow_add_pending(pid_t pid)
+{
+	struct follow_pending *fp;
+
+	if (follow_pending_count == follow_pending_size) {
+		follow_pending_size += FOLLOW_GROWTH;
+		follow_pending = xrealloc(follow_pending, follow_pending_size,
+				sizeof(struct follow_pending));
+	}
+
+	fp = &follow_pending[follow_pending_count++];
+	fp->pid = pid;
+	fp->since = get_monotonic_time();
+
+	debug("follow: new child %d\n", pid);
+}
+
+
+/*
+ * Stop waiting on a child, it exited or it was classified.
+ */
+void
+_follow_remove_pending(int i)
+{
+	follow_pending[i] = follow_pending[--follow_pending_count];
+}
+
+
+/*
+ * Hand a process over to the tracing thread, it is woken up if it is waiting
+ * on us. The follower thread interrupts its waitpid() otherwise.
+ */
+void
+_follow_add_ready(pid_t pid)
+{
+	pthread_mutex_lock(&follow_mutex);
+	if (follow_ready_count == follow_ready_size) {
+		follow_ready_size += FOLLOW_GROWTH;
+		follow_ready = xrealloc(follow_ready, follow_ready_size,
+				sizeof(pid_t));
+	}
+	follow_ready[follow_ready_count++] = pid;
+	pthread_cond_signal(&follow_cond);
+	pthread_mutex_unlock(&follow_mutex);
+}
+
+
+/*
+ * Read the titles of the children we're waiting on. A child is decided once
+ * it has a role (and a database if we filter on it), or when it took too
+ * long.
+ */
+void
+_follow_check_pending(void)
+{
+	discover_process dp;
+	double now;
+	int i = 0, timed_out;
+
+	now = get_monotonic_time();
+
+	while (i < follow_pending_count) {
+		if (discover_read(follow_pending[i].pid, &dp) == -1) {
+			_follow_remove_pending(i);
+			continue;
+		}
+
+		timed_out = (now - follow_pending[i].since >= FOLLOW_TIMEOUT);
+		if (!timed_out && (dp.role == ROLE_OTHER ||
+					(follow_filter->database != NULL &&
+					 dp.database[0] == '\0'))) {
+			i++;
+			continue;
+		}
+
+		if (discover_match(&dp, follow_filter)) {
+			debug("follow: attaching to %d (%s)\n", dp.pid,
+					discover_role_name(dp.role));
+			_follow_add_ready(dp.pid);
+		} else {
+			debug("follow: ignoring %d (%s)\n", dp.pid,
+					discover_role_name(dp.role));
+		}
+
+		_follow_remove_pending(i);
+	}
+}
+
+
+/*
+ * Read the events waiting on the socket. Only the processes forked by the
+ * postmaster interest us, not its threads nor the children of its children.
+ */
+void
+_follow_receive(void)
+{
+	char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct nlmsghdr *nlh;
+	struct cn_msg *msg;
+	struct proc_event *ev;
+	ssize_t len;
+	int i;
+
+	len = recv(follow_socket, buf, sizeof(buf), 0);
+	if (len == -1) {
+		/* The kernel had to drop some, we can only go on. */
+		if (errno == ENOBUFS) {
+			debug("follow: events were lost\n");
+			return;
+		}
+		if (errno == EINTR)
+			return;
+		err(1, "follow: recv()");
+	}
+
+	for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+			nlh = NLMSG_NEXT(nlh, len)) {
+		if (nlh->nlmsg_type == NLMSG_NOOP ||
+				nlh->nlmsg_type == NLMSG_ERROR)
+			continue;
+
+		msg = NLMSG_DATA(nlh);
+		ev = (struct proc_event *)msg->data;
+
+		switch (ev->what) {
+		case PROC_EVENT_FORK:
+			if (ev->event_data.fork.parent_tgid ==
+					follow_postmaster &&
+					ev->event_data.fork.child_pid ==
+					ev->event_data.fork.child_tgid)
+				_follow_add_pending(
+						ev->event_data.fork.child_tgid);
+			break;
+		case PROC_EVENT_EXIT:
+			for (i = 0; i < follow_pending_count; i++) {
+				if (follow_pending[i].pid ==
+						ev->event_data.exit.process_pid) {
+					_follow_remove_pending(i);
+					break;
+				}
+			}
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+
+/*
+ * Follower thread, the socket is only polled with a timeout while some
+ * children are waiting to be classified or to be taken by the tracing thread.
+ */
+void *
+_follow_run(void *arg)
+{
+	struct pollfd pfd;
+	sigset_t set;
+	int ret, waking = 0;
+
+	/* Interruptions are for the tracing thread. */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pfd.fd = follow_socket;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		ret = poll(&pfd, 1, follow_pending_count > 0 || waking ?
+				FOLLOW_INTERVAL : -1);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "follow: poll()");
+		}
+
+		if (ret > 0)
+			_follow_receive();
+
+		if (follow_pending_count > 0)
+			_follow_check_pending();
+
+		waking = _follow_wake_tracer();
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Subscribe to the proc connector and start following the children of the
+ * postmaster matching the filter. This needs to be root (CAP_NET_ADMIN).
+ */
+void
+follow_start(pid_t postmaster, discover_filter *filter)
+{
+	struct sockaddr_nl sa;
+	char buf[NLMSG_SPACE(sizeof(struct cn_msg) +
+			sizeof(enum proc_cn_mcast_op))];
+	struct nlmsghdr *nlh;
+	struct cn_msg *msg;
+	enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+	struct sigaction act;
+	pthread_t thread;
+	int size = FOLLOW_SOCKET_BUFFER, ret;
+
+	follow_postmaster = postmaster;
+	follow_filter = filter;
+	follow_tracer = pthread_self();
+
+	/* No SA_RESTART, waitpid() has to return. */
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = _follow_wakeup_handler;
+	sigemptyset(&act.sa_mask);
+	sigaction(FOLLOW_WAKEUP_SIGNAL, &act, NULL);
+
+	follow_socket = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+			NETLINK_CONNECTOR);
+	if (follow_socket == -1)
+		err(1, "follow: unable to open the proc connector");
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = CN_IDX_PROC;
+	if (bind(follow_socket, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+		err(1, "follow: unable to bind to the proc connector");
+
+	if (setsockopt(follow_socket, SOL_SOCKET, SO_RCVBUF, &size,
+				sizeof(size)) == -1)
+		debug("follow: unable to grow the socket buffer\n");
+
+	memset(buf, 0, sizeof(buf));
+	nlh = (struct nlmsghdr *)buf;
+	nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(op));
+	nlh->nlmsg_type = NLMSG_DONE;
+	msg = NLMSG_DATA(nlh);
+	msg->id.idx = CN_IDX_PROC;
+	msg->id.val = CN_VAL_PROC;
+	msg->len = sizeof(op);
+	memcpy(msg->data, &op, sizeof(op));
+
+	if (send(follow_socket, nlh, nlh->nlmsg_len, 0) == -1)
+		err(1, "follow: unable to listen to the proc connector");
+
+	ret = pthread_create(&thread, NULL, _follow_run, NULL);
+	if (ret != 0) {
+		errno = ret;
+		err(1, "pthread_create");
+	}
+
+	debug("follow: following the children of %d\n", postmaster);
+}
+
+
+/*
+ * Call the provided function for every process to attach since the last
+ * call. With 'wait', block until there is at least one or until interrupted,
+ * the signal handler can't wake us up, the flag is checked every
+ * FOLLOW_WAIT_INTERVAL. The idle handler of trace.c is called meanwhile.
+ */
+void
+follow_read_pids(void (*func_handler)(pid_t), int wait)
+{
+	struct timespec ts;
+	pid_t *swap;
+	int i, count, size;
+
+	pthread_mutex_lock(&follow_mutex);
+	while (wait && follow_ready_count == 0 && !trace_interrupted) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += FOLLOW_WAIT_INTERVAL * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&follow_cond, &follow_mutex, &ts);
+
+		pthread_mutex_unlock(&follow_mutex);
+		trace_idle();
+		pthread_mutex_lock(&follow_mutex);
+	}
+
+	swap = follow_taken;
+	size = follow_taken_size;
+	follow_taken = follow_ready;
+	follow_taken_size = follow_ready_size;
+	follow_ready = swap;
+	follow_ready_size = size;
+	count = follow_ready_count;
+	follow_ready_count = 0;
+	pthread_mutex_unlock(&follow_mutex);
+
+	for (i = 0; i < count; i++)
+		func_handler(follow_taken[i]);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * How often the titles of the new processes are read, and the tracing thread
+ * woken up again until it took the ones to attach, in milliseconds.
+ */
+#define FOLLOW_INTERVAL		1
+
+/*
+ * Stop waiting for a new process to tell what it does after this long, in
+ * seconds. It is then matched with whatever its title is.
+ */
+#define FOLLOW_TIMEOUT		1.0
+
+/*
+ * How often a tracing thread waiting for new processes checks whether it was
+ * interrupted, in milliseconds.
+ */
+#define FOLLOW_WAIT_INTERVAL	100
+
+/*
+ * Sent to the tracing thread to interrupt its waitpid() when there are
+ * processes to attach.
+ */
+#define FOLLOW_WAKEUP_SIGNAL	SIGUSR2
+
+/* Size of the receive buffer of the socket, bursts of forks queue there. */
+#define FOLLOW_SOCKET_BUFFER	(1024 * 1024)
+
+/* Minimum growth of the lists of processes. */
+#define FOLLOW_GROWTH		16
+
+
+void		 follow_start(pid_t, discover_filter *);
+void		 follow_read_pids(void (*func)(pid_t), int);
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * Log-linear histograms, used to keep the distribution of the durations of
+ * the system calls without keeping every one of them.
+ *
+ * The small values (under HIST_SUB_COUNT) have a bucket each, the others are
+ * split by power of two and then linearly by their HIST_SUB_BITS bits below
+ * the highest. A bucket is found with a count of leading zeros and a shift,
+ * the relative error is the same for every value.
+ */
+
+#include <sys/param.h>
+
+#include <stdio.h>
+
+#include <postgres.h>
+
+#include "hist.h"
+
+
+/*
+ * Bucket of a value, see above.
+ */
+static inline int
+_hist_get_index(uint64 value)
+{
+	int exponent;
+
+	if (value < HIST_SUB_COUNT)
+		return (int)value;
+
+	exponent = 63 - __builtin_clzll(value);
+
+	return (exponent - HIST_SUB_BITS + 1) * HIST_SUB_COUNT +
+		(int)((value >> (exponent - HIST_SUB_BITS)) &
+				(HIST_SUB_COUNT - 1));
+}
+
+
+/*
+ * Middle of the range of values of a bucket.
+ */
+uint64
+_hist_get_value(int index)
+{
+	int block, exponent;
+	uint64 sub;
+
+	if (index < HIST_SUB_COUNT)
+		return (uint64)index;
+
+	block = index / HIST_SUB_COUNT;
+	sub = index % HIST_SUB_COUNT;
+	exponent = block + HIST_SUB_BITS - 1;
+
+	return ((HIST_SUB_COUNT + sub) << (exponent - HIST_SUB_BITS)) +
+		((uint64)1 << (exponent - HIST_SUB_BITS)) / 2;
+}
+
+
+/*
+ * Count a value.
+ */
+void
+hist_add(hist *h, uint64 value)
+{
+	if (value > h->max)
+		h->max = value;
+
+	if (value >= (uint64)1 << HIST_MAX_BITS)
+		value = ((uint64)1 << HIST_MAX_BITS) - 1;
+
+	h->buckets[_hist_get_index(value)]++;
+	h->count++;
+}
+
+
+/*
+ * Add all the values of 'src' to 'dst'.
+ */
+void
+hist_merge(hist *dst, hist *src)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+
+	dst->count += src->count;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+
+/*
+ * Returns the value under which 'percentile' (0 to 100) of the values fall,
+ * within the precision of a bucket and never more than the maximum. Returns
+ * 0 for an empty histogram.
+ */
+uint64
+hist_get_percentile(hist *h, double percentile)
+{
+	uint64 target, seen = 0, value;
+	int i;
+
+	if (h->count == 0)
+		return 0;
+
+	target = (uint64)(percentile / 100.0 * h->count + 0.5);
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= target)
+			break;
+	}
+
+	value = _hist_get_value(MIN(i, HIST_BUCKETS - 1));
+
+	return MIN(value, h->max);
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Each power of two is split in 2^HIST_SUB_BITS linear buckets, the values are
+ * known within 1/16th (about 6%). The values under 2^HIST_MAX_BITS are
+ * counted, the larger ones in the last bucket: with nanoseconds, that is
+ * about 18 minutes.
+ */
+#define HIST_SUB_BITS		4
+#define HIST_SUB_COUNT		(1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS		40
+#define HIST_BUCKETS		((HIST_MAX_BITS - HIST_SUB_BITS + 1) * \
+					HIST_SUB_COUNT)
+
+
+/*
+ * Log-linear histogram (HDR-style) of a distribution of values, with the
+ * exact maximum.
+ */
+typedef struct _hist {
+	uint64		 count;
+	uint64		 max;
+	uint32		 buckets[HIST_BUCKETS];
+} hist;
+
+
+void		 hist_add(hist *, uint64);
+void		 hist_merge(hist *, hist *);
+uint64		 hist_get_percentile(hist *, double);
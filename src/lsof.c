@@ -20,6 +20,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <err.h>
@@ -69,8 +70,9 @@ lsof_open(pid_t pid)
 		if (close(pipe_r) == -1)
 			err(1, "lsof_open:close(pipe_r)");
 		if (execl(lsof_path, "lsof",
-					"-Faftn",	/* parser-friendly see
+					"-Faftno",	/* parser-friendly see
 							   lsof(8) */
+					"-o",		/* always the offset */
 					"-p", cpid,	/* target pid */
 					(char*)NULL) == -1)
 			err(1, "lsof_open:execl()");
@@ -114,20 +116,16 @@ lsof_read_lines(int fd)
 		if (type == 'f') {
 			fd_field = xatoi_or_zero(c);
 
-			/* Not a numeric file descriptor, ignore it. */
+			/*
+			 * Not a numeric file descriptor, ignore it and its
+			 * fields.
+			 */
 			if (fd_field == 0) {
+				current = NULL;
 				continue;
 			}
 
-			/* 
-			 * Before we move on to the next file descriptor, make
-			 * sure the previous one is valid.
-			 */
-			if (current == NULL || (current->fd_type == FD_TYPE_REG
-						&& current->filepath != NULL)) {
-				current = pfd_cache_next();
-			}
-
+			current = pfd_cache_slot(fd_field);
 			pfd_clean(current);
 			current->fd = fd_field;
 		}
@@ -168,6 +166,13 @@ lsof_read_lines(int fd)
 				current->fd_type = FD_TYPE_UNKNOWN;
 			}
 			break;
+		/* file offset, 0t is decimal, 0x hexadecimal */
+		case 'o':
+			if (strncmp(c, "0t", 2) == 0)
+				current->offset = strtoll(c + 2, NULL, 10);
+			else if (strncmp(c, "0x", 2) == 0)
+				current->offset = strtoll(c + 2, NULL, 16);
+			break;
 		/* file name */
 		case 'n':
 			current->filepath = xstrdup(c);
@@ -20,7 +20,9 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
+#include <errno.h>
 #include <err.h>
 
 #include <postgres.h>
@@ -28,6 +30,28 @@
 #include "pfd.h"
 #include "pfd_cache.h"
 #include "trace.h"
+#include "dispatch.h"
+#include "reltab.h"
+#include "relstat.h"
+#include "progress.h"
+#include "hist.h"
+#include "summary.h"
+#include "context.h"
+#ifdef HAVE_CURSES
+#include "top.h"
+#endif
+#ifdef HAVE_PTRACE
+#include "ptrace.h"
+#endif
+#ifdef HAVE_TRACEFS
+#include "tracefs.h"
+#endif
+#ifdef HAVE_PROCFS
+#include "discover.h"
+#include "follow.h"
+#include "proc.h"
+#include "sample.h"
+#endif
 #include "lsof.h"
 #include "ps.h"
 #include "utils.h"
@@ -35,15 +59,30 @@
 #include "pg.h"
 
 
+/*
+ * Without a native tracer, strace (or dtruss) is all we have.
+ */
+#ifdef HAVE_PTRACE
+#define DEFAULT_BACKEND		"ptrace"
+#else
+#define DEFAULT_BACKEND		"strace"
+#endif
+
+
 #define _DEBUG_FLAG
 int debug_flag = 0;
 int show_strace = 1;
-char *pwd = NULL;
+int show_calls = 1;
 extern char *current_cluster_path;
+extern context *current_context;
+extern int context_count;
+extern enum trace_policy trace_policy;
+extern volatile sig_atomic_t trace_interrupted;
 
 
 /*
- * Get human-readable file descriptor, if possible.
+ * Get human-readable file descriptor, if possible. The string is allocated,
+ * it is for the caller to free.
  */
 char *
 get_human_fd(int fd)
@@ -52,49 +91,263 @@ get_human_fd(int fd)
 
 	pfd = pfd_cache_get(fd);
 
+	/* Not resolved when opened, the relation may be newer than our copy
+	 * of pg_class. */
+	if (pfd->relname == NULL && pfd->filenode != InvalidOid)
+		pfd_update_from_pg(pfd);
+
 	return pfd_get_repr(pfd);
 }
 
 
 /*
- * Take any function with the file descriptor as first argument.
+ * Convert the textual whence argument of lseek (as printed by strace) back to
+ * its numeric value, -1 if unknown.
+ */
+int
+whence_from_name(char *name)
+{
+	if (name == NULL)
+		return -1;
+	if (strcmp(name, "SEEK_SET") == 0)
+		return SEEK_SET;
+	if (strcmp(name, "SEEK_CUR") == 0)
+		return SEEK_CUR;
+	if (strcmp(name, "SEEK_END") == 0)
+		return SEEK_END;
+
+	return xatoi_or_zero(name);
+}
+
+
+/*
+ * Return the name of a whence value, for display purpose.
+ */
+char *
+whence_get_name(int whence)
+{
+	switch (whence) {
+	case SEEK_SET:
+		return "SEEK_SET";
+	case SEEK_CUR:
+		return "SEEK_CUR";
+	case SEEK_END:
+		return "SEEK_END";
+	default:
+		return "?";
+	}
+}
+
+
+/*
+ * Convert the textual directory argument of the *at() functions back to a file
+ * descriptor.
+ */
+int
+dirfd_from_name(char *name)
+{
+	if (strcmp(name, "AT_FDCWD") == 0)
+		return AT_FDCWD;
+
+	return xatoi(name);
+}
+
+
+/*
+ * Convert the textual command of fcntl back to its numeric value, only the
+ * ones duplicating a file descriptor are of any interest, -1 for the others.
+ */
+int
+fcntl_cmd_from_name(char *name)
+{
+	if (strcmp(name, "F_DUPFD") == 0)
+		return F_DUPFD;
+	if (strcmp(name, "F_DUPFD_CLOEXEC") == 0)
+		return F_DUPFD_CLOEXEC;
+
+	return -1;
+}
+
+
+/*
+ * With several processes traced, tell which one made the call.
  */
 void
-process_fd_func(char *func_name, int argc, char **argv, char *result)
+print_prefix(trace_event *ev)
 {
-	int fd;
-	char *human_fd, *size;
+	if (context_count > 1)
+		printf("[pid %d] ", (int)ev->pid);
+}
+
+
+/*
+ * Turn a read or a write of 'size' bytes at 'offset' into the blocks of the
+ * relation it touched, count it and follow the progress of the reads.
+ */
+void
+account_io(trace_event *ev, pfd_t *pfd, off_t offset, long size)
+{
+	pfd_io io;
+	bool write;
+
+	if (pfd_get_io(pfd, offset, size, &io) == -1)
+		return;
+
+	if (pfd->relname == NULL)
+		pfd_update_from_pg(pfd);
+
+	write = ev->func == TRACE_FUNC_WRITE ||
+		ev->func == TRACE_FUNC_PWRITE ||
+		ev->func == TRACE_FUNC_PWRITEV;
+
+	relstat_add(&io, write);
+	if (!write)
+		progress_read(pfd, ev->pid, offset, size);
+
+	debug("io: %s filenode=%u fork=%d blocks=%u-%u\n", ev->func_name,
+			pfd->filenode, pfd->file_type, io.first_block,
+			io.first_block + io.nblocks - 1);
+}
+
+
+/*
+ * Take any function with the file descriptor as first argument and the size
+ * as third (read, write). They start at the current file position and move it
+ * by the number of bytes transferred.
+ */
+void
+handle_fd_func(trace_event *ev)
+{
+	char *human_fd;
+	pfd_t *pfd;
+	int fd = (int)ev->args[0];
+
+	pfd = pfd_cache_get(fd);
+
+	if (ev->func == TRACE_FUNC_WRITE)
+		pfd_notify_write(pfd);
+
+	account_io(ev, pfd, pfd->offset, ev->result);
+	pfd_advance(pfd, ev->result);
+
+	if (!show_calls)
+		return;
+
+	human_fd = get_human_fd(fd);
+
+	print_prefix(ev);
+	printf("%s(%s, %ld)\n", ev->func_name, human_fd, ev->args[2]);
+	xfree(human_fd);
+}
+
+
+/*
+ * Handle the positional reads and writes (pread64, pwrite64, preadv, pwritev
+ * and their v2 variant), the offset is the fourth argument and the file
+ * position doesn't move. The iovecs of the vectored variants are not decoded,
+ * their size is the number of bytes transferred.
+ */
+void
+handle_pio(trace_event *ev)
+{
+	char *human_fd;
+	pfd_t *pfd;
+	int fd = (int)ev->args[0];
+	long size = ev->args[2];
+
+	pfd = pfd_cache_get(fd);
+
+	if (ev->func == TRACE_FUNC_PWRITE || ev->func == TRACE_FUNC_PWRITEV)
+		pfd_notify_write(pfd);
+
+	if (ev->func == TRACE_FUNC_PREADV || ev->func == TRACE_FUNC_PWRITEV)
+		size = ev->result;
+
+	account_io(ev, pfd, ev->args[3], ev->result);
+
+	if (!show_calls)
+		return;
 
-	fd = xatoi(argv[0]);
-	size = argv[2];
 	human_fd = get_human_fd(fd);
 
-	printf("%s(%s, %s)\n", func_name, human_fd, size);
+	print_prefix(ev);
+	printf("%s(%s, %ld, %ld)\n", ev->func_name, human_fd, size,
+			ev->args[3]);
+	xfree(human_fd);
+}
+
+
+/*
+ * Take any function with the file descriptor as only argument (fsync,
+ * fdatasync).
+ */
+void
+handle_sync(trace_event *ev)
+{
+	char *human_fd;
+
+	if (!show_calls)
+		return;
+
+	human_fd = get_human_fd((int)ev->args[0]);
+	print_prefix(ev);
+	printf("%s(%s)\n", ev->func_name, human_fd);
+	xfree(human_fd);
 }
 
 
 /*
- * Take any function with the file descriptor as first argument.
+ * Handle an 'ftruncate' call, shrinking pg_class is a write as far as our copy
+ * is concerned.
  */
 void
-process_func_seek(int argc, char **argv, char *result)
+handle_ftruncate(trace_event *ev)
 {
-	int fd;
-	char *human_fd, *offset, *whence;
+	char *human_fd;
+	int fd = (int)ev->args[0];
 
-	fd = xatoi(argv[0]);
-	offset = argv[1];
-	whence = argv[2];
+	pfd_notify_write(pfd_cache_get(fd));
+
+	if (!show_calls)
+		return;
 
 	human_fd = get_human_fd(fd);
-	printf("lseek(%s, %s, %s)\n", human_fd, offset, whence);
+	print_prefix(ev);
+	printf("ftruncate(%s, %ld)\n", human_fd, ev->args[1]);
+	xfree(human_fd);
+}
+
+
+/*
+ * Handle an 'lseek' call.
+ */
+void
+handle_seek(trace_event *ev)
+{
+	char *human_fd;
+	int fd = (int)ev->args[0];
+
+	pfd_seek(pfd_cache_get(fd), ev->result);
+
+	/* Postgres gets the size of the segments this way. */
+	if (ev->args[1] == 0 && ev->args[2] == SEEK_END)
+		progress_probe(pfd_cache_get(fd), ev->result);
+
+	if (!show_calls)
+		return;
+
+	human_fd = get_human_fd(fd);
+	print_prefix(ev);
+	printf("lseek(%s, %ld, %s)\n", human_fd, ev->args[1],
+			whence_get_name((int)ev->args[2]));
+	xfree(human_fd);
 }
 
 
 /*
  * Attempt to produce an absolute path if a relative path is given. Using the
- * 'pwd' global variable set in main, if 'pwd' couldn't get populated, take a
- * chance and use the cluster path.
+ * working directory of the current process, if it couldn't get populated, take
+ * a chance and use the cluster path.
  */
 char *
 resolve_path(char *path)
@@ -107,8 +360,9 @@ resolve_path(char *path)
 	if (path[0] == '/')
 		return xstrdup(path);
 
-	if (pwd != NULL) {
-		snprintf(buffer, sizeof(buffer), "%s/%s", pwd, path);
+	if (current_context->pwd != NULL) {
+		snprintf(buffer, sizeof(buffer), "%s/%s",
+				current_context->pwd, path);
 	} else if (current_cluster_path != NULL) {
 		snprintf(buffer, sizeof(buffer), "%s/%s", current_cluster_path,
 				path);
@@ -124,105 +378,565 @@ resolve_path(char *path)
  * Handle an 'open' call, update the pfd_cache accordingly.
  */
 void
-process_func_open(int argc, char **argv, char *result)
+handle_open(trace_event *ev)
 {
-	int fd;
 	char *path;
 
-	if (argc != 2 && argc != 3)
-		errx(1, "error: open() with %u args", argc);
+	path = resolve_path(ev->path);
 
-	path = resolve_path(argv[0]);
+	if (ev->result >= 0)
+		pfd_cache_add((int)ev->result, path);
 
-	if (result != NULL) {
-		fd = xatoi(result);
-		pfd_cache_add(fd, path);
+	if (show_calls) {
+		print_prefix(ev);
+		printf("%s(%s, ...) -> fd:%ld\n", ev->func_name, path,
+				ev->result);
 	}
 
-	printf("open(%s, ...) -> fd:%s\n", path, result);
-
 	if (path != NULL)
 		xfree(path);
 }
 
 
+/*
+ * Handle an 'openat' call, a relative path is relative to the directory
+ * argument unless it is AT_FDCWD.
+ */
+void
+handle_openat(trace_event *ev)
+{
+	trace_event open_ev = *ev;
+	char buffer[MAXPATHLEN];
+	pfd_t *dir;
+	int dirfd = (int)ev->args[0];
+
+	if (ev->path != NULL && ev->path[0] != '/' && dirfd != AT_FDCWD) {
+		dir = pfd_cache_get(dirfd);
+		if (dir->filepath != NULL) {
+			snprintf(buffer, sizeof(buffer), "%s/%s", dir->filepath,
+					ev->path);
+			open_ev.path = buffer;
+		}
+	}
+
+	handle_open(&open_ev);
+}
+
+
 /*
  * Handle a 'close' call, delete this fd from pfd_cache.
  */
 void
-process_func_close(int argc, char **argv, char *result)
+handle_close(trace_event *ev)
 {
-	int fd;
 	char *human_fd;
+	int fd = (int)ev->args[0];
+
+	if (show_calls) {
+		human_fd = get_human_fd(fd);
+		print_prefix(ev);
+		printf("close(%s)\n", human_fd);
+		xfree(human_fd);
+	}
 
-	if (argc != 1)
-		errx(1, "error: close() with %u args", argc);
+	pfd_cache_delete(fd);
+}
 
-	fd = xatoi(argv[0]);
+
+/*
+ * Handle dup(), dup2() and dup3(), the new file descriptor (the result) points
+ * to the same file as the first argument.
+ */
+void
+handle_dup(trace_event *ev)
+{
+	char *human_fd;
+	int fd = (int)ev->args[0];
+
+	if (ev->result >= 0)
+		pfd_cache_dup(fd, (int)ev->result);
+
+	if (!show_calls)
+		return;
 
 	human_fd = get_human_fd(fd);
-	printf("close(%s)\n", human_fd);
+	print_prefix(ev);
+	printf("%s(%s) -> fd:%ld\n", ev->func_name, human_fd, ev->result);
+	xfree(human_fd);
+}
 
-	pfd_cache_delete(fd);
+
+/*
+ * Everything else is printed as-is when it comes from strace. The native
+ * tracers only give us a number and the raw arguments.
+ */
+void
+handle_other(trace_event *ev)
+{
+	if (!show_strace)
+		return;
+
+	print_prefix(ev);
+
+	if (ev->line != NULL) {
+		trace_line_restore(ev->line);
+		fwrite(ev->line->raw, 1, ev->line->len, stdout);
+		return;
+	}
+
+	printf("syscall_%ld(0x%lx, 0x%lx, 0x%lx) = %ld\n", ev->nr,
+			ev->args[0], ev->args[1], ev->args[2], ev->result);
 }
 
 
 /*
- * Check if we have a handler for this function and run it.
+ * Only the fcntl commands duplicating a file descriptor change what we know,
+ * the others are printed as-is.
+ */
+void
+handle_fcntl(trace_event *ev)
+{
+	if (ev->args[1] == F_DUPFD || ev->args[1] == F_DUPFD_CLOEXEC)
+		handle_dup(ev);
+	else
+		handle_other(ev);
+}
+
+
+/*
+ * Convert the textual return value of a function to a number, strace follows
+ * errors with their name (e.g. "-1 ENOENT (No such file or directory)").
+ */
+long
+result_from_text(char *result)
+{
+	if (result == NULL)
+		return -1;
+
+	return strtol(result, NULL, 10);
+}
+
+
+/*
+ * Convert the time spent in a function, in seconds, to nanoseconds. Returns
+ * -1 if strace didn't give it to us.
+ */
+long
+duration_from_text(char *duration)
+{
+	if (duration == NULL)
+		return -1;
+
+	return (long)(strtod(duration, NULL) * 1e9);
+}
+
+
+/*
+ * Switch to the context of the process that made the call before passing it to
+ * its handlers, a process we didn't know about gets a new context.
+ */
+void
+process_event(trace_event *ev)
+{
+	context *c;
+
+	c = context_get(ev->pid);
+	if (c == NULL)
+		context_add(ev->pid);
+	else
+		context_switch(c);
+
+	dispatch_event(ev);
+}
+
+
+/*
+ * Forget about a process that is gone.
+ */
+void
+process_exit(pid_t pid)
+{
+	context_remove(pid);
+}
+
+
+/*
+ * Turn a line of strace into a trace_event and pass it to its handlers. Only
+ * the arguments of the functions we handle are decoded, the others are
+ * printed as-is from the line.
+ */
+void
+process_func(pid_t pid, trace_line *tl)
+{
+	trace_event ev;
+	char **argv = tl->argv;
+	int argc = tl->argc;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.pid = pid;
+	ev.func = dispatch_lookup(tl->func_name);
+	ev.func_name = tl->func_name;
+	ev.nr = -1;
+	ev.result = result_from_text(tl->result);
+	ev.duration = duration_from_text(tl->duration);
+	ev.line = tl;
+
+	switch (ev.func) {
+	case TRACE_FUNC_READ:
+	case TRACE_FUNC_WRITE:
+		ev.args[0] = xatoi(argv[0]);
+		ev.args[2] = strtol(argv[2], NULL, 10);
+		break;
+	case TRACE_FUNC_OPEN:
+		if (argc != 2 && argc != 3)
+			errx(1, "error: open() with %u args", argc);
+		ev.path = argv[0];
+		break;
+	case TRACE_FUNC_CLOSE:
+		if (argc != 1)
+			errx(1, "error: close() with %u args", argc);
+		ev.args[0] = xatoi(argv[0]);
+		break;
+	case TRACE_FUNC_LSEEK:
+		ev.args[0] = xatoi(argv[0]);
+		ev.args[1] = strtol(argv[1], NULL, 10);
+		ev.args[2] = whence_from_name(argv[2]);
+		break;
+	case TRACE_FUNC_OPENAT:
+		if (argc != 3 && argc != 4)
+			errx(1, "error: openat() with %u args", argc);
+		ev.args[0] = dirfd_from_name(argv[0]);
+		ev.path = argv[1];
+		break;
+	case TRACE_FUNC_PREAD:
+	case TRACE_FUNC_PWRITE:
+	case TRACE_FUNC_PREADV:
+	case TRACE_FUNC_PWRITEV:
+		if (argc != 4 && argc != 5)
+			errx(1, "error: %s() with %u args", ev.func_name, argc);
+		ev.args[0] = xatoi(argv[0]);
+		ev.args[2] = strtol(argv[2], NULL, 10);
+		ev.args[3] = strtol(argv[3], NULL, 10);
+		break;
+	case TRACE_FUNC_FSYNC:
+	case TRACE_FUNC_FDATASYNC:
+	case TRACE_FUNC_DUP:
+		if (argc != 1)
+			errx(1, "error: %s() with %u args", ev.func_name, argc);
+		ev.args[0] = xatoi(argv[0]);
+		break;
+	case TRACE_FUNC_FTRUNCATE:
+	case TRACE_FUNC_DUP2:
+	case TRACE_FUNC_DUP3:
+		if (argc < 2)
+			errx(1, "error: %s() with %u args", ev.func_name, argc);
+		ev.args[0] = xatoi(argv[0]);
+		ev.args[1] = strtol(argv[1], NULL, 10);
+		break;
+	case TRACE_FUNC_FCNTL:
+		if (argc < 2)
+			errx(1, "error: fcntl() with %u args", argc);
+		ev.args[0] = xatoi(argv[0]);
+		ev.args[1] = fcntl_cmd_from_name(argv[1]);
+		break;
+	default:
+		break;
+	}
+
+	process_event(&ev);
+}
+
+
+#ifdef HAVE_PROCFS
+/* Which processes of the cluster to trace (-D). */
+discover_filter process_filter;
+
+
+/*
+ * Find the processes of the cluster matching the filters, add their pids to
+ * 'pids'. With 'list_only' they are only shown.
  *
- * If we no handler is found for this function call, we simply print the line
- * as-is.
+ * Returns the new number of pids.
+ */
+int
+select_processes(pid_t postmaster, int list_only, pid_t **pids, int pid_count)
+{
+	discover_process *list, *dp;
+	int count;
+
+	count = discover_children(postmaster, &list);
+
+	for (dp = list; dp < list + count; dp++) {
+		if (!discover_match(dp, &process_filter))
+			continue;
+
+		if (list_only) {
+			printf("%7d  %-19s  %s\n", (int)dp->pid,
+					discover_role_name(dp->role), dp->title);
+			continue;
+		}
+
+		debug("discover: tracing %d (%s)\n", (int)dp->pid,
+				discover_role_name(dp->role));
+		*pids = xrealloc(*pids, pid_count + 1, sizeof(pid_t));
+		(*pids)[pid_count++] = dp->pid;
+	}
+
+	return pid_count;
+}
+#endif
+
+
+/*
+ * Create the context of a traced process, with its current file descriptors
+ * and working directory. With /proc nothing is forked, without it we need
+ * lsof and ps.
+ *
+ * Returns -1 if the process is already gone, it has no context.
+ */
+int
+load_context(pid_t pid)
+{
+	context_add(pid);
+#ifdef HAVE_PROCFS
+	if (pfd_cache_preload_from_proc(pid) == -1 ||
+			(current_context->pwd = proc_get_cwd(pid)) == NULL) {
+		if (errno != ENOENT && errno != ESRCH)
+			err(1, "unable to inspect pid %d", pid);
+		warnx("pid %d exited, skipping it", pid);
+		context_remove(pid);
+		return -1;
+	}
+#else
+	pfd_cache_preload_from_lsof(pid);
+	current_context->pwd = ps_get_pwd(pid);
+#endif
+
+	return 0;
+}
+
+
+/*
+ * Drop the process at 'i' from the list, keeping the order.
+ */
+int
+drop_process(pid_t *pids, int pid_count, int i)
+{
+	memmove(pids + i, pids + i + 1, (pid_count - i - 1) * sizeof(pid_t));
+
+	return pid_count - 1;
+}
+
+
+/*
+ * Create the contexts of the processes we start with, the ones gone already
+ * are dropped from the list. Returns the number of processes left.
+ */
+int
+load_contexts(pid_t *pids, int pid_count)
+{
+	int i = 0;
+
+#ifndef HAVE_PROCFS
+	ps_resolve_path();
+	lsof_resolve_path();
+#endif
+
+	while (i < pid_count) {
+		if (load_context(pids[i]) == -1)
+			pid_count = drop_process(pids, pid_count, i);
+		else
+			i++;
+	}
+
+	return pid_count;
+}
+
+
+#ifdef HAVE_PTRACE
+/*
+ * Attach to the processes we start with from 'first' on, the ones that
+ * exited since we found them are dropped from the list. Returns the number
+ * of processes left.
+ */
+int
+attach_processes(pid_t *pids, int pid_count, int first)
+{
+	int i = first;
+
+	while (i < pid_count) {
+		if (ptrace_attach(pids[i]) == 0) {
+			i++;
+			continue;
+		}
+		if (errno != ESRCH)
+			err(1, "unable to ptrace pid %d", pids[i]);
+		warnx("pid %d exited, skipping it", pids[i]);
+		pid_count = drop_process(pids, pid_count, i);
+	}
+
+	return pid_count;
+}
+#endif
+
+
+#if defined(HAVE_PROCFS) && defined(HAVE_PTRACE)
+/*
+ * Attach to a new process found by the follower (-f), it could be gone
+ * already. Once attached it is stopped, its descriptors can be read.
  */
 void
-process_func(char *line, char *func_name, int argc, char **argv, char *result)
-{
-	if (strcmp(func_name, "read") == 0) {
-		process_fd_func(func_name, argc, argv, result);
-	} else if (strcmp(func_name, "write") == 0) {
-		process_fd_func(func_name, argc, argv, result);
-	} else if (strcmp(func_name, "open") == 0) {
-		process_func_open(argc, argv, result);
-	} else if (strcmp(func_name, "close") == 0) {
-		process_func_close(argc, argv, result);
-	} else if (strcmp(func_name, "lseek") == 0) {
-		process_func_seek(argc, argv, result);
-	} else if (show_strace) {
-		printf("%s", line);
+attach_process(pid_t pid)
+{
+	if (ptrace_attach(pid) == -1) {
+		debug("follow: unable to attach to %d\n", pid);
+		return;
 	}
+
+	/* Its exit is reported by waitpid(), like any tracee. */
+	load_context(pid);
+}
+
+
+/*
+ * Wait handler of ptrace_read_events(), attach to the new processes.
+ */
+void
+process_wait(int block)
+{
+	follow_read_pids(attach_process, block);
 }
+#endif
 
 
 void
 usage()
 {
-	fprintf(stderr, "usage: pg_trace [-h] [-d] [-p pid]\n");
+	fprintf(stderr, "usage: pg_trace [-h] [-d] [-n] [-t] [-c] [-l] [-f] "
+			"[-i interval] [-b backend] [-O policy]\n"
+			"                [-s interval] [-D datadir [-r role,...] "
+			"[-U user] [-N database]\n"
+			"                [-T title]] [-p pid ...]\n");
 	exit(1);
 }
 
 
+/*
+ * SIGINT and SIGTERM only raise a flag, the event loops return when they see
+ * it and the atexit() handlers (tracefs, top, summary) run once we're out of
+ * them. A second one doesn't wait.
+ */
 void
 sigint_handler(int sig)
 {
+	if (trace_interrupted)
+		_exit(1);
+
+	trace_interrupted = 1;
+}
+
+
+/*
+ * Exit status once tracing is over.
+ */
+int
+exit_status(void)
+{
+	if (!trace_interrupted)
+		return 0;
+
 	fprintf(stderr, "Interrupted\n");
-	exit(1);
+
+	return 1;
 }
 
 
 int
 main(int argc, char **argv)
 {
-	int fd, opt;
+	struct sigaction sa;
+	int i, opt;
 	extern char *optarg;
-	pid_t pid = 0;
+	pid_t *pids = NULL;
+	int pid_count = 0;
+	char *backend = NULL;
+	char *datadir = NULL, *roles = NULL, *user = NULL, *database = NULL;
+	char *title = NULL;
+	int list_only = 0, follow = 0;
+#ifdef HAVE_PROCFS
+	pid_t postmaster;
+#endif
+	int sample_interval = 0, top_mode = 0;
+	int summary_mode = 0, summary_interval = 0;
+	enum trace_func func;
 
-	while ((opt = getopt(argc, argv, "p:ndh")) != -1) {
+	while ((opt = getopt(argc, argv, "b:p:s:i:O:D:r:U:N:T:lfntcdh")) != -1) {
 		switch (opt) {
+		case 'b':
+			backend = optarg;
+			break;
+		case 'D':
+			datadir = optarg;
+			break;
+		case 'r':
+			roles = optarg;
+			break;
+		case 'U':
+			user = optarg;
+			break;
+		case 'N':
+			database = optarg;
+			break;
+		case 'T':
+			title = optarg;
+			break;
+		case 'l':
+			list_only = 1;
+			break;
+		case 'f':
+			follow = 1;
+			break;
 		case 'p':
-			pid = xatoi(optarg);
+			pids = xrealloc(pids, pid_count + 1, sizeof(pid_t));
+			pids[pid_count++] = xatoi(optarg);
+			break;
+		case 'O':
+			if (strcmp(optarg, "block") == 0)
+				trace_policy = TRACE_POLICY_BLOCK;
+			else if (strcmp(optarg, "drop") == 0)
+				trace_policy = TRACE_POLICY_DROP;
+			else if (strcmp(optarg, "sample") == 0)
+				trace_policy = TRACE_POLICY_SAMPLE;
+			else
+				errx(1, "unknown overload policy: %s", optarg);
 			break;
 		case 'n':
 			show_strace = 0;
 			break;
+		case 't':
+#ifdef HAVE_CURSES
+			top_mode = 1;
+			show_strace = 0;
+			show_calls = 0;
+#else
+			errx(1, "top mode requires curses");
+#endif
+			break;
+		case 'c':
+			summary_mode = 1;
+			show_strace = 0;
+			show_calls = 0;
+			break;
+		case 'i':
+			summary_interval = xatoi(optarg);
+			if (summary_interval <= 0)
+				errx(1, "invalid summary interval: %s", optarg);
+			break;
+		case 's':
+			sample_interval = xatoi(optarg);
+			if (sample_interval <= 0)
+				errx(1, "invalid sampling interval: %s", optarg);
+			break;
 		case 'd':
 			debug_flag = 1;
 			break;
@@ -232,30 +946,200 @@ main(int argc, char **argv)
 		}
 	}
 
-	signal(SIGINT, sigint_handler);
+	if (summary_interval > 0 && !summary_mode)
+		errx(1, "-i requires -c");
+
+	if (datadir == NULL && (roles != NULL || user != NULL ||
+				database != NULL || title != NULL || list_only ||
+				follow))
+		errx(1, "-r, -U, -N, -T, -l and -f require -D");
+	if (datadir != NULL && pid_count > 0)
+		errx(1, "-D and -p are mutually exclusive");
+	if (follow) {
+		if (list_only)
+			errx(1, "-f and -l are mutually exclusive");
+		if (sample_interval > 0)
+			errx(1, "-f and -s are mutually exclusive");
+		if (backend != NULL && strcmp(backend, "ptrace") != 0)
+			errx(1, "-f requires the ptrace backend");
+	}
+
+	/* Listing the processes doesn't need to be root. */
+	if (datadir != NULL) {
+#ifdef HAVE_PROCFS
+		process_filter.user = user;
+		process_filter.database = database;
+		process_filter.title = title;
+		if (roles != NULL)
+			discover_parse_roles(&process_filter, roles);
+
+		postmaster = discover_postmaster(datadir);
+
+		/*
+		 * Listen to the forks before looking for the current children,
+		 * none can fall in between.
+		 */
+		if (follow) {
+			if (geteuid() != 0)
+				errx(1, "you need to be root");
+#ifdef HAVE_PTRACE
+			follow_start(postmaster, &process_filter);
+#else
+			errx(1, "-f requires the ptrace backend");
+#endif
+		}
+
+		pid_count = select_processes(postmaster, list_only, &pids,
+				pid_count);
+		if (list_only)
+			return 0;
+		if (pid_count == 0 && !follow)
+			errx(1, "no process of %s matches", datadir);
+#else
+		errx(1, "discovery requires /proc");
+#endif
+	}
+
+	/* No SA_RESTART, a blocking call of an event loop has to return. */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigint_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/*
+	 * The summary needs to see the descriptors before close() forgets them
+	 * and after open() learned about them.
+	 */
+	if (summary_mode)
+		for (func = 0; func < TRACE_FUNC_COUNT; func++)
+			if (func != TRACE_FUNC_OPEN &&
+					func != TRACE_FUNC_OPENAT)
+				dispatch_register(func, summary_event);
+
+	dispatch_register(TRACE_FUNC_READ, handle_fd_func);
+	dispatch_register(TRACE_FUNC_WRITE, handle_fd_func);
+	dispatch_register(TRACE_FUNC_OPEN, handle_open);
+	dispatch_register(TRACE_FUNC_CLOSE, handle_close);
+	dispatch_register(TRACE_FUNC_LSEEK, handle_seek);
+	dispatch_register(TRACE_FUNC_OPENAT, handle_openat);
+	dispatch_register(TRACE_FUNC_PREAD, handle_pio);
+	dispatch_register(TRACE_FUNC_PWRITE, handle_pio);
+	dispatch_register(TRACE_FUNC_PREADV, handle_pio);
+	dispatch_register(TRACE_FUNC_PWRITEV, handle_pio);
+	dispatch_register(TRACE_FUNC_FSYNC, handle_sync);
+	dispatch_register(TRACE_FUNC_FDATASYNC, handle_sync);
+	dispatch_register(TRACE_FUNC_FTRUNCATE, handle_ftruncate);
+	dispatch_register(TRACE_FUNC_DUP, handle_dup);
+	dispatch_register(TRACE_FUNC_DUP2, handle_dup);
+	dispatch_register(TRACE_FUNC_DUP3, handle_dup);
+	dispatch_register(TRACE_FUNC_FCNTL, handle_fcntl);
+	dispatch_register(TRACE_FUNC_OTHER, handle_other);
+
+	if (summary_mode) {
+		dispatch_register(TRACE_FUNC_OPEN, summary_event);
+		dispatch_register(TRACE_FUNC_OPENAT, summary_event);
+	}
 
 	/* Nothing piped to stdin, we'll need tools to obtain data. */
 	if (isatty(STDIN_FILENO)) {
 		if (geteuid() != 0)
 			errx(1, "you need to be root");
 
-		if (pid == 0)
+		if (pid_count == 0 && !follow)
 			usage();
 
-		ps_resolve_path();
-		trace_resolve_path();
-		lsof_resolve_path();
+		if (sample_interval > 0) {
+			if (top_mode)
+				errx(1, "-t and -s are mutually exclusive");
+			if (summary_mode)
+				errx(1, "-c and -s are mutually exclusive");
+			if (pid_count > 1)
+				errx(1, "-s samples a single process");
+#ifdef HAVE_PROCFS
+			sample_run(pids[0], sample_interval);
+			return exit_status();
+#else
+			errx(1, "sampling requires /proc");
+#endif
+		}
+
+		if (backend == NULL)
+			backend = DEFAULT_BACKEND;
+		if (strcmp(backend, "ptrace") != 0 &&
+				strcmp(backend, "tracefs") != 0 &&
+				strcmp(backend, "strace") != 0)
+			errx(1, "unknown backend: %s", backend);
 
-		pfd_cache_preload_from_lsof(pid);
+#ifdef HAVE_CURSES
+		if (top_mode)
+			top_start(pid_count > 0 ? pids[0] : 0, pid_count);
+#endif
+		if (summary_mode)
+			summary_start(summary_interval);
 
-		pwd = ps_get_pwd(pid);
+#ifdef HAVE_PTRACE
+		/*
+		 * Only the first attach can fall back to strace, we can't have
+		 * some processes with one tracer and the others with another.
+		 * The processes are stopped once attached, their descriptors
+		 * can't change while we read them.
+		 */
+		if (strcmp(backend, "ptrace") == 0) {
+#ifdef HAVE_PROCFS
+			if (follow) {
+				pid_count = attach_processes(pids, pid_count,
+						0);
+				pid_count = load_contexts(pids, pid_count);
+				ptrace_read_events(process_event, process_exit,
+						process_wait);
+				return exit_status();
+			}
+#endif
+			if (ptrace_attach(pids[0]) == 0) {
+				pid_count = attach_processes(pids, pid_count,
+						1);
+				pid_count = load_contexts(pids, pid_count);
+				ptrace_read_events(process_event, process_exit,
+						NULL);
+				return exit_status();
+			}
+			warn("unable to ptrace pid %d, falling back to strace",
+					pids[0]);
+		}
+#endif
 
-		fd = trace_open(pid);
-		trace_read_lines(fd, process_func);
-		close(fd);
+		pid_count = load_contexts(pids, pid_count);
+		if (pid_count == 0)
+			errx(1, "no process left to trace");
+
+#ifdef HAVE_TRACEFS
+		if (strcmp(backend, "tracefs") == 0) {
+			if (pid_count > 1)
+				errx(1, "tracefs traces a single process");
+			if (tracefs_open(pids[0]) == -1)
+				err(1, "tracefs is not available");
+			tracefs_read_events(pids[0], process_event);
+			return exit_status();
+		}
+#endif
+
+		trace_resolve_path();
+
+		for (i = 0; i < pid_count; i++)
+			trace_add_source(trace_open(pids[i]), pids[i]);
+		trace_read_lines(process_func, process_exit);
 	} else {
-		trace_read_lines(STDIN_FILENO, process_func);
+		context_add(0);
+#ifdef HAVE_CURSES
+		if (top_mode)
+			top_start(0, 1);
+#endif
+		if (summary_mode)
+			summary_start(summary_interval);
+		trace_add_source(STDIN_FILENO, 0);
+		trace_read_lines(process_func, process_exit);
 	}
 
-	return 0;
+	return exit_status();
 }
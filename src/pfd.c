@@ -31,14 +31,7 @@
 
 
 extern char *current_cluster_path;
-extern Oid current_database_oid;
-
-
-/*
- * Did we do the initial rn_cache population? This can only happen once we know
- * the cluster path and database oid.
- */
-int rn_cache_local_loaded = 0;
+extern int pg_class_loaded;
 
 
 /*
@@ -51,7 +44,11 @@ void
 pfd_clean(pfd_t *pfd)
 {
 	pfd->fd_type = FD_TYPE_INVALID;
+	pfd->file_type = FILE_TYPE_UNKNOWN;
+	pfd->database_oid = InvalidOid;
 	pfd->part = 0;
+	pfd->offset = -1;
+	pfd->progress = 0;
 
 	if (pfd->relname != NULL) {
 		xfree(pfd->relname);
@@ -71,7 +68,6 @@ pfd_clean(pfd_t *pfd)
  * Based on the path, we can figure out:
  *
  *  - current_cluster_path
- *  - current_database_oid
  *  - shared (/global/ path)
  *  - database oid
  *  - file oid
@@ -122,8 +118,8 @@ pfd_update_from_filepath(pfd_t *pfd)
 	return;
 
 parse_database_oid:
-	/* Keep reference to the database Oid. We should always be looking at
-	 * the same database, but just in case. */
+	/* Keep reference to the database Oid, a process can touch the files of
+	 * several databases. */
 	oid = c;
 	c = strchr(c, '/');
 	if (c == NULL) {
@@ -139,9 +135,19 @@ parse_database_oid:
 
 parse_filenode:
 	oid = c;
+	pfd->database_oid = db_oid;
+
+	/* The relation map is not a relation but we need to know when it is
+	 * written to, see pfd_notify_write(). */
+	if (strcmp(oid, RELMAPPER_FILENAME) == 0) {
+		pfd->file_type = FILE_TYPE_RELMAP;
+		pfd->filenode = InvalidOid;
+		xfree(filepath);
+		return;
+	}
 
-	/* Skip the part chunk at the end of the OID, TODO: use that for the
-	 * progress management... later (each file is 1GB). */
+	/* Relations are split in segments of 1 GiB, all but the first have
+	 * their number as suffix (see progress.c). */
 	c = strchr(oid, '.');
 	if (c != NULL) {
 		*c = '\0';
@@ -158,8 +164,8 @@ parse_filenode:
 		pfd->file_type = FILE_TYPE_FSM;
 	} else {
 		pfd->file_type = FILE_TYPE_TABLE;
-		pfd->part = part;
 	}
+	pfd->part = part;
 
 	/* Whatever's in oid at this point, has got to be an int, if the
 	 * conversion fail, this is not the droid we're looking for. */
@@ -170,14 +176,8 @@ parse_filenode:
 		return;
 	}
 
-	/* Now that we know the path is valid, save the current cluster path
-	 * and current database oid. */
-	if (current_database_oid == InvalidOid && db_oid != InvalidOid) {
-		current_database_oid = db_oid;
-	} else if (!(pfd->shared) && current_database_oid != db_oid) {
-		errx(1, "error: one backend shouldn't switch database");
-	}
-
+	/* Now that we know the path is valid, save the current cluster
+	 * path. */
 	if (current_cluster_path == NULL) {
 		*(oid - 1) = '\0';
 		current_cluster_path = xstrdup(filepath);
@@ -190,6 +190,31 @@ parse_filenode:
 }
 
 
+/*
+ * Returns a copy of the relname of a pfd. The local relations of the databases
+ * other than the first one seen are prefixed with the name of their database
+ * (e.g. "db.relname"), the output of a single backend doesn't change.
+ */
+char *
+_pfd_qualify_relname(pfd_t *pfd, char *relname)
+{
+	char buffer[MAX_RELNAME_LENGTH];
+	char *datname;
+
+	if (pfd->shared || pfd->database_oid == pg_get_main_database())
+		return xstrdup(relname);
+
+	datname = pg_get_database_name(pfd->database_oid);
+	if (datname != NULL)
+		snprintf(buffer, sizeof(buffer), "%s.%s", datname, relname);
+	else
+		snprintf(buffer, sizeof(buffer), "%u.%s", pfd->database_oid,
+				relname);
+
+	return xstrdup(buffer);
+}
+
+
 /*
  * Resolve the relname (relationship name) of a pfd.
  */
@@ -197,6 +222,7 @@ void
 pfd_update_from_pg(pfd_t *pfd)
 {
 	Oid mapped_oid;
+	char *relname = NULL;
 
 	if (pfd->relname != NULL)
 		return;
@@ -205,12 +231,14 @@ pfd_update_from_pg(pfd_t *pfd)
 		errx(1, "got in pfd_update_from_pg without filenode");
 
 	/*
-	 * If the rn_cache is empty at this point, fill it, we should have all
-	 * the path required to load pg_class.
+	 * Use the catalog of the database of the file. If its rn_cache is empty
+	 * at this point, fill it, we should have all the path required to load
+	 * pg_class. The shared relations are in the pg_class of any database.
 	 */
-	if (pfd->shared == false && rn_cache_local_loaded == false) {
-		pg_load_rn_cache_from_pg_class(pfd->shared);
-		rn_cache_local_loaded = true;
+	if (pfd->shared == false) {
+		pg_switch_database(pfd->database_oid);
+		if (!pg_class_loaded)
+			pg_load_rn_cache_from_pg_class(pfd->shared);
 	}
 
 	/*
@@ -221,12 +249,95 @@ pfd_update_from_pg(pfd_t *pfd)
 	load_relmap_file(pfd->shared);
 	mapped_oid = FilenodeToRelationMapOid(pfd->filenode, pfd->shared);
 	if (mapped_oid != InvalidOid) {
-		pfd->relname = rn_cache_get_from_oid(mapped_oid);
-		if (pfd->relname != NULL)
-			return;
+		relname = rn_cache_get_from_oid(mapped_oid);
+		if (relname == NULL && pg_class_loaded)
+			relname = pg_lookup_oid(mapped_oid);
 	}
 
-	pfd->relname = rn_cache_get_from_filenode(pfd->filenode);
+	if (relname == NULL)
+		relname = rn_cache_get_from_filenode(pfd->filenode);
+
+	/* Unknown filenode, look it up in pg_class, the relation may also have
+	 * been created, truncated or rewritten since we last looked. */
+	if (relname == NULL && pfd->shared == false)
+		relname = pg_lookup_filenode(pfd->filenode);
+
+	/* The cache owns its strings, the pfd gets its own copy. */
+	if (relname != NULL)
+		pfd->relname = _pfd_qualify_relname(pfd, relname);
+}
+
+
+/*
+ * Called when the traced process writes to a file descriptor. A write to a
+ * relation map means a catalog got a new filenode (VACUUM FULL, CLUSTER...),
+ * our cached copy of the map is now stale. A write to pg_class means new
+ * relations or filenodes.
+ */
+void
+pfd_notify_write(pfd_t *pfd)
+{
+	if (pfd->shared == false)
+		pg_switch_database(pfd->database_oid);
+
+	if (pfd->file_type == FILE_TYPE_RELMAP)
+		relmap_invalidate(pfd->shared);
+	else if (pfd->shared == false && pfd->filenode != InvalidOid &&
+			pfd->filenode == pg_get_pg_class_filenode())
+		pg_class_mark_dirty();
+}
+
+
+/*
+ * Move the file position after a read() or write() of 'size' bytes (the
+ * result of the call, nothing moves on errors).
+ */
+void
+pfd_advance(pfd_t *pfd, long size)
+{
+	if (pfd->offset >= 0 && size > 0)
+		pfd->offset += size;
+}
+
+
+/*
+ * Set the file position after an lseek(). Whatever the whence (SEEK_SET,
+ * SEEK_CUR or SEEK_END), its result is the new position, this also gets us a
+ * position for the descriptors we didn't know.
+ */
+void
+pfd_seek(pfd_t *pfd, off_t result)
+{
+	if (result >= 0)
+		pfd->offset = result;
+}
+
+
+/*
+ * Find the blocks touched by an I/O of 'size' bytes at 'offset' within the
+ * file. The segment the file is part of is accounted for.
+ *
+ * Returns -1 if this is not a relation file, if the offset is unknown or
+ * nothing was transferred.
+ */
+int
+pfd_get_io(pfd_t *pfd, off_t offset, long size, pfd_io *io)
+{
+	uint32 last;
+
+	if (pfd->filenode == InvalidOid || offset < 0 || size <= 0)
+		return -1;
+
+	io->pfd = pfd;
+	io->offset = offset;
+	io->size = size;
+	io->first_block = (uint32)pfd->part * RELSEG_SIZE +
+		offset / BLCKSZ;
+	last = (uint32)pfd->part * RELSEG_SIZE +
+		(offset + size - 1) / BLCKSZ;
+	io->nblocks = last - io->first_block + 1;
+
+	return 0;
 }
 
 
@@ -273,7 +384,7 @@ pfd_get_repr(pfd_t *pfd)
 
 	/* Can't get a filepath, display the fd. */
 	if (repr == NULL) {
-		snprintf(buffer, sizeof(buffer), "fd=%u", pfd->fd);
+		snprintf(buffer, sizeof(buffer), "fd=%d", pfd->fd);
 		repr = xstrdup(buffer);
 	}
 
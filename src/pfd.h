@@ -17,6 +17,9 @@
 
 #define MAX_HUMAN_FD_LENGTH	256
 
+/* Longest relname, qualified by the name of its database. */
+#define MAX_RELNAME_LENGTH	(NAMEDATALEN * 2)
+
 
 /*
  * CHR to IPV6 types are directly mirrored from the lsof listing. New entries
@@ -49,16 +52,24 @@ enum file_type {
 	FILE_TYPE_VM,
 	FILE_TYPE_FSM,
 	FILE_TYPE_XLOG,
+	FILE_TYPE_RELMAP,
 	FILE_TYPE_UNKNOWN
 };
 
 
+/*
+ * 'offset' is our model of the file position, moved by the reads, writes and
+ * seeks we see, -1 when unknown (descriptors opened before we attached).
+ * 'progress' is the position of its progress record plus one, 0 if none.
+ */
 typedef struct _pfd_t {
 	Oid		 database_oid;
 	Oid		 oid;
 	Oid		 filenode;
 	int		 fd;
 	int		 part;
+	off_t		 offset;
+	int		 progress;
 	bool		 shared;
 	enum fd_type	 fd_type;
 	enum file_type	 file_type;
@@ -67,7 +78,24 @@ typedef struct _pfd_t {
 } pfd_t;
 
 
+/*
+ * Blocks of a relation fork touched by a read or a write, the block numbers
+ * are relative to the whole fork (all its segments), see pfd_get_io().
+ */
+typedef struct _pfd_io {
+	pfd_t		*pfd;
+	off_t		 offset;
+	long		 size;
+	uint32		 first_block;
+	uint32		 nblocks;
+} pfd_io;
+
+
 void		 pfd_clean(pfd_t *);
 char		*pfd_get_repr(pfd_t *);
 void		 pfd_update_from_filepath(pfd_t *);
 void		 pfd_update_from_pg(pfd_t *);
+void		 pfd_notify_write(pfd_t *);
+void		 pfd_advance(pfd_t *, long);
+void		 pfd_seek(pfd_t *, off_t);
+int		 pfd_get_io(pfd_t *, off_t, long, pfd_io *);
@@ -18,27 +18,42 @@
  * descriptors.
  */
 
+#include <sys/param.h>
+
 #include <stdio.h>
 #include <unistd.h>
+#include <string.h>
+#include <err.h>
 
 #include <postgres.h>
 
 #include "pfd.h"
 #include "pfd_cache.h"
 #include "lsof.h"
+#ifdef HAVE_PROCFS
+#include "proc.h"
+#endif
 #include "utils.h"
 #include "xmalloc.h"
 
 
-/* Realloc'd array of pfd_t's, NULL == uninitialized. */
+/*
+ * Realloc'd array of pfd_t's indexed by file descriptor, NULL ==
+ * uninitialized. File descriptors are small and dense integers (the kernel
+ * always hands out the lowest available one), which makes the lookups
+ * constant time. Free slots have the FD_TYPE_INVALID type.
+ */
 pfd_t *pfd_pool = NULL;
 
-/* Number of items in the pool. */
-int pfd_count = 0;
-
-/* Actual byte size of the pool, this can only grow. */
+/* Number of slots in the pool, this can only grow. */
 int pfd_pool_size = 0;
 
+/*
+ * Returned for the negative file descriptors, a failed open() passed along to
+ * close() or read() by the traced process. Nothing is kept in it.
+ */
+pfd_t pfd_invalid;
+
 
 
 /*
@@ -48,67 +63,72 @@ void
 pfd_cache_clear() {
 	int i;
 
-	if (pfd_pool != NULL) {
-		for (i = 0; i < pfd_count; i++)
+	for (i = 0; i < pfd_pool_size; i++) {
+		if (pfd_pool[i].fd_type != FD_TYPE_INVALID)
 			pfd_clean(&pfd_pool[i]);
-
-		pfd_count = 0;
 	}
 }
 
 
 /*
- * Return the next free slot in the cache. If necessary, grow the pool.
+ * Return the slot for this file descriptor, whatever its state. If necessary,
+ * grow the pool.
  */
 pfd_t *
-pfd_cache_next()
+pfd_cache_slot(int fd)
 {
 	pfd_t *pfd;
-	pfd_count++;
+	int i, old_size;
+
+	if (fd < 0)
+		errx(1, "pfd_cache: invalid file descriptor %d", fd);
 
 	/* We've outgrown our cache size, 3nl@rg3! */
-	if (pfd_count > pfd_pool_size) {
-		pfd_pool_size += PFD_CACHE_GROWTH;
+	if (fd >= pfd_pool_size) {
+		old_size = pfd_pool_size;
+		while (fd >= pfd_pool_size)
+			pfd_pool_size += MAX(pfd_pool_size, PFD_CACHE_GROWTH);
 		debug("pfd_cache: growing pool to %d pfds\n", pfd_pool_size);
 		pfd_pool = xrealloc(pfd_pool, pfd_pool_size, sizeof(pfd_t));
-	}
 
-	/* Pick up the next pfd from the grown pool, since it's uninitialized,
-	 * clean it up first.  */
-	pfd = &pfd_pool[pfd_count - 1];
-	pfd->fd = InvalidOid;
-	pfd->fd_type = FD_TYPE_INVALID;
-	pfd->relname = NULL;
-	pfd->filepath = NULL;
+		/* The new slots are uninitialized, clean them up first. */
+		for (i = old_size; i < pfd_pool_size; i++) {
+			pfd = &pfd_pool[i];
+			memset(pfd, 0, sizeof(pfd_t));
+			pfd->fd = i;
+			pfd->offset = -1;
+			pfd->fd_type = FD_TYPE_INVALID;
+			pfd->file_type = FILE_TYPE_UNKNOWN;
+		}
+	}
 
-	return pfd;
+	return &pfd_pool[fd];
 }
 
 
 /*
  * Retrieve an pfd_t based on its fd.
  *
- * If this entry does not exist, create a new one.
+ * If this entry does not exist, create a new one. A negative fd gets an
+ * invalid entry, reset on each call.
  */
 pfd_t *
 pfd_cache_get(int fd)
 {
-	int i;
-	pfd_t *pfd;
-
-	for (i = 0; i < pfd_count; i++) {
-		pfd = &pfd_pool[i];
-
-		if (pfd->fd_type == FD_TYPE_INVALID)
-			continue;
-
-		if (pfd->fd == fd)
-			return pfd;
+	if (fd < 0) {
+		memset(&pfd_invalid, 0, sizeof(pfd_t));
+		pfd_invalid.fd = fd;
+		pfd_invalid.offset = -1;
+		pfd_invalid.fd_type = FD_TYPE_INVALID;
+		pfd_invalid.file_type = FILE_TYPE_UNKNOWN;
+		return &pfd_invalid;
 	}
 
-	pfd = pfd_cache_add(fd, NULL);
+	if (fd < pfd_pool_size &&
+			pfd_pool[fd].fd_type != FD_TYPE_INVALID)
+		return &pfd_pool[fd];
 
-	return pfd;
+	return pfd_cache_add(fd, NULL);
 }
 
 
@@ -120,46 +140,33 @@ pfd_cache_get(int fd)
 void
 pfd_cache_delete(int fd)
 {
-	int i;
-	pfd_t *pfd;
-
-	for (i = 0; i < pfd_count; i++) {
-		pfd = &pfd_pool[i];
-
-		if (pfd->fd_type == FD_TYPE_INVALID)
-			continue;
+	if (fd < 0 || fd >= pfd_pool_size)
+		return;
 
-		if (pfd->fd == fd) {
-			pfd_clean(pfd);
-			return;
-		}
-	}
+	if (pfd_pool[fd].fd_type != FD_TYPE_INVALID)
+		pfd_clean(&pfd_pool[fd]);
 }
 
 
 /*
  * Add a file descriptor to the cache. This is used for incremental updates,
- * not for the initial bulk load. It will find empty spots before.
+ * not for the initial bulk load. If the slot is still in use (we missed a
+ * close), the previous file is dropped. A file we saw opened is at offset 0.
  */
 pfd_t *
 pfd_cache_add(int fd, char *path)
 {
-	int i;
-	pfd_t *current = NULL;
+	pfd_t *current;
 
-	/* First try to replace an empty slot. */
-	for (i = 0; i < pfd_count; i++) {
-		if (pfd_pool[i].fd_type == FD_TYPE_INVALID) {
-			current = &pfd_pool[i];
-			break;
-		}
-	}
-
-	if (current == NULL)
-		current = pfd_cache_next();
+	current = pfd_cache_slot(fd);
+	if (current->fd_type != FD_TYPE_INVALID)
+		pfd_clean(current);
 
 	current->fd = fd;
 	current->fd_type = FD_TYPE_REG;
+	current->file_type = FILE_TYPE_UNKNOWN;
+	current->filenode = InvalidOid;
+	current->offset = path != NULL ? 0 : -1;
 
 	/* If a path was provided, attempt to populate the structure. */
 	if (path != NULL) {
@@ -174,6 +181,40 @@ pfd_cache_add(int fd, char *path)
 }
 
 
+/*
+ * Make 'newfd' a copy of 'oldfd', after a dup(), dup2() or fcntl(F_DUPFD).
+ * Whatever 'newfd' pointed to was closed by the kernel.
+ *
+ * Both descriptors share their file position in the kernel, we only copy it,
+ * postgres doesn't use both of them for I/O.
+ */
+pfd_t *
+pfd_cache_dup(int oldfd, int newfd)
+{
+	pfd_t *old, *new;
+
+	if (oldfd == newfd)
+		return pfd_cache_get(newfd);
+
+	/* Grow first, the pool could move under 'old'. */
+	pfd_cache_slot(MAX(oldfd, newfd));
+	old = pfd_cache_get(oldfd);
+	new = pfd_cache_slot(newfd);
+
+	if (new->fd_type != FD_TYPE_INVALID)
+		pfd_clean(new);
+
+	memcpy(new, old, sizeof(pfd_t));
+	new->fd = newfd;
+	if (old->filepath != NULL)
+		new->filepath = xstrdup(old->filepath);
+	if (old->relname != NULL)
+		new->relname = xstrdup(old->relname);
+
+	return new;
+}
+
+
 /*
  * Pre-load the pfd_cache using the output from lsof.
  */
@@ -194,6 +235,54 @@ pfd_cache_preload_from_lsof(pid_t pid)
 }
 
 
+#ifdef HAVE_PROCFS
+/*
+ * Add a file descriptor found in /proc, called by proc_read_fds(). What is
+ * not a file shows up as "type:[inode]" (sockets, pipes), it is kept without
+ * a path. Like with lsof, the relations are only looked up when used.
+ */
+void
+_pfd_cache_add_from_proc(int fd, char *path, off_t offset)
+{
+	pfd_t *current;
+
+	current = pfd_cache_slot(fd);
+	pfd_clean(current);
+	current->fd = fd;
+
+	if (path[0] != '/') {
+		if (strncmp(path, "pipe:", 5) == 0)
+			current->fd_type = FD_TYPE_FIFO;
+		else
+			current->fd_type = FD_TYPE_UNKNOWN;
+		return;
+	}
+
+	current->fd_type = FD_TYPE_REG;
+	current->offset = offset;
+	current->filepath = xstrdup(path);
+	pfd_update_from_filepath(current);
+}
+
+
+/*
+ * Pre-load the pfd_cache from /proc, this is what lsof would read for us
+ * without forking it.
+ *
+ * Returns -1 if the process can't be inspected, with errno set.
+ */
+int
+pfd_cache_preload_from_proc(pid_t pid)
+{
+	debug("pfd_cache: load from /proc (pid=%d)\n", pid);
+
+	pfd_cache_clear();
+
+	return proc_read_fds(pid, _pfd_cache_add_from_proc);
+}
+#endif
+
+
 /*
  * Print the content of the pfd_cache to stdout.
  *
@@ -208,8 +297,10 @@ pfd_cache_print()
 
 	printf("index\tfd_type\tfd\tfilenode\tfilepath\trelname\n");
 
-	for (i = 0; i < pfd_count; i++) {
+	for (i = 0; i < pfd_pool_size; i++) {
 		pfd = &pfd_pool[i];
+		if (pfd->fd_type == FD_TYPE_INVALID)
+			continue;
 		printf("%i\t%i\t%i\t%i\t%s\t%s\n", i, pfd->fd_type, pfd->fd,
 				pfd->filenode, pfd->filepath, pfd->relname);
 	}
@@ -15,13 +15,16 @@
  */
 
 
-/* How much to realloc when the cache is too tight. */
+/* Minimum growth of the pool when the cache is too tight. */
 #define PFD_CACHE_GROWTH	64
 
 /* prototypes */
 void		 pfd_cache_clear();
-pfd_t		*pfd_cache_next();
+pfd_t		*pfd_cache_slot(int);
 pfd_t		*pfd_cache_get(int);
 void		 pfd_cache_delete(int);
 pfd_t		*pfd_cache_add(int, char *);
+pfd_t		*pfd_cache_dup(int, int);
 void		 pfd_cache_preload_from_lsof(pid_t);
+int		 pfd_cache_preload_from_proc(pid_t);
+void		 pfd_cache_print();
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Micro-benchmark of the pfd_cache lookups. For a growing number of open file
+ * descriptors, time a large number of random pfd_cache_get() calls and print
+ * the average cost of each. This should remain flat whatever the number of
+ * descriptors. The random descriptors are drawn before the clock starts,
+ * random() costs more than a lookup.
+ *
+ * 	make bench && ./pfd_cache_bench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+
+#include <postgres.h>
+
+#include "pfd.h"
+#include "pfd_cache.h"
+#include "xmalloc.h"
+
+
+#define _DEBUG_FLAG
+int debug_flag = 0;
+
+
+/* Number of lookups per round. */
+#define LOOKUPS		10000000
+
+
+int
+main(int argc, char **argv)
+{
+	int sizes[] = { 10, 100, 1000, 10000 };
+	int i, j, fd, *fds;
+	struct timespec start, end;
+	double elapsed;
+	long sum = 0;
+
+	fds = xcalloc(LOOKUPS, sizeof(int));
+
+	for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+		pfd_cache_clear();
+
+		for (fd = 0; fd < sizes[i]; fd++)
+			pfd_cache_add(fd, NULL);
+
+		for (j = 0; j < LOOKUPS; j++)
+			fds[j] = random() % sizes[i];
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (j = 0; j < LOOKUPS; j++)
+			sum += pfd_cache_get(fds[j])->fd;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		elapsed = (end.tv_sec - start.tv_sec) * 1e9 +
+			(end.tv_nsec - start.tv_nsec);
+
+		printf("%6d fds: %6.1f ns/lookup\n", sizes[i],
+				elapsed / LOOKUPS);
+	}
+
+	xfree(fds);
+
+	/* Keep the compiler from optimizing the lookups away. */
+	if (sum < 0)
+		printf("%ld\n", sum);
+
+	return 0;
+}
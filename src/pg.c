@@ -14,21 +14,37 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
 #include <err.h>
 
 #include <c.h>
 #include <postgres.h>
 #include <access/htup.h>
+#include <access/transam.h>
 #include <catalog/pg_class.h>
+#include <catalog/pg_database.h>
+#include <catalog/indexing.h>
 #include <storage/bufpage.h>
 #include <storage/itemid.h>
 
+#include "btree.h"
 #include "rn_cache.h"
 #include "relmapper.h"
+#include "snapshot.h"
+#include "strlcpy.h"
 #include "utils.h"
 #include "xmalloc.h"
 #include "pg.h"
@@ -42,13 +58,217 @@
 char *current_cluster_path = NULL;
 
 /*
- * And we also make the assumption that a backend will not connect to multiple
- * databases. Experimentations show that \connect will spawn a new backend.
- * TODO: make sure this is not a false assumption.
+ * A backend only ever connects to one database (\connect spawns a new one),
+ * but the other processes (checkpointer, autovacuum, walsenders...) touch the
+ * files of all of them. This is the database whose catalog state is in the
+ * globals below, see pg_switch_database().
  */
 Oid current_database_oid = InvalidOid;
 
 
+/* Older releases have no index on relfilenode, see _pg_index_check(). */
+#ifndef ClassTblspcRelfilenodeIndexId
+#define ClassTblspcRelfilenodeIndexId	InvalidOid
+#endif
+
+/* Older releases only have the lock bits, see _pg_decode_tuple(). */
+#ifndef HEAP_XMAX_IS_LOCKED_ONLY
+#define HEAP_XMAX_IS_LOCKED_ONLY(infomask)	((infomask) & HEAP_IS_LOCKED)
+#endif
+
+/* Before 9.3, xmax was never a MultiXactId when updated. */
+#ifndef HeapTupleHeaderGetRawXmax
+#define HeapTupleHeaderGetRawXmax(tup)		HeapTupleHeaderGetXmax(tup)
+#endif
+
+
+/*
+ * One pg_class tuple, decoded but not yet in the rn_cache. The relname points
+ * within the mapped page. 'aborted' and 'deleted' come from the hint bits,
+ * the inserting or deleting transaction may be over without them set yet.
+ * 'hot_next' is the line pointer of the next version of a HOT chain (same
+ * page), 0 if this is the last one.
+ */
+struct pg_class_tuple {
+	Oid		 oid;
+	Oid		 filenode;
+	Oid		 tablespace;
+	TransactionId	 xmin;
+	TransactionId	 xmax;
+	BlockNumber	 block;
+	OffsetNumber	 offnum;
+	OffsetNumber	 hot_next;
+	int		 heap_only;
+	int		 xmax_invalid;
+	int		 aborted;
+	int		 deleted;
+	char		*relname;
+};
+
+/*
+ * Work of one decoder thread: a range of pages and the tuples found there.
+ */
+struct pg_decoder {
+	pthread_t		 thread;
+	char			**pages;
+	BlockNumber		*blocks;
+	int			 page_count;
+	struct pg_class_tuple	*tuples;
+	int			 tuple_count;
+	int			 tuple_size;
+};
+
+/*
+ * A key recently looked up in a pg_class index without success.
+ */
+struct pg_index_miss {
+	Oid		 indexid;
+	Oid		 key;
+	time_t		 when;
+};
+
+/*
+ * A mapped segment of a relation.
+ */
+struct pg_mapping {
+	char		*addr;
+	size_t		 size;
+};
+
+/*
+ * Catalog state of a database: its copy of pg_class (the rn_cache) and what
+ * we know of the pg_class table itself. This is where the globals of a
+ * database are kept while another one is current.
+ */
+struct pg_database {
+	Oid			 oid;
+	rn_cache_image		 rn_cache;
+	int			 class_loaded;
+	Oid			 class_filenode;
+	uint64			*class_lsns;
+	int			 class_page_count;
+	time_t			 class_refreshed;
+	int			 class_dirty;
+	int			 class_use_index;
+	int			 class_index_pages;
+	int			 class_unsaved;
+	struct pg_index_miss	 index_misses[PG_INDEX_MISS_CACHE_SIZE];
+};
+
+/*
+ * A row of pg_database. 'live' tells if this version of the tuple was neither
+ * deleted nor updated.
+ */
+struct pg_datname {
+	Oid		 oid;
+	int		 live;
+	char		 name[NAMEDATALEN];
+};
+
+
+/*
+ * Was the rn_cache populated from pg_class yet? This can only happen once we
+ * know the cluster path and database oid.
+ */
+int pg_class_loaded = 0;
+
+/*
+ * State of the last pg_class scan: the filenode we scanned, and the LSN of
+ * each of its pages. A refresh only decodes the pages with a different LSN
+ * and the ones appended since. This is saved in the snapshots.
+ */
+Oid pg_class_filenode = InvalidOid;
+uint64 *pg_class_lsns = NULL;
+int pg_class_page_count = 0;
+time_t pg_class_refreshed = 0;
+int pg_class_dirty = 0;
+
+/*
+ * Are relations looked up through the pg_class indexes? Otherwise the whole
+ * table is loaded and refreshed.
+ */
+int pg_class_use_index = 0;
+
+/*
+ * Number of pages of pg_class when we started using its indexes. A relation
+ * missing from the index (it lags behind until the next checkpoint) is only
+ * searched for in the pages added since.
+ */
+int pg_class_index_pages = 0;
+
+/*
+ * Did the index lookups add relations since the snapshot was loaded? They
+ * are saved when we exit.
+ */
+int pg_class_unsaved = 0;
+struct pg_index_miss pg_index_misses[PG_INDEX_MISS_CACHE_SIZE];
+
+/*
+ * Mappings of the pg_class scan in progress, see _pg_sigbus_handler().
+ */
+struct pg_mapping *pg_scan_maps = NULL;
+int pg_scan_map_count = 0;
+long pg_scan_page_size = 0;
+
+/* Databases whose files were seen, realloc'd. */
+struct pg_database *pg_databases = NULL;
+int pg_database_count = 0;
+
+/* Content of pg_database, read when needed, see pg_get_database_name(). */
+struct pg_datname *pg_datnames = NULL;
+int pg_datname_count = 0;
+time_t pg_datnames_loaded = 0;
+
+
+/*
+ * Returns the filenode of the pg_class table of the current database, or
+ * InvalidOid if we don't know where it is yet.
+ */
+Oid
+pg_get_pg_class_filenode(void)
+{
+	/* We haven't found any cluster or database yet, shouldn't be here. */
+	if (current_cluster_path == NULL || current_database_oid == InvalidOid)
+		return InvalidOid;
+
+	/*
+	 * This gives us access to all the mapped file nodes, they are not
+	 * available in pg_class. It will also allow us to find the file node
+	 * for pg_class since it's a mapped file node itself.
+	 */
+	load_relmap_file(false);
+
+	return RelationMapOidToFilenode(RelationRelationId, false);
+}
+
+
+/*
+ * Returns the filesystem path of a relation of the local relmap (pg_class and
+ * its indexes), NULL if it's not mapped or if we don't know where the database
+ * is yet.
+ */
+char *
+_pg_get_mapped_filepath(Oid relid)
+{
+	Oid filenode;
+	char buffer[MAXPGPATH];
+
+	if (current_cluster_path == NULL || current_database_oid == InvalidOid)
+		return NULL;
+
+	load_relmap_file(false);
+
+	filenode = RelationMapOidToFilenode(relid, false);
+	if (filenode == InvalidOid)
+		return NULL;
+
+	snprintf(buffer, MAXPGPATH, "%s/base/%u/%u", current_cluster_path,
+			current_database_oid, filenode);
+
+	return xstrdup(buffer);
+}
+
+
 /*
  * Returns the filesystem path of the pg_class table.
  *
@@ -58,129 +278,1149 @@ Oid current_database_oid = InvalidOid;
 char *
 pg_get_pg_class_filepath(bool shared)
 {
-	int filenode;
-	char buffer[MAXPGPATH];
-
 	/* We can't obtain pg_class from the shared relmap, it's only available
 	 * in the local database's relmap. */
 	if (shared)
 		return NULL;
 
-	/* We haven't found any cluster or database yet, shouldn't be here. */
-	if (current_cluster_path == NULL || current_database_oid == InvalidOid)
+	return _pg_get_mapped_filepath(RelationRelationId);
+}
+
+
+/*
+ * Read one block of a relation, from the right segment.
+ *
+ * Returns -1 if the block can't be read entirely.
+ */
+int
+pg_read_block(char *filepath, uint32 blkno, char *page)
+{
+	char path[MAXPGPATH];
+	int fd, segment;
+	ssize_t l;
+
+	segment = blkno / RELSEG_SIZE;
+	if (segment == 0)
+		strlcpy(path, filepath, sizeof(path));
+	else
+		snprintf(path, sizeof(path), "%s.%d", filepath, segment);
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	l = pread(fd, page, BLCKSZ, (off_t)(blkno % RELSEG_SIZE) * BLCKSZ);
+	close(fd);
+
+	if (l != BLCKSZ)
+		return -1;
+
+	return 0;
+}
+
+
+/*
+ * Returns the number of line pointers of a heap page, zero for new pages (all
+ * zeros) or anything that doesn't look like a page.
+ */
+int
+_pg_page_get_item_count(char *p)
+{
+	PageHeaderData *ph = (PageHeaderData *)p;
+
+	if (PageGetPageSize(p) != BLCKSZ || ph->pd_lower > BLCKSZ ||
+			ph->pd_lower < SizeOfPageHeaderData)
+		return 0;
+
+	return (ph->pd_lower - SizeOfPageHeaderData) / sizeof(ItemIdData);
+}
+
+
+/*
+ * Return the heap tuple at line pointer 'offnum' (starting at 1) of a page,
+ * with at least 'size' bytes of data. Pages are read while postgres may be
+ * writing them, nothing pointing outside the page is followed.
+ *
+ * Returns NULL if there is no valid tuple there.
+ */
+HeapTupleHeaderData *
+_pg_get_tuple(char *p, int offnum, size_t size)
+{
+	HeapTupleHeaderData *hthd;
+	ItemIdData *pd_linp;
+
+	pd_linp = PageGetItemId(p, offnum);
+
+	/* Strip out dead, redirects, etc. */
+	if (pd_linp->lp_flags != LP_NORMAL)
+		return NULL;
+
+	if (pd_linp->lp_off + pd_linp->lp_len > BLCKSZ)
 		return NULL;
 
+	hthd = (HeapTupleHeaderData *)PageGetItem(p, pd_linp);
+	if (hthd->t_hoff + size > pd_linp->lp_len)
+		return NULL;
+
+	return hthd;
+}
+
+
+/*
+ * Returns the OID of a tuple, InvalidOid if it doesn't have one.
+ */
+Oid
+_pg_get_tuple_oid(HeapTupleHeaderData *hthd)
+{
+	if (hthd->t_infomask & HEAP_HASOID)
+		return *((Oid *)((void *)hthd + hthd->t_hoff - sizeof(Oid)));
+
+	return InvalidOid;
+}
+
+
+/*
+ * Decode the pg_class tuple at line pointer 'offnum' (starting at 1) of page
+ * 'block'.
+ *
+ * Returns 0 if there is no valid tuple there.
+ */
+int
+_pg_decode_tuple(char *p, BlockNumber block, int offnum,
+		struct pg_class_tuple *tuple)
+{
+	HeapTupleHeaderData *hthd;
+	FormData_pg_class *ci;
+	uint16 infomask;
+
+	hthd = _pg_get_tuple(p, offnum, sizeof(FormData_pg_class));
+	if (hthd == NULL)
+		return 0;
+
+	ci = (FormData_pg_class *)((void *)hthd + hthd->t_hoff);
+	infomask = hthd->t_infomask;
+
+	/* If this tuple has an OID, that's the OID of our table. */
+	tuple->oid = _pg_get_tuple_oid(hthd);
+
+	tuple->filenode = ci->relfilenode;
+	tuple->tablespace = ci->reltablespace;
+	tuple->xmin = HeapTupleHeaderGetXmin(hthd);
+	tuple->xmax = (infomask & HEAP_XMAX_IS_MULTI) ? InvalidTransactionId :
+		HeapTupleHeaderGetRawXmax(hthd);
+	tuple->block = block;
+	tuple->offnum = offnum;
+	tuple->heap_only = HeapTupleHeaderIsHeapOnly(hthd);
+	tuple->hot_next = 0;
+	if (HeapTupleHeaderIsHotUpdated(hthd) &&
+			ItemPointerGetBlockNumber(&hthd->t_ctid) == block)
+		tuple->hot_next = ItemPointerGetOffsetNumber(&hthd->t_ctid);
+	tuple->xmax_invalid = (infomask & HEAP_XMAX_INVALID) != 0;
+	tuple->relname = NameStr(ci->relname);
+
+	/* Both bits set is a frozen xmin (9.4+), not an aborted one. */
+	tuple->aborted = (infomask & (HEAP_XMIN_COMMITTED |
+				HEAP_XMIN_INVALID)) == HEAP_XMIN_INVALID;
+	tuple->deleted = (infomask & HEAP_XMAX_COMMITTED) &&
+		!HEAP_XMAX_IS_LOCKED_ONLY(infomask);
+
+	return 1;
+}
+
+
+/*
+ * Decode the pg_class tuples of one page into the decoder's buffer.
+ */
+void
+_pg_decode_page(char *p, BlockNumber block, struct pg_decoder *dec)
+{
+	int i, count;
+
+	count = _pg_page_get_item_count(p);
+
+	for (i = 0; i < count; i++) {
+		if (dec->tuple_count == dec->tuple_size) {
+			dec->tuple_size += PG_DECODER_GROWTH;
+			dec->tuples = xrealloc(dec->tuples, dec->tuple_size,
+					sizeof(struct pg_class_tuple));
+		}
+
+		if (_pg_decode_tuple(p, block, i + 1,
+					&dec->tuples[dec->tuple_count]))
+			dec->tuple_count++;
+	}
+}
+
+
+/*
+ * Does transaction 'a' come after 'b'? The special ones (frozen) come before
+ * all the others, the normal ones wrap around.
+ */
+int
+_pg_xid_follows(TransactionId a, TransactionId b)
+{
+	if (!TransactionIdIsNormal(a) || !TransactionIdIsNormal(b))
+		return a > b;
+
+	return (int32)(a - b) > 0;
+}
+
+
+/*
+ * Add a decoded tuple to the rn_cache, or bring the record of its relation up
+ * to date. Pages are decoded again when they change, so we see the versions
+ * of a relation (renames, any update of its row) as they come: the one
+ * inserted last wins, and the record goes away once the deletion of the
+ * version it comes from is committed (DROP, or a new filenode). The records
+ * of the relmapper are left alone.
+ */
+void
+_pg_add_tuple(struct pg_class_tuple *tuple)
+{
+	rn_record *rec;
+
+	if (tuple->aborted)
+		return;
+
+	if (tuple->filenode != InvalidOid)
+		rec = rn_cache_get_record_from_filenode(tuple->filenode);
+	else
+		rec = rn_cache_get_record_from_oid(tuple->oid);
+
+	if (rec != NULL && rec->origin != RN_ORIGIN_PGCLASS)
+		return;
+
+	if (tuple->deleted) {
+		if (rec != NULL && rec->block == tuple->block &&
+				rec->offnum == tuple->offnum &&
+				rec->xmin == tuple->xmin)
+			rn_cache_delete(rec);
+		return;
+	}
+
 	/*
-	 * This gives us access to all the mapped file nodes, they are not
-	 * available in pg_class. It will also allow us to find the file node
-	 * for pg_class since it's a mapped file node itself.
+	 * The same xmin is the same version moved (VACUUM FULL), or an update
+	 * within the inserting transaction and only the last one isn't updated.
 	 */
-	load_relmap_file(false);
+	if (rec == NULL)
+		rec = rn_cache_add(RN_ORIGIN_PGCLASS, tuple->oid,
+				tuple->filenode, tuple->relname);
+	else if (_pg_xid_follows(tuple->xmin, rec->xmin) ||
+			(tuple->xmin == rec->xmin && tuple->xmax_invalid))
+		rn_cache_rename(rec, tuple->relname);
+	else
+		return;
 
-	filenode = RelationMapOidToFilenode(RelationRelationId, shared);
-	snprintf(buffer, MAXPGPATH, "%s/base/%u/%d", current_cluster_path,
-			current_database_oid, filenode);
+	rec->xmin = tuple->xmin;
+	rec->block = tuple->block;
+	rec->offnum = tuple->offnum;
+}
 
-	debug("pg_class is located at %s\n", buffer);
 
-	return xstrdup(buffer);
+/*
+ * Body of a decoder thread.
+ */
+void *
+_pg_decoder_run(void *arg)
+{
+	struct pg_decoder *dec = arg;
+	int i;
+
+	for (i = 0; i < dec->page_count; i++)
+		_pg_decode_page(dec->pages[i], dec->blocks[i], dec);
+
+	return NULL;
+}
+
+
+/*
+ * Add the tuples found by a decoder to the rn_cache, either the deleted ones
+ * or the others.
+ */
+void
+_pg_decoder_merge(struct pg_decoder *dec, int deleted)
+{
+	struct pg_class_tuple *tuple;
+	int i;
+
+	for (i = 0; i < dec->tuple_count; i++) {
+		tuple = &dec->tuples[i];
+		if (tuple->deleted == deleted)
+			_pg_add_tuple(tuple);
+	}
 }
 
 
 /*
- * Reads one page from the provided file pointer.
+ * Decode a list of pages ('blocks' are their numbers in pg_class) and add
+ * their tuples to the rn_cache.
  *
- * Returns NULL if we can't read an entire header or an entire page.
+ * Large lists are split in contiguous ranges across a few threads, the
+ * rn_cache is not thread-safe so each thread fills its own buffer. The buffers
+ * are merged in page order (deletions first), the result is the same as a
+ * sequential scan.
  */
-Page *
-pg_read_page(FILE *fp)
+void
+_pg_decode_pages(char **pages, BlockNumber *blocks, int count)
 {
-	int l;
-	PageHeaderData *ph;
-	Page *p;
+	struct pg_decoder *decoders, *dec;
+	int i, n = 1, chunk, ret;
+
+	if (count >= PG_DECODER_MIN_PAGES * 2) {
+		n = MIN(sysconf(_SC_NPROCESSORS_ONLN), PG_DECODER_MAX_THREADS);
+		n = MAX(MIN(n, count / PG_DECODER_MIN_PAGES), 1);
+	}
+
+	decoders = xcalloc(n, sizeof(struct pg_decoder));
+	chunk = (count + n - 1) / n;
 
-	/* Read the page header */
-	ph = xmalloc(SizeOfPageHeaderData);
-	if (fread(ph, SizeOfPageHeaderData, 1, fp) != 1) {
-		xfree(ph);
-		if (feof(fp))
-			return NULL;
-		errx(1, "unable to read page header");
+	for (i = 0; i < n; i++) {
+		dec = &decoders[i];
+		dec->pages = pages + i * chunk;
+		dec->blocks = blocks + i * chunk;
+		dec->page_count = MAX(MIN(chunk, count - i * chunk), 0);
 	}
 
-	/* Fill the rest of the data */
-	p = xrealloc(ph, 1, PageGetPageSize(ph));
-	l = fread((void *)p + SizeOfPageHeaderData,
-			PageGetPageSize(p) - SizeOfPageHeaderData, 1, fp);
-	if (l != 1) {
-		xfree(p);
-		if (feof(fp))
-			return NULL;
-		errx(1, "pg_read_page:fread()");
+	/* The first range is decoded by this thread. */
+	for (i = 1; i < n; i++) {
+		ret = pthread_create(&decoders[i].thread, NULL, _pg_decoder_run,
+				&decoders[i]);
+		if (ret != 0) {
+			errno = ret;
+			err(1, "pthread_create");
+		}
 	}
 
-	return p;
+	_pg_decoder_run(&decoders[0]);
+
+	for (i = 1; i < n; i++)
+		pthread_join(decoders[i].thread, NULL);
+
+	/* The deletions first, they only remove what they inserted. */
+	for (i = 0; i < n; i++)
+		_pg_decoder_merge(&decoders[i], 1);
+
+	for (i = 0; i < n; i++) {
+		_pg_decoder_merge(&decoders[i], 0);
+		if (decoders[i].tuples != NULL)
+			xfree(decoders[i].tuples);
+	}
+
+	debug("pg_class: %d pages decoded by %d thread(s)\n", count, n);
+
+	xfree(decoders);
 }
 
 
-void
-pg_load_rn_cache_from_page(Page *p)
+/*
+ * Map all the segments of a relation read-only. The segments are appended
+ * to 'maps', the number of pages is returned.
+ */
+int
+_pg_map_relation(char *filepath, struct pg_mapping **maps, int *map_count)
 {
-	int i, count;
-	PageHeaderData *ph;
-	HeapTupleHeaderData *hthd;
-	FormData_pg_class *ci;
-	ItemIdData *pd_linp;
-	Oid id;
+	char path[MAXPGPATH];
+	struct stat sb;
+	struct pg_mapping *map;
+	size_t size;
+	int fd, segment, pages = 0;
 
-	ph = (PageHeaderData *)p;
-	count = (ph->pd_lower - SizeOfPageHeaderData) / sizeof(ItemIdData);
+	for (segment = 0;; segment++) {
+		if (segment == 0)
+			strlcpy(path, filepath, sizeof(path));
+		else
+			snprintf(path, sizeof(path), "%s.%d", filepath,
+					segment);
 
-	for (i = 0; i < count; i++) {
-		pd_linp = PageGetItemId(p, i + 1);
+		fd = open(path, O_RDONLY);
+		if (fd == -1) {
+			if (segment > 0 && errno == ENOENT)
+				break;
+			err(1, "unable to open %s", path);
+		}
 
-		/* Strip out dead, redirects, etc. */
-		if (pd_linp->lp_flags != LP_NORMAL)
+		if (fstat(fd, &sb) == -1)
+			err(1, "unable to stat %s", path);
+
+		/* A page being added may be incomplete. */
+		size = sb.st_size - sb.st_size % BLCKSZ;
+
+		if (size > 0) {
+			*maps = xrealloc(*maps, *map_count + 1,
+					sizeof(struct pg_mapping));
+			map = &(*maps)[(*map_count)++];
+			map->size = size;
+			map->addr = mmap(NULL, size, PROT_READ, MAP_SHARED,
+					fd, 0);
+			if (map->addr == MAP_FAILED)
+				err(1, "unable to map %s", path);
+			pages += size / BLCKSZ;
+		}
+
+		close(fd);
+
+		/* Only the last segment is not full. */
+		if (size < (size_t)RELSEG_SIZE * BLCKSZ)
+			break;
+	}
+
+	return pages;
+}
+
+
+/*
+ * VACUUM can truncate the empty pages at the end of pg_class while we read
+ * its mapping, touching them then raises SIGBUS (in whichever thread). Those
+ * pages are replaced with zeros, which is what a new page holds and what they
+ * had before being truncated as far as we are concerned: no tuple. Any other
+ * SIGBUS is not ours, it is raised again with the default action.
+ */
+void
+_pg_sigbus_handler(int sig, siginfo_t *info, void *context)
+{
+	char *addr = info->si_addr, *page;
+	int i;
+
+	for (i = 0; i < pg_scan_map_count; i++) {
+		if (addr < pg_scan_maps[i].addr ||
+				addr >= pg_scan_maps[i].addr +
+				pg_scan_maps[i].size)
 			continue;
 
-		hthd = (HeapTupleHeaderData *)PageGetItem(p, pd_linp);
+		page = (char *)((uintptr_t)addr & ~(pg_scan_page_size - 1));
+		if (mmap(page, pg_scan_page_size, PROT_READ,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+				-1, 0) != MAP_FAILED)
+			return;
+		break;
+	}
 
-		ci = (FormData_pg_class *)((void *)hthd + hthd->t_hoff);
+	signal(SIGBUS, SIG_DFL);
+}
 
-		/* If this tuple has an OID, that's the OID of our table. */
-		if (hthd->t_infomask & HEAP_HASOID)
-			id = *((Oid *)((void *)ci - sizeof(Oid)));
+
+/*
+ * Count the pages of all the segments of a relation.
+ */
+int
+_pg_count_pages(char *filepath)
+{
+	char path[MAXPGPATH];
+	struct stat sb;
+	int segment, pages = 0;
+
+	for (segment = 0;; segment++) {
+		if (segment == 0)
+			strlcpy(path, filepath, sizeof(path));
 		else
-			id = 0;
+			snprintf(path, sizeof(path), "%s.%d", filepath,
+					segment);
+
+		if (stat(path, &sb) == -1)
+			break;
+
+		pages += sb.st_size / BLCKSZ;
+		if (sb.st_size < (off_t)RELSEG_SIZE * BLCKSZ)
+			break;
+	}
+
+	return pages;
+}
+
+
+/*
+ * Scan the pg_class table and decode the pages that changed since the last
+ * scan, starting at page 'first'. The relation is mapped, only the headers of
+ * the other pages are touched. The pages before 'first' are skipped, their
+ * LSN is unknown. The mapping is guarded against truncation by
+ * _pg_sigbus_handler().
+ *
+ * Returns the number of pages decoded.
+ */
+int
+_pg_scan_pg_class(int first)
+{
+	char *pg_class_filepath, *p, **pages;
+	BlockNumber *blocks;
+	struct pg_mapping *maps = NULL;
+	struct sigaction sa, osa;
+	Oid filenode;
+	uint64 lsn;
+	int i, j, count, known, map_count = 0, decoded = 0;
+
+	pg_class_filepath = pg_get_pg_class_filepath(false);
+	if (pg_class_filepath == NULL)
+		return 0;
+
+	debug("pg_class is located at %s\n", pg_class_filepath);
+
+	/* pg_class was rewritten (VACUUM FULL), none of the LSNs apply. */
+	filenode = pg_get_pg_class_filenode();
+	if (filenode != pg_class_filenode) {
+		pg_class_filenode = filenode;
+		pg_class_page_count = 0;
+	}
+
+	count = _pg_map_relation(pg_class_filepath, &maps, &map_count);
+	known = MIN(count, pg_class_page_count);
+	if (count > pg_class_page_count)
+		pg_class_lsns = xrealloc(pg_class_lsns, count, sizeof(uint64));
+	pg_class_page_count = count;
+
+	pages = xcalloc(MAX(count, 1), sizeof(char *));
+	blocks = xcalloc(MAX(count, 1), sizeof(BlockNumber));
+
+	pg_scan_maps = maps;
+	pg_scan_map_count = map_count;
+	pg_scan_page_size = sysconf(_SC_PAGESIZE);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = _pg_sigbus_handler;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGBUS, &sa, &osa);
+
+	for (i = 0, j = 0; j < map_count; j++) {
+		for (p = maps[j].addr; p < maps[j].addr + maps[j].size;
+				p += BLCKSZ, i++) {
+			if (i < first) {
+				pg_class_lsns[i] = PG_CLASS_LSN_UNKNOWN;
+				continue;
+			}
+
+			/* pd_lsn is 8 bytes in every release, whatever its
+			 * type. */
+			memcpy(&lsn, &((PageHeaderData *)p)->pd_lsn,
+					sizeof(lsn));
+			if (i < known && pg_class_lsns[i] == lsn)
+				continue;
+
+			pg_class_lsns[i] = lsn;
+			blocks[decoded] = i;
+			pages[decoded++] = p;
+		}
+	}
+
+	if (decoded > 0)
+		_pg_decode_pages(pages, blocks, decoded);
+
+	sigaction(SIGBUS, &osa, NULL);
+	pg_scan_map_count = 0;
 
-		ci = (FormData_pg_class *)((void *)hthd + hthd->t_hoff);
+	for (j = 0; j < map_count; j++)
+		munmap(maps[j].addr, maps[j].size);
 
-		rn_cache_add(RN_ORIGIN_PGCLASS, id, ci->relfilenode,
-				NameStr(ci->relname));
+	debug("pg_class: %d/%d pages decoded\n", decoded, count);
+
+	if (maps != NULL)
+		xfree(maps);
+	xfree(pages);
+	xfree(blocks);
+	xfree(pg_class_filepath);
+
+	return decoded;
+}
+
+
+/*
+ * Check that both pg_class indexes can be walked.
+ */
+int
+_pg_index_check(void)
+{
+	Oid indexes[] = { ClassOidIndexId, ClassTblspcRelfilenodeIndexId };
+	char *filepath;
+	int i, valid;
+
+	for (i = 0; i < (int)(sizeof(indexes) / sizeof(Oid)); i++) {
+		if (indexes[i] == InvalidOid)
+			return 0;
+
+		filepath = _pg_get_mapped_filepath(indexes[i]);
+		if (filepath == NULL)
+			return 0;
+		valid = btree_check(filepath);
+		xfree(filepath);
+		if (!valid)
+			return 0;
 	}
+
+	return 1;
 }
 
 
 /*
- * Find a relname based either on filenode or oid. This is not super pretty,
- * but until refactored, whichever one is not InvalidOid is the one used for
- * filtering.
+ * Initial load of the rn_cache from pg_class. If its indexes can be used, we
+ * don't load anything, each relation is looked up when needed.
  */
 void
 pg_load_rn_cache_from_pg_class(bool shared)
 {
-	FILE *fp;
-	char *pg_class_filepath;
-	Page *p;
+	char *filepath;
 
-	pg_class_filepath = pg_get_pg_class_filepath(shared);
-	if (pg_class_filepath == NULL)
+	if (shared)
 		return;
 
-	fp = fopen(pg_class_filepath, "rb");
-	while ((p = pg_read_page(fp)) != NULL) {
-		pg_load_rn_cache_from_page(p);
-		xfree(p);
+	if (_pg_index_check()) {
+		debug("pg_class: using index lookups\n");
+		pg_class_use_index = 1;
+		pg_class_loaded = 1;
+		filepath = pg_get_pg_class_filepath(false);
+		if (filepath == NULL)
+			errx(1, "pg_class disappeared from the relmap");
+		pg_class_index_pages = _pg_count_pages(filepath);
+		xfree(filepath);
+
+		/* The relations already in the rn_cache are never looked up
+		 * again, only a current snapshot can be trusted. */
+		if (snapshot_load() == SNAPSHOT_STALE) {
+			rn_cache_clear();
+			pg_class_page_count = 0;
+		}
+		return;
 	}
-	fclose(fp);
+
+	/* A stale snapshot still saves us from decoding the pages that didn't
+	 * change since. */
+	if (snapshot_load() != SNAPSHOT_CURRENT && _pg_scan_pg_class(0) > 0)
+		snapshot_save();
+
+	pg_class_refreshed = time(NULL);
+	pg_class_dirty = 0;
+	pg_class_loaded = 1;
+}
+
+
+/*
+ * Return the line pointer of the first tuple of a HOT chain, following the
+ * redirect left by pruning in place of its root. 0 if there is none.
+ */
+OffsetNumber
+_pg_hot_chain_start(char *page, OffsetNumber offnum)
+{
+	ItemIdData *lp;
+
+	if (offnum < 1 || offnum > _pg_page_get_item_count(page))
+		return 0;
+
+	lp = PageGetItemId(page, offnum);
+	if (lp->lp_flags != LP_REDIRECT)
+		return offnum;
+
+	offnum = lp->lp_off;
+	if (offnum < 1 || offnum > _pg_page_get_item_count(page))
+		return 0;
+
+	return offnum;
+}
+
+
+/*
+ * Look for a pg_class tuple through one of its indexes, add it to the
+ * rn_cache. 'match' tells if a decoded tuple is the one we want, the TID we
+ * get from the index may be stale.
+ *
+ * The index points at the root of a HOT chain, the versions of the row
+ * updated since (VACUUM and ANALYZE do it all the time) follow on the same
+ * page. We can't check their visibility but we prefer the ones not deleted
+ * or updated, the last of the chain.
+ *
+ * Returns 1 if it was found, 0 if not, -1 if the index can't be walked.
+ */
+int
+_pg_index_fetch(Oid indexid, Oid *keys, int nkeys,
+		int (*match)(struct pg_class_tuple *, Oid *))
+{
+	ItemPointerData tids[PG_INDEX_MAX_MATCHES];
+	struct pg_class_tuple tuple, found;
+	char *index_filepath, *heap_filepath, *page, *relname = NULL;
+	BlockNumber block;
+	OffsetNumber offnum;
+	TransactionId prior_xmax;
+	int i, hops, count, result;
+
+	index_filepath = _pg_get_mapped_filepath(indexid);
+	heap_filepath = pg_get_pg_class_filepath(false);
+	if (index_filepath == NULL || heap_filepath == NULL)
+		errx(1, "pg_class or its index disappeared from the relmap");
+
+	count = btree_lookup(index_filepath, keys, nkeys, tids,
+			PG_INDEX_MAX_MATCHES);
+
+	page = xmalloc(BLCKSZ);
+
+	for (i = 0; i < count; i++) {
+		block = ItemPointerGetBlockNumber(&tids[i]);
+		if (pg_read_block(heap_filepath, block, page) == -1)
+			continue;
+
+		offnum = _pg_hot_chain_start(page,
+				ItemPointerGetOffsetNumber(&tids[i]));
+		prior_xmax = InvalidTransactionId;
+
+		/* A chain can't be longer than the page, don't loop. */
+		for (hops = 0; offnum != 0 && hops < PG_MAX_HOT_CHAIN;
+				hops++) {
+			if (offnum > _pg_page_get_item_count(page) ||
+					!_pg_decode_tuple(page, block, offnum,
+						&tuple))
+				break;
+
+			/* The slot was reused, the chain is over. */
+			if (hops > 0 && (!tuple.heap_only ||
+					(prior_xmax != InvalidTransactionId &&
+					 tuple.xmin != prior_xmax)))
+				break;
+
+			prior_xmax = tuple.xmax;
+			offnum = tuple.hot_next;
+
+			if (!match(&tuple, keys))
+				continue;
+
+			if (relname != NULL && (!tuple.xmax_invalid ||
+						found.xmax_invalid))
+				continue;
+
+			/* The relname points within the page, keep a copy. */
+			if (relname != NULL)
+				xfree(relname);
+			relname = xstrdup(tuple.relname);
+			found = tuple;
+			found.relname = relname;
+		}
+	}
+
+	result = (count == -1) ? -1 : 0;
+	if (relname != NULL) {
+		_pg_add_tuple(&found);
+		xfree(relname);
+		result = 1;
+	}
+
+	xfree(page);
+	xfree(index_filepath);
+	xfree(heap_filepath);
+
+	return result;
+}
+
+
+/*
+ * Check if a tuple found through pg_class_tblspc_relfilenode_index is the
+ * right one.
+ */
+int
+_pg_match_filenode(struct pg_class_tuple *tuple, Oid *keys)
+{
+	return tuple->tablespace == keys[0] && tuple->filenode == keys[1];
+}
+
+
+/*
+ * Check if a tuple found through pg_class_oid_index is the right one.
+ */
+int
+_pg_match_oid(struct pg_class_tuple *tuple, Oid *keys)
+{
+	return tuple->oid == keys[0];
+}
+
+
+/*
+ * Did we look for this key recently without finding it? A relation we can't
+ * find is likely to be asked for again on every event.
+ */
+int
+_pg_index_recent_miss(Oid indexid, Oid key)
+{
+	struct pg_index_miss *miss;
+
+	miss = &pg_index_misses[key % PG_INDEX_MISS_CACHE_SIZE];
+
+	return miss->indexid == indexid && miss->key == key &&
+		time(NULL) - miss->when < PG_CLASS_REFRESH_INTERVAL;
+}
+
+
+/*
+ * Remember that the index didn't have this key.
+ */
+void
+_pg_index_add_miss(Oid indexid, Oid key)
+{
+	struct pg_index_miss *miss;
+
+	miss = &pg_index_misses[key % PG_INDEX_MISS_CACHE_SIZE];
+	miss->indexid = indexid;
+	miss->key = key;
+	miss->when = time(NULL);
+}
+
+
+/*
+ * Look for a relation through one of the pg_class indexes, or refresh the
+ * whole rn_cache if we can't use them. A miss is remembered and falls back to
+ * a refresh of the pages added to pg_class since we started using the index,
+ * if the index can't be walked at all we go back to loading all of pg_class
+ * for good.
+ *
+ * Returns 1 if the rn_cache may have something new.
+ */
+int
+_pg_lookup(Oid indexid, Oid *keys, int nkeys,
+		int (*match)(struct pg_class_tuple *, Oid *))
+{
+	if (!pg_class_use_index)
+		return pg_refresh_rn_cache_from_pg_class() > 0;
+
+	if (_pg_index_recent_miss(indexid, keys[nkeys - 1]))
+		return 0;
+
+	switch (_pg_index_fetch(indexid, keys, nkeys, match)) {
+	case 1:
+		pg_class_unsaved = 1;
+		return 1;
+	case -1:
+		warnx("unable to use the pg_class indexes, loading pg_class");
+		pg_class_use_index = 0;
+		pg_class_page_count = 0;
+		_pg_scan_pg_class(0);
+		pg_class_refreshed = time(NULL);
+		return 1;
+	default:
+		/*
+		 * Not in the index, or not where it points: the table has the
+		 * last word. The index stays in use for the next lookups.
+		 */
+		_pg_index_add_miss(indexid, keys[nkeys - 1]);
+		if (pg_refresh_rn_cache_from_pg_class() == 0)
+			return 0;
+		pg_class_unsaved = 1;
+		return 1;
+	}
+}
+
+
+/*
+ * Find the relname of a filenode missing from the rn_cache, NULL if it is
+ * still unknown.
+ */
+char *
+pg_lookup_filenode(Oid filenode)
+{
+	/* Our files are all in the default tablespace, stored as 0. */
+	Oid keys[2] = { InvalidOid, filenode };
+
+	if (!_pg_lookup(ClassTblspcRelfilenodeIndexId, keys, 2,
+				_pg_match_filenode))
+		return NULL;
+
+	return rn_cache_get_from_filenode(filenode);
+}
+
+
+/*
+ * Find the relname of an oid missing from the rn_cache, NULL if it is still
+ * unknown.
+ */
+char *
+pg_lookup_oid(Oid oid)
+{
+	Oid keys[1] = { oid };
+
+	if (!_pg_lookup(ClassOidIndexId, keys, 1, _pg_match_oid))
+		return NULL;
+
+	return rn_cache_get_from_oid(oid);
+}
+
+
+/*
+ * Bring the rn_cache up to date with pg_class, this is called when we fail
+ * to resolve a filenode. To avoid reading pg_class headers on every miss, this
+ * only happens once every PG_CLASS_REFRESH_INTERVAL seconds, unless a write
+ * to pg_class was seen. With the indexes, only the pages added since we
+ * started using them are read.
+ *
+ * Returns the number of pages decoded, zero means nothing new.
+ */
+int
+pg_refresh_rn_cache_from_pg_class(void)
+{
+	time_t now;
+
+	now = time(NULL);
+	if (!pg_class_dirty &&
+			now - pg_class_refreshed < PG_CLASS_REFRESH_INTERVAL)
+		return 0;
+
+	pg_class_refreshed = now;
+	pg_class_dirty = 0;
+
+	/* The index has everything but the pages added since we use it. */
+	if (pg_class_use_index)
+		return _pg_scan_pg_class(pg_class_index_pages);
+
+	return _pg_scan_pg_class(0);
+}
+
+
+/*
+ * The traced process wrote to pg_class, the next refresh can't wait.
+ */
+void
+pg_class_mark_dirty(void)
+{
+	pg_class_dirty = 1;
+	memset(pg_index_misses, 0, sizeof(pg_index_misses));
+}
+
+
+/*
+ * Returns the catalog state of a database we've seen, NULL if it's new.
+ */
+struct pg_database *
+_pg_get_database(Oid oid)
+{
+	int i;
+
+	for (i = 0; i < pg_database_count; i++)
+		if (pg_databases[i].oid == oid)
+			return &pg_databases[i];
+
+	return NULL;
+}
+
+
+/*
+ * Move the catalog state of the current database out of the globals.
+ */
+void
+_pg_save_database(struct pg_database *db)
+{
+	rn_cache_save(&db->rn_cache);
+	db->class_loaded = pg_class_loaded;
+	db->class_filenode = pg_class_filenode;
+	db->class_lsns = pg_class_lsns;
+	db->class_page_count = pg_class_page_count;
+	db->class_refreshed = pg_class_refreshed;
+	db->class_dirty = pg_class_dirty;
+	db->class_use_index = pg_class_use_index;
+	db->class_index_pages = pg_class_index_pages;
+	db->class_unsaved = pg_class_unsaved;
+	memcpy(db->index_misses, pg_index_misses, sizeof(pg_index_misses));
+}
+
+
+/*
+ * Put the catalog state of a database back in the globals.
+ */
+void
+_pg_restore_database(struct pg_database *db)
+{
+	rn_cache_restore(&db->rn_cache);
+	pg_class_loaded = db->class_loaded;
+	pg_class_filenode = db->class_filenode;
+	pg_class_lsns = db->class_lsns;
+	pg_class_page_count = db->class_page_count;
+	pg_class_refreshed = db->class_refreshed;
+	pg_class_dirty = db->class_dirty;
+	pg_class_use_index = db->class_use_index;
+	pg_class_index_pages = db->class_index_pages;
+	pg_class_unsaved = db->class_unsaved;
+	memcpy(pg_index_misses, db->index_misses, sizeof(pg_index_misses));
+}
+
+
+/*
+ * Save the snapshots of the databases whose rn_cache was filled through the
+ * pg_class indexes, the ones loaded from a scan were saved right away.
+ */
+void
+_pg_save_snapshots(void)
+{
+	int i;
+
+	for (i = 0; i < pg_database_count; i++) {
+		pg_switch_database(pg_databases[i].oid);
+		if (pg_class_use_index && pg_class_unsaved) {
+			snapshot_save();
+			pg_class_unsaved = 0;
+		}
+	}
+}
+
+
+/*
+ * Make 'oid' the current database, the one whose catalog is used to resolve
+ * the relations. The state of the previous one is kept aside, a database seen
+ * for the first time starts empty: its pg_class and relation map are only
+ * loaded when one of its relations needs a name.
+ */
+void
+pg_switch_database(Oid oid)
+{
+	struct pg_database *db;
+
+	if (oid == current_database_oid || oid == InvalidOid)
+		return;
+
+	if (current_database_oid != InvalidOid)
+		_pg_save_database(_pg_get_database(current_database_oid));
+
+	db = _pg_get_database(oid);
+	if (db == NULL) {
+		if (pg_database_count == 0)
+			atexit(_pg_save_snapshots);
+		pg_databases = xrealloc(pg_databases, pg_database_count + 1,
+				sizeof(struct pg_database));
+		db = &pg_databases[pg_database_count++];
+		memset(db, 0, sizeof(struct pg_database));
+		db->oid = oid;
+		debug("pg: found database %u (%d databases)\n", oid,
+				pg_database_count);
+	}
+
+	_pg_restore_database(db);
+	current_database_oid = oid;
+}
+
+
+/*
+ * Returns the first database whose files were seen, the one of the traced
+ * backend most of the time. InvalidOid if none yet.
+ */
+Oid
+pg_get_main_database(void)
+{
+	if (pg_database_count == 0)
+		return InvalidOid;
+
+	return pg_databases[0].oid;
+}
+
+
+/*
+ * Record a row of pg_database. Dead versions of a row may still be around,
+ * the live one wins.
+ */
+void
+_pg_add_datname(Oid oid, char *name, int live)
+{
+	struct pg_datname *dn;
+	int i;
+
+	for (i = 0; i < pg_datname_count; i++) {
+		dn = &pg_datnames[i];
+		if (dn->oid != oid)
+			continue;
+		if (live || !dn->live) {
+			dn->live = live;
+			strlcpy(dn->name, name, sizeof(dn->name));
+		}
+		return;
+	}
+
+	pg_datnames = xrealloc(pg_datnames, pg_datname_count + 1,
+			sizeof(struct pg_datname));
+	dn = &pg_datnames[pg_datname_count++];
+	dn->oid = oid;
+	dn->live = live;
+	strlcpy(dn->name, name, sizeof(dn->name));
+}
+
+
+/*
+ * Read all the rows of pg_database, a shared catalog found through the shared
+ * relation map. It only has a few pages, they are read as-is.
+ */
+void
+_pg_load_datnames(void)
+{
+	HeapTupleHeaderData *hthd;
+	FormData_pg_database *di;
+	char path[MAXPGPATH], *page;
+	Oid filenode;
+	uint32 blkno;
+	int i, count;
+
+	if (current_cluster_path == NULL)
+		return;
+
+	load_relmap_file(true);
+	filenode = RelationMapOidToFilenode(DatabaseRelationId, true);
+	if (filenode == InvalidOid)
+		return;
+
+	snprintf(path, sizeof(path), "%s/global/%u", current_cluster_path,
+			filenode);
+
+	page = xmalloc(BLCKSZ);
+	pg_datname_count = 0;
+
+	for (blkno = 0; pg_read_block(path, blkno, page) == 0; blkno++) {
+		count = _pg_page_get_item_count(page);
+		for (i = 1; i <= count; i++) {
+			hthd = _pg_get_tuple(page, i,
+					sizeof(FormData_pg_database));
+			if (hthd == NULL)
+				continue;
+
+			di = (FormData_pg_database *)((void *)hthd +
+					hthd->t_hoff);
+			_pg_add_datname(_pg_get_tuple_oid(hthd),
+					NameStr(di->datname),
+					(hthd->t_infomask & HEAP_XMAX_INVALID) != 0);
+		}
+	}
+
+	debug("pg_database: %d databases in %u pages\n", pg_datname_count,
+			blkno);
+
+	xfree(page);
+}
+
+
+/*
+ * Returns the name of a database we've read from pg_database, NULL if none.
+ */
+char *
+_pg_find_datname(Oid oid)
+{
+	int i;
+
+	for (i = 0; i < pg_datname_count; i++)
+		if (pg_datnames[i].oid == oid)
+			return pg_datnames[i].name;
+
+	return NULL;
+}
+
+
+/*
+ * Returns the name of a database, NULL if it's not in pg_database.
+ * pg_database is read the first time and again when we're asked for a
+ * database we don't know about, at most once every PG_CLASS_REFRESH_INTERVAL
+ * seconds.
+ */
+char *
+pg_get_database_name(Oid oid)
+{
+	char *name;
+	time_t now;
+
+	name = _pg_find_datname(oid);
+	if (name != NULL)
+		return name;
+
+	now = time(NULL);
+	if (pg_datnames_loaded != 0 &&
+			now - pg_datnames_loaded < PG_CLASS_REFRESH_INTERVAL)
+		return NULL;
+
+	pg_datnames_loaded = now;
+	_pg_load_datnames();
+
+	return _pg_find_datname(oid);
 }
@@ -15,4 +15,40 @@
  */
 
 
+/* Minimum delay between two pg_class refreshes, in seconds. */
+#define PG_CLASS_REFRESH_INTERVAL	1
+
+/*
+ * pg_class pages are decoded by up to PG_DECODER_MAX_THREADS threads, each
+ * with at least PG_DECODER_MIN_PAGES pages, below that it's not worth it.
+ */
+#define PG_DECODER_MAX_THREADS	8
+#define PG_DECODER_MIN_PAGES	64
+
+/* Growth of the tuple buffer of a decoder. */
+#define PG_DECODER_GROWTH	1024
+
+/* Longest HOT chain followed from an index entry, one per line pointer. */
+#define PG_MAX_HOT_CHAIN	(BLCKSZ / sizeof(ItemIdData))
+
+/* Maximum versions of a pg_class tuple considered in an index lookup. */
+#define PG_INDEX_MAX_MATCHES	16
+
+/* LSN of the pg_class pages we skipped, it never matches a real page. */
+#define PG_CLASS_LSN_UNKNOWN	(~(uint64)0)
+
+/* Number of index misses remembered, to avoid repeating them. */
+#define PG_INDEX_MISS_CACHE_SIZE	64
+
+
+Oid		 pg_get_pg_class_filenode(void);
+char		*pg_get_pg_class_filepath(bool);
+int		 pg_read_block(char *, uint32, char *);
+char		*pg_lookup_filenode(Oid);
+char		*pg_lookup_oid(Oid);
 void		 pg_load_rn_cache_from_pg_class(bool);
+int		 pg_refresh_rn_cache_from_pg_class(void);
+void		 pg_class_mark_dirty(void);
+void		 pg_switch_database(Oid);
+Oid		 pg_get_main_database(void);
+char		*pg_get_database_name(Oid);
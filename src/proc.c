@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ *
+ * Direct access to the /proc filesystem of Linux. Everything we would ask
+ * lsof or ps for is there, without forking anything.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <err.h>
+
+#include "proc.h"
+#include "utils.h"
+#include "xmalloc.h"
+
+
+/*
+ * Read the current position of a file descriptor from its fdinfo entry,
+ * returns -1 if it is not available.
+ */
+off_t
+_proc_get_fd_pos(pid_t pid, int fd)
+{
+	FILE *fp;
+	char path[MAXPATHLEN], line[MAX_LINE_LENGTH];
+	off_t pos = -1;
+
+	snprintf(path, sizeof(path), "/proc/%d/fdinfo/%d", (int)pid, fd);
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, "pos:", 4) == 0) {
+			pos = strtoll(line + 4, NULL, 10);
+			break;
+		}
+	}
+
+	fclose(fp);
+
+	return pos;
+}
+
+
+/*
+ * Walk all the file descriptors of a process, calling the provided function
+ * with the fd, the path it points to and its current position. Descriptors
+ * closed while we walk are skipped.
+ *
+ * Returns -1 if the process can't be inspected, with errno set.
+ */
+int
+proc_read_fds(pid_t pid, void (*func_handler)(int, char *, off_t))
+{
+	DIR *dir;
+	struct dirent *de;
+	char path[MAXPATHLEN], target[MAXPATHLEN];
+	ssize_t l;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+
+	dir = opendir(path);
+	if (dir == NULL)
+		return -1;
+
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		fd = xatoi_or_zero(de->d_name);
+		if (fd == 0 && strcmp(de->d_name, "0") != 0)
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int)pid, fd);
+		l = readlink(path, target, sizeof(target) - 1);
+		if (l == -1)
+			continue;
+		target[l] = '\0';
+
+		func_handler(fd, target, _proc_get_fd_pos(pid, fd));
+	}
+
+	closedir(dir);
+
+	return 0;
+}
+
+
+/*
+ * Return the parent pid of a process from its stat entry, -1 if the process
+ * is gone. The command name is between parentheses and may contain anything,
+ * the fields we want are after the last one.
+ */
+pid_t
+proc_get_ppid(pid_t pid)
+{
+	FILE *fp;
+	char path[MAXPATHLEN], line[MAX_LINE_LENGTH], *c;
+	char state;
+	int ppid;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+
+	c = fgets(line, sizeof(line), fp);
+	fclose(fp);
+
+	if (c == NULL || (c = strrchr(line, ')')) == NULL)
+		return -1;
+
+	if (sscanf(c + 1, " %c %d", &state, &ppid) != 2)
+		return -1;
+
+	return ppid;
+}
+
+
+/*
+ * Read the command line of a process in 'buf', the arguments separated by
+ * spaces. This is where postgres shows its process title.
+ *
+ * Returns the length of the command line, -1 if the process is gone.
+ */
+int
+proc_read_cmdline(pid_t pid, char *buf, size_t size)
+{
+	char path[MAXPATHLEN];
+	ssize_t len, i;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/cmdline", (int)pid);
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	len = read(fd, buf, size - 1);
+	close(fd);
+
+	if (len == -1)
+		return -1;
+
+	/* The title may be padded with NULs or spaces. */
+	for (i = 0; i < len; i++)
+		if (buf[i] == '\0')
+			buf[i] = ' ';
+	while (len > 0 && buf[len - 1] == ' ')
+		len--;
+	buf[len] = '\0';
+
+	return len;
+}
+
+
+/*
+ * Return the current working directory of a process, NULL if it can't be
+ * inspected. The string is allocated, it is for the caller to free.
+ */
+char *
+proc_get_cwd(pid_t pid)
+{
+	char path[MAXPATHLEN], target[MAXPATHLEN];
+	ssize_t l;
+
+	snprintf(path, sizeof(path), "/proc/%d/cwd", (int)pid);
+
+	l = readlink(path, target, sizeof(target) - 1);
+	if (l == -1)
+		return NULL;
+	target[l] = '\0';
+
+	return xstrdup(target);
+}
+
+
+/*
+ * Call the provided function for every child of 'ppid'.
+ *
+ * Returns -1 if /proc can't be read, with errno set.
+ */
+int
+proc_read_children(pid_t ppid, void (*func_handler)(pid_t))
+{
+	DIR *dir;
+	struct dirent *de;
+	pid_t pid;
+
+	dir = opendir("/proc");
+	if (dir == NULL)
+		return -1;
+
+	while ((de = readdir(dir)) != NULL) {
+		pid = xatoi_or_zero(de->d_name);
+		if (pid <= 0)
+			continue;
+
+		if (proc_get_ppid(pid) == ppid)
+			func_handler(pid);
+	}
+
+	closedir(dir);
+
+	return 0;
+}
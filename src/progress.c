@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * Progress of the scans: where the reads are within each relation fork and
+ * how fast they move. Relations are split in segments of RELSEG_SIZE blocks
+ * (1 GiB), the position within the whole fork is the segment number and the
+ * offset within the segment. The size of the fork is the sum of the size of
+ * its segments, stat'd every now and then, or what the backend learnt when it
+ * probed the size of a segment with lseek(fd, 0, SEEK_END).
+ *
+ * Like relstat, the records are read from the top mode thread through
+ * progress_copy(). A backend only reads a handful of relations at once, the
+ * pfd keeps the position of its record to avoid the lookups.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <postgres.h>
+
+#include "pfd.h"
+#include "progress.h"
+#include "strlcpy.h"
+#include "utils.h"
+#include "xmalloc.h"
+
+
+/* Size of a full segment, in bytes. */
+#define SEGMENT_SIZE		((off_t)RELSEG_SIZE * BLCKSZ)
+
+
+progress *progress_pool = NULL;
+int progress_count = 0;
+int progress_pool_size = 0;
+
+pthread_mutex_t progress_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Returns 1 if the record is the one of the fork behind this pfd.
+ */
+int
+_progress_match(progress *p, pfd_t *pfd)
+{
+	return p->filenode == pfd->filenode && p->shared == pfd->shared &&
+		p->database_oid == pfd->database_oid &&
+		p->file_type == pfd->file_type;
+}
+
+
+/*
+ * Returns a copy of the path of the first segment of a fork, without the
+ * ".N" suffix of the other segments.
+ */
+char *
+_progress_get_base_path(char *filepath)
+{
+	char *path, *c;
+
+	path = xstrdup(filepath);
+
+	c = strrchr(path, '.');
+	if (c != NULL && c[1] != '\0' && strchr(c, '/') == NULL &&
+			strspn(c + 1, "0123456789") == strlen(c + 1))
+		*c = '\0';
+
+	return path;
+}
+
+
+/*
+ * Find the record of the fork behind a pfd, create it if this is the first
+ * time we see it. Called with the mutex held.
+ */
+progress *
+_progress_get(pfd_t *pfd)
+{
+	progress *p;
+	int i;
+
+	if (pfd->progress > 0 && pfd->progress <= progress_count &&
+			_progress_match(&progress_pool[pfd->progress - 1], pfd))
+		return &progress_pool[pfd->progress - 1];
+
+	for (i = 0; i < progress_count; i++) {
+		if (_progress_match(&progress_pool[i], pfd)) {
+			pfd->progress = i + 1;
+			return &progress_pool[i];
+		}
+	}
+
+	if (progress_count == progress_pool_size) {
+		progress_pool_size += MAX(progress_pool_size, PROGRESS_GROWTH);
+		progress_pool = xrealloc(progress_pool, progress_pool_size,
+				sizeof(progress));
+	}
+
+	p = &progress_pool[progress_count];
+	memset(p, 0, sizeof(progress));
+	p->database_oid = pfd->database_oid;
+	p->filenode = pfd->filenode;
+	p->shared = pfd->shared;
+	p->file_type = pfd->file_type;
+	if (pfd->filepath != NULL)
+		p->filepath = _progress_get_base_path(pfd->filepath);
+
+	pfd->progress = ++progress_count;
+
+	return p;
+}
+
+
+/*
+ * Add up the size of all the segments of a fork, they are named after the
+ * first one with a ".N" suffix. The last one is the only one not full.
+ */
+void
+_progress_stat(progress *p, double now)
+{
+	char path[MAXPATHLEN];
+	struct stat st;
+	off_t size = 0;
+	int i;
+
+	p->stat_time = now;
+
+	if (p->filepath == NULL)
+		return;
+
+	for (i = 0;; i++) {
+		if (i == 0)
+			strlcpy(path, p->filepath, sizeof(path));
+		else
+			snprintf(path, sizeof(path), "%s.%d", p->filepath, i);
+
+		if (stat(path, &st) == -1)
+			break;
+
+		size += st.st_size;
+		if (st.st_size < SEGMENT_SIZE)
+			break;
+	}
+
+	if (size > 0)
+		p->size = size;
+}
+
+
+/*
+ * Find the reader of a fork for this process. A new one takes a free slot,
+ * or the one of the process that has been idle the longest.
+ */
+progress_reader *
+_progress_get_reader(progress *p, pid_t pid)
+{
+	progress_reader *r, *oldest = &p->readers[0];
+	int i;
+
+	for (i = 0; i < PROGRESS_READERS; i++) {
+		r = &p->readers[i];
+		if (r->pid == pid)
+			return r;
+		if (r->time < oldest->time)
+			oldest = r;
+	}
+
+	memset(oldest, 0, sizeof(progress_reader));
+	oldest->pid = pid;
+
+	return oldest;
+}
+
+
+/*
+ * Move the position of the reader of a fork to the end of a read, 'max_gap'
+ * is how far ahead of its previous position it can start while still being
+ * sequential. The fork is as far as its furthest reader, those idle for a
+ * while don't count.
+ */
+void
+_progress_update(pfd_t *pfd, pid_t pid, off_t offset, long size,
+		off_t max_gap)
+{
+	progress *p;
+	progress_reader *r;
+	off_t start, end;
+	double now, rate;
+	int i;
+
+	if (pfd->filenode == InvalidOid || offset < 0)
+		return;
+
+	now = get_monotonic_time();
+	start = pfd->part * SEGMENT_SIZE + offset;
+	end = start + MAX(size, 0);
+
+	pthread_mutex_lock(&progress_mutex);
+
+	p = _progress_get(pfd);
+
+	if (p->name[0] == '\0' && pfd->relname != NULL)
+		strlcpy(p->name, pfd->relname, sizeof(p->name));
+
+	r = _progress_get_reader(p, pid);
+	if (start >= r->position && start - r->position <= max_gap)
+		r->sequential++;
+	else
+		r->sequential = 0;
+	r->position = end;
+	r->time = now;
+
+	p->position = 0;
+	p->sequential = 0;
+	for (i = 0; i < PROGRESS_READERS; i++) {
+		r = &p->readers[i];
+		if (r->time == 0 || now - r->time > PROGRESS_READER_IDLE)
+			continue;
+		p->position = MAX(p->position, r->position);
+		p->sequential = MAX(p->sequential, r->sequential);
+	}
+
+	/* Exponentially weighted moving average of the reading speed, going
+	 * back counts as not moving. */
+	if (p->rate_time == 0) {
+		p->rate_time = now;
+		p->rate_position = p->position;
+	} else if (now - p->rate_time >= PROGRESS_RATE_INTERVAL) {
+		rate = MAX(p->position - p->rate_position, 0) /
+			(now - p->rate_time);
+		if (p->rate == 0)
+			p->rate = rate;
+		else
+			p->rate = PROGRESS_RATE_ALPHA * rate +
+				(1 - PROGRESS_RATE_ALPHA) * p->rate;
+		p->rate_time = now;
+		p->rate_position = p->position;
+	}
+
+	/* Past the end, the fork grew since we last looked. */
+	if (now - p->stat_time >= (p->position > p->size ?
+				PROGRESS_RATE_INTERVAL : PROGRESS_STAT_INTERVAL))
+		_progress_stat(p, now);
+
+	pthread_mutex_unlock(&progress_mutex);
+}
+
+
+/*
+ * A read of 'size' bytes at 'offset' within the file behind a pfd, by the
+ * process 'pid'.
+ */
+void
+progress_read(pfd_t *pfd, pid_t pid, off_t offset, long size)
+{
+	_progress_update(pfd, pid, offset, size, PROGRESS_SEQ_GAP);
+}
+
+
+/*
+ * The position of the file behind a pfd of the process 'pid', as sampled from
+ * /proc. Anything going forward is sequential.
+ */
+void
+progress_sample(pfd_t *pfd, pid_t pid, off_t offset)
+{
+	_progress_update(pfd, pid, offset, 0, SEGMENT_SIZE * 1024);
+}
+
+
+/*
+ * The backend probed the size of a segment with lseek(fd, 0, SEEK_END), the
+ * fork is at least that large.
+ */
+void
+progress_probe(pfd_t *pfd, off_t segment_size)
+{
+	progress *p;
+
+	if (pfd->filenode == InvalidOid || segment_size < 0)
+		return;
+
+	pthread_mutex_lock(&progress_mutex);
+
+	p = _progress_get(pfd);
+	p->size = MAX(p->size, pfd->part * SEGMENT_SIZE + segment_size);
+
+	pthread_mutex_unlock(&progress_mutex);
+}
+
+
+/*
+ * Copy the record of the fork behind a pfd to 'dst'.
+ *
+ * Returns -1 if we haven't seen it read.
+ */
+int
+progress_get(pfd_t *pfd, progress *dst)
+{
+	int i, ret = -1;
+
+	pthread_mutex_lock(&progress_mutex);
+
+	for (i = 0; i < progress_count; i++) {
+		if (_progress_match(&progress_pool[i], pfd)) {
+			*dst = progress_pool[i];
+			ret = 0;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&progress_mutex);
+
+	return ret;
+}
+
+
+/*
+ * Copy all the records to '*dst', a realloc'd array of '*size' records grown
+ * as needed.
+ *
+ * Returns the number of records copied.
+ */
+int
+progress_copy(progress **dst, int *size)
+{
+	int count;
+
+	pthread_mutex_lock(&progress_mutex);
+
+	count = progress_count;
+	if (count > *size) {
+		*size = progress_pool_size;
+		*dst = xrealloc(*dst, *size, sizeof(progress));
+	}
+	if (count > 0)
+		memcpy(*dst, progress_pool, count * sizeof(progress));
+
+	pthread_mutex_unlock(&progress_mutex);
+
+	return count;
+}
+
+
+/*
+ * Position within the fork in percent of its size, -1 if unknown.
+ */
+int
+progress_get_percent(progress *p)
+{
+	if (p->size <= 0)
+		return -1;
+
+	return MIN(p->position * 100 / p->size, 100);
+}
+
+
+/*
+ * Estimated number of seconds until the end of the fork is reached, -1 if it
+ * is not under a sequential scan or not moving.
+ */
+double
+progress_get_eta(progress *p)
+{
+	if (p->sequential < PROGRESS_SEQ_MIN || p->rate <= 0 || p->size <= 0)
+		return -1;
+
+	return MAX(p->size - p->position, 0) / p->rate;
+}
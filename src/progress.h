@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/* Minimum growth of the pool. */
+#define PROGRESS_GROWTH		16
+
+/* How often the rate is sampled (EWMA) and the segments stat'd, in seconds. */
+#define PROGRESS_RATE_INTERVAL	1.0
+#define PROGRESS_STAT_INTERVAL	10.0
+
+/* Weight of the last sample in the rate. */
+#define PROGRESS_RATE_ALPHA	0.3
+
+/*
+ * Reads are sequential when they start at most this many bytes after the end
+ * of the previous one. A relation is under sequential scan after this many
+ * sequential reads (or forward moves when sampling) in a row.
+ */
+#define PROGRESS_SEQ_GAP	(32 * BLCKSZ)
+#define PROGRESS_SEQ_MIN	4
+
+/*
+ * Processes followed per fork (a parallel scan and its workers) and how long
+ * one can stay without reading it before it is forgotten, in seconds.
+ */
+#define PROGRESS_READERS	8
+#define PROGRESS_READER_IDLE	5.0
+
+
+/*
+ * A process reading a fork, its reads are only sequential with regard to its
+ * own previous one.
+ */
+typedef struct _progress_reader {
+	pid_t		 pid;
+	off_t		 position;
+	int		 sequential;
+	double		 time;
+} progress_reader;
+
+/*
+ * Progress of the reads through a relation fork, across all its segments.
+ * 'position' and 'size' are global, as if the segments were a single file.
+ * 'position' and 'sequential' are the furthest of the processes reading it.
+ */
+typedef struct _progress {
+	Oid		 database_oid;
+	Oid		 filenode;
+	bool		 shared;
+	enum file_type	 file_type;
+	char		 name[MAX_RELNAME_LENGTH];
+	char		*filepath;
+	off_t		 size;
+	off_t		 position;
+	int		 sequential;
+	double		 rate;
+	off_t		 rate_position;
+	double		 rate_time;
+	double		 stat_time;
+	progress_reader	 readers[PROGRESS_READERS];
+} progress;
+
+
+void		 progress_read(pfd_t *, pid_t, off_t, long);
+void		 progress_sample(pfd_t *, pid_t, off_t);
+void		 progress_probe(pfd_t *, off_t);
+int		 progress_get(pfd_t *, progress *);
+int		 progress_copy(progress **, int *);
+int		 progress_get_percent(progress *);
+double		 progress_get_eta(progress *);
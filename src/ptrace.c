@@ -0,0 +1,431 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * Native Linux tracer. Instead of spawning strace and parsing its output, we
+ * attach to the backend ourselves with PTRACE_SEIZE and decode the system
+ * calls straight from the tracee (PTRACE_GET_SYSCALL_INFO), producing typed
+ * trace_event's. This skips the formatting, the pipe and the parsing.
+ *
+ * This requires Linux 5.3 or better, trace_open() (strace) is the fallback
+ * if the attach fails.
+ *
+ * Several processes can be traced at once, each keeps the syscall-enter-stop
+ * it is waiting to complete in its tracee record.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <err.h>
+
+#include "trace.h"
+#include "ptrace.h"
+#include "sysent.h"
+#include "utils.h"
+#include "xmalloc.h"
+
+
+/*
+ * A process we are attached to, 'entry' is only valid 'in_syscall'. A new
+ * tracee stays 'stopped' until the event loop resumes it.
+ */
+struct ptrace_tracee {
+	pid_t				 pid;
+	int				 stopped;
+	int				 group_stopped;
+	int				 in_syscall;
+	double				 entry_time;
+	struct __ptrace_syscall_info	 entry;
+};
+
+
+/* Realloc'd array of the processes we are attached to. */
+struct ptrace_tracee *ptrace_tracees = NULL;
+int ptrace_tracee_count = 0;
+
+/*
+ * Set while the event loop is blocked in waitpid(), the follower only sends
+ * its wake-up signal then (see follow.c).
+ */
+int ptrace_waiting = 0;
+
+extern volatile sig_atomic_t trace_interrupted;
+
+
+/*
+ * Copy a NUL-terminated string from the memory of the tracee. The reads are
+ * split on page boundaries since the string could be right at the end of a
+ * mapping.
+ *
+ * Returns -1 if the memory couldn't be read.
+ */
+int
+_ptrace_read_string(pid_t pid, unsigned long addr, char *buf, size_t len)
+{
+	struct iovec local, remote;
+	size_t offset = 0, chunk;
+	long page_size;
+	ssize_t l;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	while (offset < len - 1) {
+		chunk = page_size - ((addr + offset) % page_size);
+		if (chunk > len - 1 - offset)
+			chunk = len - 1 - offset;
+
+		local.iov_base = buf + offset;
+		local.iov_len = chunk;
+		remote.iov_base = (void *)(addr + offset);
+		remote.iov_len = chunk;
+
+		l = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+		if (l <= 0)
+			return -1;
+
+		if (memchr(buf + offset, '\0', l) != NULL)
+			return 0;
+
+		offset += l;
+	}
+
+	buf[len - 1] = '\0';
+
+	return 0;
+}
+
+
+/*
+ * Is this the signal of a group-stop? Only the stop signals are, a
+ * PTRACE_INTERRUPT reports SIGTRAP.
+ */
+int
+_ptrace_is_group_stop(int sig)
+{
+	return sig == SIGSTOP || sig == SIGTSTP || sig == SIGTTIN ||
+			sig == SIGTTOU;
+}
+
+
+/*
+ * Attach to a running process without stopping it (PTRACE_SEIZE), then
+ * interrupt it to start the syscall tracing.
+ *
+ * A signal can stop the process before the interrupt does, it is delivered
+ * right away and we keep waiting. If the process is in a group-stop (SIGSTOP,
+ * SIGTSTP...) it is left stopped until SIGCONT.
+ *
+ * Returns -1 if the process couldn't be seized, errno is left untouched for
+ * the caller to report. It is ESRCH if the process exited meanwhile.
+ */
+int
+ptrace_attach(pid_t pid)
+{
+	int status, group_stopped;
+
+	if (ptrace(PTRACE_SEIZE, pid, 0, PTRACE_O_TRACESYSGOOD) == -1)
+		return -1;
+
+	if (ptrace(PTRACE_INTERRUPT, pid, 0, 0) == -1) {
+		if (errno == ESRCH)
+			return -1;
+		err(1, "ptrace_attach:ptrace(PTRACE_INTERRUPT)");
+	}
+
+	for (;;) {
+		while (waitpid(pid, &status, __WALL) == -1) {
+			if (errno != EINTR)
+				err(1, "ptrace_attach:waitpid()");
+		}
+
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			errno = ESRCH;
+			return -1;
+		}
+
+		if (WIFSTOPPED(status) && (status >> 16) == PTRACE_EVENT_STOP)
+			break;
+
+		/* Signal-delivery-stop, the interrupt is still pending. */
+		if (ptrace(PTRACE_CONT, pid, 0, WSTOPSIG(status)) == -1) {
+			if (errno == ESRCH)
+				return -1;
+			err(1, "ptrace_attach:ptrace(PTRACE_CONT)");
+		}
+	}
+
+	group_stopped = _ptrace_is_group_stop(WSTOPSIG(status));
+
+	ptrace_tracees = xrealloc(ptrace_tracees, ptrace_tracee_count + 1,
+			sizeof(struct ptrace_tracee));
+	memset(&ptrace_tracees[ptrace_tracee_count], 0,
+			sizeof(struct ptrace_tracee));
+	ptrace_tracees[ptrace_tracee_count].pid = pid;
+	ptrace_tracees[ptrace_tracee_count].group_stopped = group_stopped;
+	ptrace_tracees[ptrace_tracee_count++].stopped = 1;
+
+	debug("ptrace: attached to pid %d\n", pid);
+
+	return 0;
+}
+
+
+/*
+ * Handle a syscall-exit-stop, the arguments were captured at the matching
+ * syscall-enter-stop and the result is read now. 'duration' is the time
+ * between both stops, in nanoseconds, it includes our own overhead.
+ */
+void
+_ptrace_process_syscall(pid_t pid, struct __ptrace_syscall_info *entry,
+		struct __ptrace_syscall_info *exit, long duration,
+		void (*func_handler)(trace_event *))
+{
+	struct sysent *se;
+	trace_event ev;
+	char path[MAXPATHLEN];
+
+	se = sysent_decode(entry->entry.nr,
+			(unsigned long *)entry->entry.args, exit->exit.rval, &ev);
+	ev.pid = pid;
+	ev.duration = duration;
+
+	if (se != NULL && se->path_arg != -1 && _ptrace_read_string(pid,
+				entry->entry.args[se->path_arg], path,
+				sizeof(path)) == 0)
+		ev.path = path;
+
+	func_handler(&ev);
+}
+
+
+/*
+ * Returns the record of a process we are attached to, NULL if it isn't one of
+ * ours.
+ */
+struct ptrace_tracee *
+_ptrace_get_tracee(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < ptrace_tracee_count; i++)
+		if (ptrace_tracees[i].pid == pid)
+			return &ptrace_tracees[i];
+
+	return NULL;
+}
+
+
+/*
+ * Forget about a process that is gone and tell the exit handler.
+ */
+void
+_ptrace_remove_tracee(struct ptrace_tracee *t, void (*exit_handler)(pid_t))
+{
+	pid_t pid = t->pid;
+
+	*t = ptrace_tracees[--ptrace_tracee_count];
+
+	debug("ptrace: pid %d is gone\n", pid);
+
+	if (exit_handler != NULL)
+		exit_handler(pid);
+}
+
+
+/*
+ * Resume a tracee until its next syscall stop, with the signal to deliver if
+ * any. Returns -1 if it is gone.
+ */
+int
+_ptrace_resume(struct ptrace_tracee *t, int sig)
+{
+	if (ptrace(PTRACE_SYSCALL, t->pid, 0, sig) == -1) {
+		if (errno == ESRCH)
+			return -1;
+		err(1, "ptrace_read_events:ptrace(PTRACE_SYSCALL)");
+	}
+
+	return 0;
+}
+
+
+/*
+ * Keep a tracee in its group-stop until SIGCONT, which is reported by another
+ * stop. Returns -1 if it is gone.
+ */
+int
+_ptrace_listen(struct ptrace_tracee *t)
+{
+	if (ptrace(PTRACE_LISTEN, t->pid, 0, 0) == -1) {
+		if (errno == ESRCH)
+			return -1;
+		err(1, "ptrace_read_events:ptrace(PTRACE_LISTEN)");
+	}
+
+	return 0;
+}
+
+
+/*
+ * Resume the tracees still stopped since they were attached, those that were
+ * in a group-stop stay in it.
+ */
+void
+_ptrace_resume_new(void (*exit_handler)(pid_t))
+{
+	struct ptrace_tracee *t;
+	int i, ret;
+
+	for (i = ptrace_tracee_count - 1; i >= 0; i--) {
+		t = &ptrace_tracees[i];
+		if (!t->stopped)
+			continue;
+		t->stopped = 0;
+		if (t->group_stopped)
+			ret = _ptrace_listen(t);
+		else
+			ret = _ptrace_resume(t, 0);
+		if (ret == -1)
+			_ptrace_remove_tracee(t, exit_handler);
+	}
+}
+
+
+/*
+ * Resume the tracees from one syscall stop to the next, passing each complete
+ * system call to the handler and the pid of each tracee that is gone to the
+ * exit handler (if not NULL). Signals received by the tracees are passed
+ * through untouched.
+ *
+ * The wait handler (if not NULL) can attach to more processes. It is called
+ * with 0 when waitpid() is interrupted by a signal (that's how it is woken
+ * up, see follow.c), and with 1 when no tracee is left, it should then block
+ * until there is a process to attach. Without it, this
+ * returns when all the tracees exited. Either way, it returns when
+ * interrupted (SIGINT, SIGTERM). The idle handler of trace.c is called when
+ * waitpid() is interrupted, a handler armed with a timer gets its calls.
+ */
+void
+ptrace_read_events(void (*func_handler)(trace_event *),
+		void (*exit_handler)(pid_t), void (*wait_handler)(int))
+{
+	struct __ptrace_syscall_info info;
+	struct ptrace_tracee *t;
+	pid_t pid;
+	int status, sig;
+	long l;
+
+	_ptrace_resume_new(exit_handler);
+
+	while (!trace_interrupted &&
+			(ptrace_tracee_count > 0 || wait_handler != NULL)) {
+		if (ptrace_tracee_count == 0) {
+			wait_handler(1);
+			if (trace_interrupted)
+				break;
+			_ptrace_resume_new(exit_handler);
+			continue;
+		}
+
+		__atomic_store_n(&ptrace_waiting, 1, __ATOMIC_SEQ_CST);
+		pid = waitpid(-1, &status, __WALL);
+		__atomic_store_n(&ptrace_waiting, 0, __ATOMIC_SEQ_CST);
+		if (pid == -1) {
+			if (errno != EINTR)
+				err(1, "ptrace_read_events:waitpid()");
+			trace_idle();
+			if (wait_handler != NULL) {
+				wait_handler(0);
+				_ptrace_resume_new(exit_handler);
+			}
+			continue;
+		}
+
+		t = _ptrace_get_tracee(pid);
+		if (t == NULL)
+			continue;
+
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			_ptrace_remove_tracee(t, exit_handler);
+			continue;
+		}
+
+		if (!WIFSTOPPED(status))
+			continue;
+
+		sig = 0;
+
+		if ((status >> 16) == PTRACE_EVENT_STOP) {
+			/*
+			 * Group-stop (SIGSTOP, SIGTSTP...), the process has to
+			 * stay stopped until SIGCONT. PTRACE_LISTEN does that
+			 * and reports the SIGCONT with another stop. Anything
+			 * else is PTRACE_INTERRUPT, nothing to deliver.
+			 */
+			if (_ptrace_is_group_stop(WSTOPSIG(status))) {
+				if (_ptrace_listen(t) == -1)
+					_ptrace_remove_tracee(t, exit_handler);
+				continue;
+			}
+		} else if (WSTOPSIG(status) != (SIGTRAP | 0x80)) {
+			/* Signal-delivery-stop, inject it back on resume. */
+			sig = WSTOPSIG(status);
+		} else {
+			l = ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info),
+					&info);
+			if (l == -1) {
+				/* Killed (SIGKILL) since it stopped. */
+				if (errno == ESRCH) {
+					_ptrace_remove_tracee(t, exit_handler);
+					continue;
+				}
+				err(1, "ptrace_read_events:"
+						"ptrace(GET_SYSCALL_INFO)");
+			}
+
+			/*
+			 * The kernel tells us which side of the syscall we are
+			 * on, this keeps us in sync if we attached in the
+			 * middle of a syscall.
+			 */
+			if (info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+				t->entry = info;
+				t->entry_time = get_monotonic_time();
+				t->in_syscall = 1;
+			} else if (info.op == PTRACE_SYSCALL_INFO_EXIT &&
+					t->in_syscall) {
+				t->in_syscall = 0;
+				_ptrace_process_syscall(pid, &t->entry, &info,
+						(long)((get_monotonic_time() -
+							t->entry_time) * 1e9),
+						func_handler);
+			}
+		}
+
+		/* The handler could have attached to more processes. */
+		t = _ptrace_get_tracee(pid);
+		if (t != NULL && _ptrace_resume(t, sig) == -1)
+			_ptrace_remove_tracee(t, exit_handler);
+	}
+}
@@ -40,10 +40,13 @@
  *
  *-------------------------------------------------------------------------
  */
+#include <sys/types.h>
 #include <sys/stat.h>
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <string.h>
+#include <time.h>
 #include <err.h>
 
 #include <postgres.h>
@@ -59,11 +62,18 @@
 #include "utils/pg_crc.h"
 #include "utils/relmapper.h"
 #include "pg_crc32_table.h"
+#include "relmapper.h"
+#include "xmalloc.h"
 
 
 extern char *current_cluster_path;
 extern Oid current_database_oid;
 
+/* pg_trace: Darwin names the nanosecond modification time differently. */
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
 
 /*
  * The map file is critical data: we have no automatic method for recovering
@@ -78,8 +88,6 @@ extern Oid current_database_oid;
  * speed searching by insisting on OID order, but it really shouldn't be
  * worth the trouble given the intended size of the mapping sets.
  */
-#define RELMAPPER_FILENAME		"pg_filenode.map"
-
 #define RELMAPPER_FILEMAGIC		0x592717		/* version ID value */
 
 #define MAX_MAPPINGS			62		/* 62 * 8 + 16 = 512 */
@@ -103,9 +111,10 @@ typedef struct RelMapFile
  * The currently known contents of the shared map file and our database's
  * local map file are stored here.	These can be reloaded from disk
  * immediately whenever we receive an update sinval message.
+ *
+ * pg_trace: the local maps are in local_maps, one per database.
  */
 static RelMapFile shared_map;
-static RelMapFile local_map;
 
 /*
  * We use the same RelMapFile data structure to track uncommitted local
@@ -123,8 +132,65 @@ static RelMapFile local_map;
 static RelMapFile active_shared_updates;
 static RelMapFile active_local_updates;
 
+/*
+ * pg_trace: the maps are cached, they are only read again if their size or
+ * modification time changed (checked at most every RELMAP_RECHECK_INTERVAL
+ * seconds), or if we saw the traced process write to them.
+ */
+typedef struct RelMapCache
+{
+	bool		valid;			/* map was loaded and not invalidated */
+	time_t		checked;		/* last time we stat'd the file */
+	ino_t		ino;			/* inode at load time */
+	off_t		size;			/* size at load time */
+	struct timespec mtim;		/* modification time at load time */
+} RelMapCache;
+
+static RelMapCache shared_map_cache;
+
+/*
+ * pg_trace: a process can touch the files of several databases (checkpointer,
+ * autovacuum...), the local map of each database seen is kept.
+ */
+typedef struct RelMapLocal
+{
+	Oid			database_oid;
+	RelMapFile	map;
+	RelMapCache	cache;
+} RelMapLocal;
+
+static RelMapLocal *local_maps = NULL;
+static int	local_map_count = 0;
+
 
 void load_relmap_file(bool shared);
+static void read_relmap_file(bool shared, char *mapfilename, RelMapFile *map);
+
+
+/*
+ * local_map_get -- find the local map of the current database
+ *
+ * This is not imported from Postgresql. The map of a database we haven't
+ * seen yet is added empty, load_relmap_file() fills it.
+ */
+static RelMapLocal *
+local_map_get(void)
+{
+	int32		i;
+
+	for (i = 0; i < local_map_count; i++)
+	{
+		if (local_maps[i].database_oid == current_database_oid)
+			return &local_maps[i];
+	}
+
+	local_maps = xrealloc(local_maps, local_map_count + 1,
+						  sizeof(RelMapLocal));
+	memset(&local_maps[local_map_count], 0, sizeof(RelMapLocal));
+	local_maps[local_map_count].database_oid = current_database_oid;
+
+	return &local_maps[local_map_count++];
+}
 
 
 /*
@@ -169,7 +235,7 @@ RelationMapOidToFilenode(Oid relationId, bool shared)
 			if (relationId == map->mappings[i].mapoid)
 				return map->mappings[i].mapfilenode;
 		}
-		map = &local_map;
+		map = &local_map_get()->map;
 		for (i = 0; i < map->num_mappings; i++)
 		{
 			if (relationId == map->mappings[i].mapoid)
@@ -186,28 +252,91 @@ RelationMapOidToFilenode(Oid relationId, bool shared)
  *
  * Because the map file is essential for access to core system catalogs,
  * failure to read it is a fatal error.
+ *
+ * pg_trace: this returns immediately if the cached map is still current.
  */
 void
 load_relmap_file(bool shared)
 {
 	RelMapFile *map;
+	RelMapCache *cache;
+	RelMapLocal *local;
 	char		mapfilename[MAXPGPATH];
-	pg_crc32	crc;
-	int			fd;
+	struct stat	sb;
+	time_t		now;
 
 	if (shared)
 	{
-		snprintf(mapfilename, sizeof(mapfilename), "%s/global/%s",
-				 current_cluster_path, RELMAPPER_FILENAME);
 		map = &shared_map;
+		cache = &shared_map_cache;
 	}
 	else
 	{
+		local = local_map_get();
+		map = &local->map;
+		cache = &local->cache;
+	}
+
+	now = time(NULL);
+	if (cache->valid && now - cache->checked < RELMAP_RECHECK_INTERVAL)
+		return;
+
+	if (shared)
+		snprintf(mapfilename, sizeof(mapfilename), "%s/global/%s",
+				 current_cluster_path, RELMAPPER_FILENAME);
+	else
 		snprintf(mapfilename, sizeof(mapfilename), "%s/base/%u/%s",
 				 current_cluster_path, current_database_oid,
 				 RELMAPPER_FILENAME);
-		map = &local_map;
-	}
+
+	if (stat(mapfilename, &sb) < 0)
+		err(1, "could not stat relation mapping file \"%s\"",
+						mapfilename);
+
+	cache->checked = now;
+
+	if (cache->valid && sb.st_ino == cache->ino &&
+		sb.st_size == cache->size &&
+		sb.st_mtim.tv_sec == cache->mtim.tv_sec &&
+		sb.st_mtim.tv_nsec == cache->mtim.tv_nsec)
+		return;
+
+	read_relmap_file(shared, mapfilename, map);
+
+	cache->valid = true;
+	cache->ino = sb.st_ino;
+	cache->size = sb.st_size;
+	cache->mtim = sb.st_mtim;
+}
+
+
+/*
+ * relmap_invalidate -- forget a cached map
+ *
+ * This is not imported from Postgresql, it is called when the traced process
+ * writes to a map file, the next load_relmap_file() reads it again. The local
+ * map is the one of the current database.
+ */
+void
+relmap_invalidate(bool shared)
+{
+	if (shared)
+		shared_map_cache.valid = false;
+	else
+		local_map_get()->cache.valid = false;
+}
+
+
+/*
+ * read_relmap_file -- read and verify a map file
+ *
+ * pg_trace: this is the original body of load_relmap_file.
+ */
+static void
+read_relmap_file(bool shared, char *mapfilename, RelMapFile *map)
+{
+	pg_crc32	crc;
+	int			fd;
 
 	/* Read data ... */
 	fd = open(mapfilename, O_RDONLY | PG_BINARY, S_IRUSR | S_IWUSR);
@@ -285,7 +414,7 @@ FilenodeToRelationMapOid(Oid filenode, bool shared)
 			if (filenode == map->mappings[i].mapfilenode)
 				return map->mappings[i].mapoid;
 		}
-		map = &local_map;
+		map = &local_map_get()->map;
 		for (i = 0; i < map->num_mappings; i++)
 		{
 			if (filenode == map->mappings[i].mapfilenode)
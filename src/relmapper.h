@@ -14,6 +14,14 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/* Name of the relation map files, in global/ and in each database. */
+#define RELMAPPER_FILENAME	"pg_filenode.map"
+
+/* How often a cached relation map is checked for changes, in seconds. */
+#define RELMAP_RECHECK_INTERVAL	1
+
+
 void		 load_relmap_file(bool);
+void		 relmap_invalidate(bool);
 Oid		 RelationMapOidToFilenode(Oid, bool);
 Oid		 FilenodeToRelationMapOid(Oid, bool);
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * Per-relation I/O counters, fed by every read and write on a relation file
+ * and read from other threads (the top mode) through relstat_copy().
+ *
+ * The records are kept in a reltab, a single mutex protects it, the readers
+ * only hold it long enough to copy the records.
+ */
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <postgres.h>
+
+#include "pfd.h"
+#include "reltab.h"
+#include "relstat.h"
+#include "strlcpy.h"
+#include "xmalloc.h"
+
+
+reltab relstat_table = RELTAB_INITIALIZER(relstat);
+
+pthread_mutex_t relstat_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Find the record of the relation file behind a pfd, create it if this is
+ * the first time we see it. Called with the mutex held.
+ */
+relstat *
+_relstat_get(pfd_t *pfd)
+{
+	relstat *rs;
+	relkey key;
+	bool created;
+
+	memset(&key, 0, sizeof(key));
+	key.database_oid = pfd->database_oid;
+	key.filenode = pfd->filenode;
+	key.shared = pfd->shared;
+	key.file_type = pfd->file_type;
+	key.part = pfd->part;
+
+	rs = reltab_get(&relstat_table, &key, &created);
+	if (created) {
+		rs->offset = -1;
+		if (pfd->filepath != NULL)
+			rs->filepath = xstrdup(pfd->filepath);
+	}
+
+	return rs;
+}
+
+
+/*
+ * Count a read or a write on a relation file.
+ */
+void
+relstat_add(pfd_io *io, bool write)
+{
+	relstat *rs;
+
+	pthread_mutex_lock(&relstat_mutex);
+
+	rs = _relstat_get(io->pfd);
+
+	if (rs->name[0] == '\0' && io->pfd->relname != NULL)
+		strlcpy(rs->name, io->pfd->relname, sizeof(rs->name));
+
+	if (write) {
+		rs->writes++;
+		rs->write_bytes += io->size;
+	} else {
+		rs->reads++;
+		rs->read_bytes += io->size;
+	}
+	rs->offset = io->offset + io->size;
+
+	pthread_mutex_unlock(&relstat_mutex);
+}
+
+
+/*
+ * Copy all the records to '*dst', a realloc'd array of '*size' records grown
+ * as needed. The records stay in the same order from one copy to the next,
+ * new ones are added at the end.
+ *
+ * Returns the number of records copied.
+ */
+int
+relstat_copy(relstat **dst, int *size)
+{
+	int count;
+
+	pthread_mutex_lock(&relstat_mutex);
+
+	count = relstat_table.count;
+	if (count > *size) {
+		*size = relstat_table.size;
+		*dst = xrealloc(*dst, *size, sizeof(relstat));
+	}
+	if (count > 0)
+		memcpy(*dst, relstat_table.pool, count * sizeof(relstat));
+
+	pthread_mutex_unlock(&relstat_mutex);
+
+	return count;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * I/O counters of a relation file: one fork (file_type) of one segment (part)
+ * of a relation. 'name' is the relname, empty until it is resolved. The
+ * filepath is set once and never freed.
+ */
+typedef struct _relstat {
+	relkey		 key;
+	char		 name[MAX_RELNAME_LENGTH];
+	char		*filepath;
+	uint64		 reads;
+	uint64		 writes;
+	uint64		 read_bytes;
+	uint64		 write_bytes;
+	off_t		 offset;
+} relstat;
+
+
+void		 relstat_add(pfd_io *, bool);
+int		 relstat_copy(relstat **, int *);
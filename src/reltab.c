@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * Tables of records keyed on a relation file, shared by the per-relation
+ * counters (relstat) and the summary mode.
+ *
+ * The records are kept in a realloc'd array with an open-addressing hash
+ * index on their key (linear probing), holding the position of the record
+ * plus one, 0 being an empty slot. The tables do no locking of their own.
+ */
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <postgres.h>
+
+#include "pfd.h"
+#include "reltab.h"
+#include "strlcpy.h"
+#include "xmalloc.h"
+
+
+/*
+ * Hash a key, Knuth's multiplicative method on each of its parts, masked by
+ * the caller.
+ */
+unsigned int
+_reltab_hash(relkey *key)
+{
+	unsigned int h;
+
+	h = (unsigned int)key->filenode * 2654435761U;
+	h ^= (unsigned int)key->database_oid * 3266489917U;
+	h ^= ((unsigned int)key->func << 12 | (unsigned int)key->part << 3 |
+			key->file_type) * 2246822519U;
+
+	return h ^ key->shared;
+}
+
+
+static inline int
+_reltab_key_equal(relkey *a, relkey *b)
+{
+	return a->filenode == b->filenode && a->part == b->part &&
+		a->database_oid == b->database_oid &&
+		a->file_type == b->file_type && a->shared == b->shared &&
+		a->func == b->func;
+}
+
+
+static inline relkey *
+_reltab_record(reltab *tab, int i)
+{
+	return (relkey *)((char *)tab->pool + i * tab->record_size);
+}
+
+
+/*
+ * (Re)build the index with enough room for 'count' records, keeping the load
+ * factor under one half.
+ */
+void
+_reltab_resize_index(reltab *tab, int count)
+{
+	unsigned int mask, j;
+	int i;
+
+	while (tab->index_size < count * 2)
+		tab->index_size = tab->index_size ?
+			tab->index_size * 2 : RELTAB_GROWTH;
+
+	tab->index = xrealloc(tab->index, tab->index_size, sizeof(int));
+	memset(tab->index, 0, tab->index_size * sizeof(int));
+	mask = tab->index_size - 1;
+
+	for (i = 0; i < tab->count; i++) {
+		j = _reltab_hash(_reltab_record(tab, i)) & mask;
+		while (tab->index[j] != 0)
+			j = (j + 1) & mask;
+		tab->index[j] = i + 1;
+	}
+}
+
+
+/*
+ * Rebuild the index after the records were moved around (sorted).
+ */
+void
+reltab_reindex(reltab *tab)
+{
+	_reltab_resize_index(tab, tab->count);
+}
+
+
+/*
+ * Find the record of a key, add it if this is the first time we see it. A
+ * new record is zeroed but for its key, '*created' tells the caller to fill
+ * the rest.
+ */
+void *
+reltab_get(reltab *tab, relkey *key, bool *created)
+{
+	relkey *rec;
+	unsigned int mask, i;
+
+	if (tab->count * 2 >= tab->index_size)
+		_reltab_resize_index(tab, tab->count + 1);
+
+	mask = tab->index_size - 1;
+	for (i = _reltab_hash(key) & mask; tab->index[i] != 0;
+			i = (i + 1) & mask) {
+		rec = _reltab_record(tab, tab->index[i] - 1);
+		if (_reltab_key_equal(rec, key)) {
+			*created = false;
+			return rec;
+		}
+	}
+
+	if (tab->count == tab->size) {
+		tab->size += MAX(tab->size, RELTAB_GROWTH);
+		tab->pool = xrealloc(tab->pool, tab->size, tab->record_size);
+	}
+
+	rec = _reltab_record(tab, tab->count);
+	memset(rec, 0, tab->record_size);
+	*rec = *key;
+
+	tab->index[i] = ++tab->count;
+	*created = true;
+
+	return rec;
+}
+
+
+/*
+ * Format the name of the relation file of a key: its relname (or filenode
+ * until 'name' is resolved) followed by the fork or the segment.
+ */
+char *
+reltab_get_name(relkey *key, char *name, char *buf, size_t len)
+{
+	char relname[MAX_RELNAME_LENGTH + 16];
+
+	if (key->filenode == InvalidOid) {
+		if (key->file_type == FILE_TYPE_XLOG)
+			strlcpy(buf, "(xlog)", len);
+		else
+			strlcpy(buf, "(other)", len);
+		return buf;
+	}
+
+	if (name[0] != '\0')
+		snprintf(relname, sizeof(relname), "%s", name);
+	else
+		snprintf(relname, sizeof(relname), "filenode=%u",
+				key->filenode);
+
+	switch (key->file_type) {
+	case FILE_TYPE_VM:
+		snprintf(buf, len, "%s(vm)", relname);
+		break;
+	case FILE_TYPE_FSM:
+		snprintf(buf, len, "%s(fsm)", relname);
+		break;
+	default:
+		if (key->part > 0)
+			snprintf(buf, len, "%s.%d", relname, key->part);
+		else
+			snprintf(buf, len, "%s", relname);
+		break;
+	}
+
+	return buf;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/* Minimum growth of the records of a table and of its index. */
+#define RELTAB_GROWTH		64
+
+
+/*
+ * Key of a record about a relation file: one fork (file_type) of one segment
+ * (part) of a relation, and one system call (a trace_func) for the tables
+ * counting them. The parts a table doesn't use are left to 0. The files
+ * which are not relations have an invalid filenode.
+ */
+typedef struct _relkey {
+	Oid		 database_oid;
+	Oid		 filenode;
+	bool		 shared;
+	enum file_type	 file_type;
+	int		 part;
+	int		 func;
+} relkey;
+
+/*
+ * Records of 'record_size' bytes starting with their relkey, in a realloc'd
+ * array with a hash index on their key. Use RELTAB_INITIALIZER.
+ */
+typedef struct _reltab {
+	size_t		 record_size;
+	void		*pool;
+	int		 count;
+	int		 size;
+	int		*index;
+	int		 index_size;
+} reltab;
+
+#define RELTAB_INITIALIZER(type)	{ sizeof(type), NULL, 0, 0, NULL, 0 }
+
+
+void		*reltab_get(reltab *, relkey *, bool *);
+void		 reltab_reindex(reltab *);
+char		*reltab_get_name(relkey *, char *, char *, size_t);
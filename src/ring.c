@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * Lock-free ring buffer between a single producer and a single consumer
+ * thread, used to drain the tracer output as fast as it comes while it is
+ * being parsed on the other side.
+ *
+ * A record is a size_t header holding its length followed by its bytes, the
+ * whole padded to RING_ALIGN. A record is never split, when it doesn't fit at
+ * the end of the buffer a RING_WRAP header sends the consumer back to the
+ * start. The indexes are published with release stores and read with acquire
+ * loads, the bytes of a record are therefore visible before the index that
+ * covers them.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <err.h>
+
+#include "ring.h"
+#include "xmalloc.h"
+
+
+/*
+ * Space taken by a record of 'len' bytes, header and padding included.
+ */
+static inline size_t
+_ring_record_size(size_t len)
+{
+	return (sizeof(size_t) + len + RING_ALIGN - 1) &
+		~(size_t)(RING_ALIGN - 1);
+}
+
+
+/*
+ * Wake up the other side if it is sleeping. The 'waiting' count is raised
+ * before the sleeper checks the indexes again and we check it after moving
+ * ours, with sequentially consistent operations one of us sees the other. It
+ * is a count and not a flag: a side that was just woken up and hasn't taken
+ * the mutex back yet must not hide the other one, which may have gone to
+ * sleep in the meantime.
+ */
+void
+_ring_wake(ring *r)
+{
+	if (!__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST))
+		return;
+
+	pthread_mutex_lock(&r->mutex);
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->mutex);
+}
+
+
+/*
+ * Allocate a ring of 'size' bytes, a power of two.
+ */
+ring *
+ring_new(size_t size)
+{
+	ring *r;
+
+	if (size == 0 || (size & (size - 1)) != 0)
+		errx(1, "ring_new: size is not a power of two (%zu)", size);
+
+	r = xmalloc(sizeof(ring));
+	memset(r, 0, sizeof(ring));
+	r->buf = xmalloc(size);
+	r->size = size;
+	pthread_mutex_init(&r->mutex, NULL);
+	pthread_cond_init(&r->cond, NULL);
+
+	return r;
+}
+
+
+void
+ring_free(ring *r)
+{
+	pthread_mutex_destroy(&r->mutex);
+	pthread_cond_destroy(&r->cond);
+	xfree(r->buf);
+	xfree(r);
+}
+
+
+/*
+ * Number of bytes used in the ring, as seen from either side.
+ */
+size_t
+ring_get_used(ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Producer: reserve room for a record of up to 'len' bytes and return where
+ * to write it, it is only visible to the consumer after ring_commit(). If the
+ * ring is full, this waits for the consumer if 'wait' is set or returns NULL.
+ */
+char *
+ring_reserve(ring *r, size_t len, int wait)
+{
+	size_t need, offset, skip, tail;
+
+	need = _ring_record_size(len);
+	if (need > r->size / 2)
+		errx(1, "ring_reserve: record too large (%zu bytes)", len);
+
+	offset = r->head & (r->size - 1);
+	skip = (offset + need > r->size) ? r->size - offset : 0;
+
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if (r->head + skip + need - tail > r->size) {
+		if (!wait)
+			return NULL;
+
+		pthread_mutex_lock(&r->mutex);
+		__atomic_add_fetch(&r->waiting, 1, __ATOMIC_SEQ_CST);
+		while (r->head + skip + need -
+				__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) >
+				r->size)
+			pthread_cond_wait(&r->cond, &r->mutex);
+		__atomic_sub_fetch(&r->waiting, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&r->mutex);
+	}
+
+	if (skip > 0) {
+		*(size_t *)(r->buf + offset) = RING_WRAP;
+		offset = 0;
+	}
+	r->reserved = skip;
+
+	return r->buf + offset + sizeof(size_t);
+}
+
+
+/*
+ * Producer: publish the record written after ring_reserve(), 'len' can be
+ * less than what was reserved.
+ */
+void
+ring_commit(ring *r, size_t len)
+{
+	size_t head;
+
+	head = r->head + r->reserved;
+	*(size_t *)(r->buf + (head & (r->size - 1))) = len;
+
+	__atomic_store_n(&r->head, head + _ring_record_size(len),
+			__ATOMIC_SEQ_CST);
+	_ring_wake(r);
+}
+
+
+/*
+ * Consumer: return the oldest record and its length, waiting for one if the
+ * ring is empty. Returns NULL once the ring is empty and closed.
+ */
+char *
+ring_peek(ring *r, size_t *len)
+{
+	size_t offset, head;
+
+	for (;;) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+		if (head == r->tail) {
+			/* The last records can come just before closing. */
+			if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+				if (__atomic_load_n(&r->head,
+						__ATOMIC_ACQUIRE) == r->tail)
+					return NULL;
+				continue;
+			}
+
+			pthread_mutex_lock(&r->mutex);
+			__atomic_add_fetch(&r->waiting, 1, __ATOMIC_SEQ_CST);
+			while (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) ==
+					r->tail &&
+					!__atomic_load_n(&r->closed,
+						__ATOMIC_SEQ_CST))
+				pthread_cond_wait(&r->cond, &r->mutex);
+			__atomic_sub_fetch(&r->waiting, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&r->mutex);
+			continue;
+		}
+
+		offset = r->tail & (r->size - 1);
+		*len = *(size_t *)(r->buf + offset);
+
+		if (*len == RING_WRAP) {
+			__atomic_store_n(&r->tail, r->tail + r->size - offset,
+					__ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		return r->buf + offset + sizeof(size_t);
+	}
+}
+
+
+/*
+ * Consumer: wait up to 'timeout' milliseconds for a record, or for the ring
+ * to be closed. Returns 0 if the time ran out first.
+ */
+int
+ring_wait(ring *r, int timeout)
+{
+	struct timespec ts;
+	int ret = 0;
+
+	if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail ||
+			__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+		return 1;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout / 1000;
+	ts.tv_nsec += (timeout % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&r->mutex);
+	__atomic_add_fetch(&r->waiting, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == r->tail &&
+			!__atomic_load_n(&r->closed, __ATOMIC_SEQ_CST) &&
+			ret == 0)
+		ret = pthread_cond_timedwait(&r->cond, &r->mutex, &ts);
+	__atomic_sub_fetch(&r->waiting, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&r->mutex);
+
+	return __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != r->tail ||
+		__atomic_load_n(&r->closed, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * Consumer: give the room of the record returned by ring_peek() back to the
+ * producer.
+ */
+void
+ring_release(ring *r, size_t len)
+{
+	__atomic_store_n(&r->tail, r->tail + _ring_record_size(len),
+			__ATOMIC_SEQ_CST);
+	_ring_wake(r);
+}
+
+
+/*
+ * Producer: no more records, the consumer gets NULL once it read them all.
+ */
+void
+ring_close(ring *r)
+{
+	__atomic_store_n(&r->closed, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&r->mutex);
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->mutex);
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/* Records are aligned on this many bytes, their header included. */
+#define RING_ALIGN		8
+
+/* Header of the padding record left at the end when the next doesn't fit. */
+#define RING_WRAP		((size_t)-1)
+
+
+/*
+ * Single-producer single-consumer ring of variable sized records. 'head' and
+ * 'tail' only ever grow, they are masked into the buffer. The producer only
+ * writes 'head' and the consumer 'tail'. The mutex and condition are only
+ * used to sleep, when the ring is full or empty, 'waiting' counts the sides
+ * that need to be woken up.
+ */
+typedef struct _ring {
+	char		*buf;
+	size_t		 size;
+	size_t		 head;
+	size_t		 tail;
+	size_t		 reserved;
+	int		 waiting;
+	int		 closed;
+	pthread_mutex_t	 mutex;
+	pthread_cond_t	 cond;
+} ring;
+
+
+ring		*ring_new(size_t);
+void		 ring_free(ring *);
+size_t		 ring_get_used(ring *);
+char		*ring_reserve(ring *, size_t, int);
+void		 ring_commit(ring *, size_t);
+char		*ring_peek(ring *, size_t *);
+int		 ring_wait(ring *, int);
+void		 ring_release(ring *, size_t);
+void		 ring_close(ring *);
@@ -21,19 +21,29 @@
  *  - origin		enum (relmap or pgclass)
  *  - oid		Oid
  *  - filenode		Oid
- *  - relname		char *
+ *  - relname		offset of the name in the arena
+ *
+ * Lookups on oid and filenode go through open-addressing hash indexes
+ * (linear probing) holding the position of the record in rn_pool plus one, 0
+ * being an empty slot. Deletions shift the following slots back instead of
+ * leaving tombstones. The relnames are interned in a single arena (rn_names)
+ * and records only keep their offset, this keeps the whole cache down to a
+ * handful of allocations even with hundreds of thousands of pg_class rows.
  *
  * Random ideas for improvements:
  *
- *  - constant time lookup (btree, rbtree, etc.)
  *  - when we see a 'write' call on either relmap or pg_class files, we should
  *    do a refresh of this cache.
  */
 
+#include <sys/param.h>
+
 #include <stdio.h>
 #include <unistd.h>
+#include <string.h>
 
 #include <postgres.h>
+#include <access/transam.h>
 
 #include "rn_cache.h"
 #include "utils.h"
@@ -48,17 +58,221 @@ rn_record *rn_pool = NULL;
 int rn_count = 0;
 int rn_pool_size = 0;
 
+/* Hash indexes, all of rn_index_size slots (a power of two). */
+int *rn_oid_index = NULL;
+int *rn_filenode_index = NULL;
+int *rn_name_index = NULL;
+int rn_index_size = 0;
+
+/* Interned relnames, NUL-terminated and referenced by offset. */
+char *rn_names = NULL;
+int rn_names_length = 0;
+int rn_names_size = 0;
+int rn_names_count = 0;
+
+
+/*
+ * Hash an Oid, Knuth's multiplicative method, masked by the caller.
+ */
+unsigned int
+_rn_hash_oid(Oid oid)
+{
+	return (unsigned int)oid * 2654435761U;
+}
+
+
+/*
+ * Hash a string (FNV-1a).
+ */
+unsigned int
+_rn_hash_name(const char *s)
+{
+	unsigned int h = 2166136261U;
+
+	while (*s != '\0') {
+		h ^= (unsigned char)*s++;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+
+/*
+ * Insert a record in one of the Oid indexes. Records sharing a key are all
+ * indexed, in the order they were added: the first one wins the lookups,
+ * like it used to with the linear scans, and the next one takes over once it
+ * is deleted.
+ */
+void
+_rn_index_insert(int *index, Oid key, int pos)
+{
+	unsigned int mask = rn_index_size - 1;
+	unsigned int i;
+
+	if (key == InvalidOid)
+		return;
+
+	for (i = _rn_hash_oid(key) & mask; index[i] != 0; i = (i + 1) & mask)
+		;
+
+	index[i] = pos + 1;
+}
+
 
 /*
- * Wipe an rn_record item clear, avoiding public urination.
+ * Remove a record from one of the Oid indexes. The slots following it are
+ * shifted back, when their home slot allows it, so that no probe sequence
+ * is broken by the hole.
+ */
+void
+_rn_index_remove(int *index, Oid key, int pos, bool by_oid)
+{
+	unsigned int mask = rn_index_size - 1;
+	unsigned int i, j, home;
+	rn_record *rec;
+
+	if (key == InvalidOid)
+		return;
+
+	for (i = _rn_hash_oid(key) & mask; index[i] != pos + 1;
+			i = (i + 1) & mask)
+		if (index[i] == 0)
+			return;
+
+	for (j = (i + 1) & mask; index[j] != 0; j = (j + 1) & mask) {
+		rec = &rn_pool[index[j] - 1];
+		home = _rn_hash_oid(by_oid ? rec->oid : rec->filenode) & mask;
+
+		/* It can't move before its home slot. */
+		if (((j - home) & mask) < ((j - i) & mask))
+			continue;
+
+		index[i] = index[j];
+		i = j;
+	}
+
+	index[i] = 0;
+}
+
+
+/*
+ * Find a record in one of the Oid indexes, NULL if not found.
+ */
+rn_record *
+_rn_index_lookup(int *index, Oid key, bool by_oid)
+{
+	unsigned int mask = rn_index_size - 1;
+	unsigned int i;
+	rn_record *rec;
+
+	if (key == InvalidOid || rn_index_size == 0)
+		return NULL;
+
+	for (i = _rn_hash_oid(key) & mask; index[i] != 0; i = (i + 1) & mask) {
+		rec = &rn_pool[index[i] - 1];
+		if ((by_oid ? rec->oid : rec->filenode) == key)
+			return rec;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Insert an already interned name in the name index.
+ */
+void
+_rn_name_index_insert(int offset)
+{
+	unsigned int mask = rn_index_size - 1;
+	unsigned int i;
+
+	i = _rn_hash_name(rn_names + offset) & mask;
+	while (rn_name_index[i] != 0)
+		i = (i + 1) & mask;
+
+	rn_name_index[i] = offset + 1;
+}
+
+
+/*
+ * (Re)build all the indexes with enough room for 'count' items, keeping the
+ * load factor under one half.
+ */
+void
+_rn_cache_reindex(int count)
+{
+	int i, offset;
+
+	while (rn_index_size < count * 2)
+		rn_index_size = rn_index_size ? rn_index_size * 2 : RN_CACHE_GROWTH;
+
+	rn_oid_index = xrealloc(rn_oid_index, rn_index_size, sizeof(int));
+	rn_filenode_index = xrealloc(rn_filenode_index, rn_index_size,
+			sizeof(int));
+	rn_name_index = xrealloc(rn_name_index, rn_index_size, sizeof(int));
+	memset(rn_oid_index, 0, rn_index_size * sizeof(int));
+	memset(rn_filenode_index, 0, rn_index_size * sizeof(int));
+	memset(rn_name_index, 0, rn_index_size * sizeof(int));
+
+	for (i = 0; i < rn_count; i++) {
+		_rn_index_insert(rn_oid_index, rn_pool[i].oid, i);
+		_rn_index_insert(rn_filenode_index, rn_pool[i].filenode, i);
+	}
+
+	for (offset = 0; offset < rn_names_length;
+			offset += strlen(rn_names + offset) + 1)
+		_rn_name_index_insert(offset);
+}
+
+
+/*
+ * Return the offset of a relname in the arena, adding it if we haven't seen
+ * it yet.
+ */
+int
+_rn_intern(const char *relname)
+{
+	unsigned int mask = rn_index_size - 1;
+	unsigned int i;
+	int len, offset;
+
+	for (i = _rn_hash_name(relname) & mask; rn_name_index[i] != 0;
+			i = (i + 1) & mask) {
+		offset = rn_name_index[i] - 1;
+		if (strcmp(rn_names + offset, relname) == 0)
+			return offset;
+	}
+
+	len = strlen(relname) + 1;
+	while (rn_names_length + len > rn_names_size) {
+		rn_names_size = rn_names_size ? rn_names_size * 2 :
+			RN_CACHE_GROWTH * NAMEDATALEN;
+		rn_names = xrealloc(rn_names, rn_names_size, 1);
+	}
+
+	offset = rn_names_length;
+	memcpy(rn_names + offset, relname, len);
+	rn_names_length += len;
+	rn_names_count++;
+
+	rn_name_index[i] = offset + 1;
+
+	return offset;
+}
+
+
+/*
+ * Wipe an rn_record item clear, avoiding public urination. The relname stays
+ * in the arena until the next rn_cache_clear().
  */
 void
 rn_record_invalidate(rn_record *rec)
 {
 	rec->oid = InvalidOid;
 	rec->filenode = InvalidOid;
-	xfree(rec->relname);
-	rec->relname = NULL;
+	rec->relname = -1;
 	rec->shared = false;
 }
 
@@ -68,122 +282,263 @@ rn_record_invalidate(rn_record *rec)
  */
 void
 rn_cache_clear() {
-	int i;
-
 	if (rn_pool == NULL)
 		return;
 
-	for (i = 0; i < rn_count; i++)
-		rn_record_invalidate(&rn_pool[i]);
-
 	rn_count = 0;
+	rn_names_length = 0;
+	rn_names_count = 0;
+	_rn_cache_reindex(0);
+}
+
+
+/*
+ * Make room in the indexes for one more relname.
+ */
+void
+_rn_cache_reserve_name(void)
+{
+	if ((rn_names_count + 1) * 2 > rn_index_size)
+		_rn_cache_reindex(MAX(rn_count, rn_names_count + 1));
 }
 
 
 /*
- * Return the next free item in the cache. If necessary, grow the pool.
+ * Return the next free item in the cache. If necessary, grow the pool and
+ * the indexes.
  */
 rn_record *
 rn_cache_next()
 {
 	rn_record *item;
-	rn_count++;
 
 	/* We've outgrown our cache size, 3nl@rg3! */
-	if (rn_count > rn_pool_size) {
-		rn_pool_size += RN_CACHE_GROWTH;
+	if (rn_count + 1 > rn_pool_size) {
+		rn_pool_size += MAX(rn_pool_size, RN_CACHE_GROWTH);
 		rn_pool = xrealloc(rn_pool, rn_pool_size, sizeof(rn_record));
 	}
 
-	item = &rn_pool[rn_count - 1];
-	item->relname = NULL;
+	/*
+	 * Keep the indexes (and the name index) at most half full. They are
+	 * rebuilt from the records in use, the new one is only counted after.
+	 */
+	if ((rn_count + 1) * 2 > rn_index_size)
+		_rn_cache_reindex(MAX(rn_count + 1, rn_names_count + 1));
+	_rn_cache_reserve_name();
+
+	item = &rn_pool[rn_count++];
+	item->relname = -1;
+	item->xmin = InvalidTransactionId;
+	item->block = 0;
+	item->offnum = 0;
 
 	return item;
 }
 
 
 /*
- * Retrieve an rn_record based on its oid.
+ * Return the relname of a record, NULL if it doesn't have one. The pointer
+ * is only valid until the next addition to the cache.
  */
 char *
-rn_cache_get_from_oid(Oid oid)
+rn_record_get_relname(rn_record *rec)
 {
-	int i;
+	if (rec == NULL || rec->relname == -1)
+		return NULL;
 
-	for (i = 0; i < rn_count; i++) {
-		if (rn_pool[i].oid == InvalidOid)
-			continue;
-		if (rn_pool[i].oid == oid)
-			return rn_pool[i].relname;
-	}
+	return rn_names + rec->relname;
+}
 
-	return NULL;
+
+/*
+ * Retrieve a relname based on its oid.
+ */
+char *
+rn_cache_get_from_oid(Oid oid)
+{
+	return rn_record_get_relname(_rn_index_lookup(rn_oid_index, oid,
+				true));
 }
 
 
 /*
- * Retrieve an rn_record based on its filenode.
+ * Retrieve a relname based on its filenode.
  */
 char *
 rn_cache_get_from_filenode(Oid filenode)
 {
-	int i;
+	return rn_record_get_relname(_rn_index_lookup(rn_filenode_index,
+				filenode, false));
+}
 
-	for (i = 0; i < rn_count; i++) {
-		if (rn_pool[i].filenode == InvalidOid)
-			continue;
-		if (rn_pool[i].filenode == filenode)
-			return rn_pool[i].relname;
-	}
 
-	return NULL;
+/*
+ * Retrieve a record based on its oid, NULL if not found.
+ */
+rn_record *
+rn_cache_get_record_from_oid(Oid oid)
+{
+	return _rn_index_lookup(rn_oid_index, oid, true);
 }
 
 
 /*
- * Remove an element from the cache. Technically we just invalidate it. This is
- * not used in the initial load, but only when we receive a close() from the
- * trace program.
+ * Retrieve a record based on its filenode, NULL if not found.
+ */
+rn_record *
+rn_cache_get_record_from_filenode(Oid filenode)
+{
+	return _rn_index_lookup(rn_filenode_index, filenode, false);
+}
+
+
+/*
+ * Remove a record from the cache. Technically we just take it out of the
+ * indexes and invalidate it, its slot in the pool is lost until the next
+ * rn_cache_clear().
  */
 void
-rn_cache_delete(Oid oid)
+rn_cache_delete(rn_record *rec)
 {
-	int i;
+	int pos;
 
-	for (i = 0; i < rn_count; i++) {
-		if (rn_pool[i].oid == oid) {
-			rn_record_invalidate(&rn_pool[i]);
-			return;
-		}
-	}
+	pos = rec - rn_pool;
+	_rn_index_remove(rn_oid_index, rec->oid, pos, true);
+	_rn_index_remove(rn_filenode_index, rec->filenode, pos, false);
+	rn_record_invalidate(rec);
 }
 
 
 /*
- * Add a file descriptor to the cache. This is used for incremental updates,
- * not for the initial bulk load. It will find empty spots before.
+ * Give a new relname to a record, the old one stays in the arena.
  */
 void
-rn_cache_add(enum rn_origin origin, Oid oid, Oid filenode, char *relname)
+rn_cache_rename(rn_record *rec, char *relname)
 {
-	int i;
-	rn_record *current = NULL;
+	_rn_cache_reserve_name();
+	rec->relname = _rn_intern(relname);
+}
 
-	/* First try to replace an empty slot. */
-	for (i = 0; i < rn_count; i++) {
-		if (rn_pool[i].oid == InvalidOid) {
-			current = &rn_pool[i];
-			break;
-		}
-	}
 
-	if (current == NULL)
-		current = rn_cache_next();
+/*
+ * Add a record to the cache, the returned pointer is only valid until the
+ * next addition.
+ */
+rn_record *
+rn_cache_add(enum rn_origin origin, Oid oid, Oid filenode, char *relname)
+{
+	rn_record *current;
+	int pos;
+
+	current = rn_cache_next();
+	pos = current - rn_pool;
 
 	current->origin = origin;
 	current->oid = oid;
 	current->filenode = filenode;
-	current->relname = xstrdup(relname);
+	current->shared = false;
+	current->relname = _rn_intern(relname);
+
+	_rn_index_insert(rn_oid_index, oid, pos);
+	_rn_index_insert(rn_filenode_index, filenode, pos);
+
+	return current;
+}
+
+
+/*
+ * Expose the arrays of the cache, they stay owned by the rn_cache and are
+ * only valid until the next addition.
+ */
+void
+rn_cache_export(rn_cache_image *image)
+{
+	image->records = rn_pool;
+	image->record_count = rn_count;
+	image->record_size = rn_pool_size;
+	image->oid_index = rn_oid_index;
+	image->filenode_index = rn_filenode_index;
+	image->name_index = rn_name_index;
+	image->index_size = rn_index_size;
+	image->names = rn_names;
+	image->names_length = rn_names_length;
+	image->names_size = rn_names_size;
+	image->names_count = rn_names_count;
+}
+
+
+/*
+ * Replace the content of the cache with a copy of the given arrays, as
+ * exported by rn_cache_export(). Nothing is hashed or interned again.
+ */
+void
+rn_cache_import(rn_cache_image *image)
+{
+	rn_count = image->record_count;
+	rn_pool_size = MAX(rn_count, RN_CACHE_GROWTH);
+	rn_pool = xrealloc(rn_pool, rn_pool_size, sizeof(rn_record));
+	memcpy(rn_pool, image->records, rn_count * sizeof(rn_record));
+
+	rn_index_size = image->index_size;
+	rn_oid_index = xrealloc(rn_oid_index, rn_index_size, sizeof(int));
+	rn_filenode_index = xrealloc(rn_filenode_index, rn_index_size,
+			sizeof(int));
+	rn_name_index = xrealloc(rn_name_index, rn_index_size, sizeof(int));
+	memcpy(rn_oid_index, image->oid_index, rn_index_size * sizeof(int));
+	memcpy(rn_filenode_index, image->filenode_index,
+			rn_index_size * sizeof(int));
+	memcpy(rn_name_index, image->name_index, rn_index_size * sizeof(int));
+
+	rn_names_length = image->names_length;
+	rn_names_count = image->names_count;
+	rn_names_size = MAX(rn_names_length, RN_CACHE_GROWTH * NAMEDATALEN);
+	rn_names = xrealloc(rn_names, rn_names_size, 1);
+	memcpy(rn_names, image->names, rn_names_length);
+}
+
+
+/*
+ * Hand the arrays of the cache over to 'image' and start again with an empty
+ * cache. Unlike rn_cache_export(), the image owns them until they are given
+ * back with rn_cache_restore(), nothing is copied.
+ */
+void
+rn_cache_save(rn_cache_image *image)
+{
+	rn_cache_export(image);
+
+	rn_pool = NULL;
+	rn_count = 0;
+	rn_pool_size = 0;
+	rn_oid_index = NULL;
+	rn_filenode_index = NULL;
+	rn_name_index = NULL;
+	rn_index_size = 0;
+	rn_names = NULL;
+	rn_names_length = 0;
+	rn_names_size = 0;
+	rn_names_count = 0;
+}
+
+
+/*
+ * Take back the arrays saved by rn_cache_save(), an image full of zeros is an
+ * empty cache. The current content of the cache must have been saved first.
+ */
+void
+rn_cache_restore(rn_cache_image *image)
+{
+	rn_pool = image->records;
+	rn_count = image->record_count;
+	rn_pool_size = image->record_size;
+	rn_oid_index = image->oid_index;
+	rn_filenode_index = image->filenode_index;
+	rn_name_index = image->name_index;
+	rn_index_size = image->index_size;
+	rn_names = image->names;
+	rn_names_length = image->names_length;
+	rn_names_size = image->names_size;
+	rn_names_count = image->names_count;
 }
 
 
@@ -196,11 +551,10 @@ rn_cache_print()
 	int i;
 	rn_record *rn = NULL;
 
-	/* First try to replace an empty slot. */
 	for (i = 0; i < rn_count; i++) {
 		rn = &rn_pool[i];
 
 		printf("%i\t%i\t%i\t%i\t%s\n", i, rn->origin, rn->oid,
-				rn->filenode, rn->relname);
+				rn->filenode, rn_record_get_relname(rn));
 	}
 }
@@ -15,7 +15,7 @@
  */
 
 
-/* How much to realloc when the cache is too tight. */
+/* Minimum growth of the pool and indexes when the cache is too tight. */
 #define RN_CACHE_GROWTH		256
 
 
@@ -31,14 +31,49 @@ typedef struct _rn_record {
 	Oid oid;
 	Oid filenode;
 	bool shared;
-	char *relname;
+	int relname;		/* offset in the relname arena, -1 if none */
+
+	/* Version of the pg_class tuple this comes from, and where it is. */
+	TransactionId xmin;
+	uint32 block;
+	uint16 offnum;
 } rn_record;
 
 
+/*
+ * Raw view of the rn_cache arrays, the snapshots save and restore them as-is.
+ * The sizes of the allocations ('record_size', 'names_size') are only used
+ * by rn_cache_save() and rn_cache_restore().
+ */
+typedef struct _rn_cache_image {
+	rn_record	*records;
+	int		 record_count;
+	int		 record_size;
+	int		*oid_index;
+	int		*filenode_index;
+	int		*name_index;
+	int		 index_size;
+	char		*names;
+	int		 names_length;
+	int		 names_size;
+	int		 names_count;
+} rn_cache_image;
+
+
+unsigned int	 _rn_hash_name(const char *);
 void		 rn_record_invalidate(rn_record *);
 void		 rn_cache_clear();
 rn_record	*rn_cache_next();
+char		*rn_record_get_relname(rn_record *);
 char		*rn_cache_get_from_oid(Oid);
 char		*rn_cache_get_from_filenode(Oid);
-void		 rn_cache_delete(Oid);
-void		 rn_cache_add(enum rn_origin, Oid, Oid, char *);
+rn_record	*rn_cache_get_record_from_oid(Oid);
+rn_record	*rn_cache_get_record_from_filenode(Oid);
+void		 rn_cache_delete(rn_record *);
+void		 rn_cache_rename(rn_record *, char *);
+rn_record	*rn_cache_add(enum rn_origin, Oid, Oid, char *);
+void		 rn_cache_print();
+void		 rn_cache_export(rn_cache_image *);
+void		 rn_cache_import(rn_cache_image *);
+void		 rn_cache_save(rn_cache_image *);
+void		 rn_cache_restore(rn_cache_image *);
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ *
+ * Sampling mode. Instead of tracing every system call, we look at the file
+ * descriptors of the process every few milliseconds through /proc. Their
+ * current position (fdinfo) is enough to see how far a scan went and how
+ * fast it moves, and the backend doesn't pay anything for it.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <err.h>
+
+#include <postgres.h>
+
+#include "pfd.h"
+#include "pfd_cache.h"
+#include "proc.h"
+#include "progress.h"
+#include "sample.h"
+#include "utils.h"
+#include "xmalloc.h"
+
+
+/*
+ * What we remember of each file descriptor from one round to the next,
+ * indexed by fd. 'round' is the last round the fd was seen in.
+ */
+struct sample_fd {
+	unsigned int	 round;
+	off_t		 offset;
+	double		 rate;
+};
+
+struct sample_fd *sample_fds = NULL;
+int sample_fd_size = 0;
+unsigned int sample_round = 0;
+
+/* Time elapsed since the previous round, in seconds. */
+double sample_elapsed = 0;
+
+/* The process sampled. */
+pid_t sample_pid = 0;
+
+extern volatile sig_atomic_t trace_interrupted;
+
+
+/*
+ * Handle one file descriptor found in /proc. New descriptors or descriptors
+ * now pointing to another file are (re)loaded in the pfd_cache, the others
+ * only get their offset and rate updated.
+ */
+void
+_sample_fd(int fd, char *path, off_t offset)
+{
+	struct sample_fd *sfd;
+	pfd_t *pfd;
+	int old_size;
+
+	if (fd >= sample_fd_size) {
+		old_size = sample_fd_size;
+		sample_fd_size = fd + PFD_CACHE_GROWTH;
+		sample_fds = xrealloc(sample_fds, sample_fd_size,
+				sizeof(struct sample_fd));
+		memset(sample_fds + old_size, 0, (sample_fd_size - old_size) *
+				sizeof(struct sample_fd));
+	}
+
+	sfd = &sample_fds[fd];
+	pfd = pfd_cache_get(fd);
+
+	if (sfd->round == 0 || pfd->filepath == NULL ||
+			strcmp(pfd->filepath, path) != 0) {
+		pfd_cache_delete(fd);
+		pfd_cache_add(fd, path);
+		sfd->rate = 0;
+	} else if (sample_elapsed > 0 && offset >= 0) {
+		sfd->rate = (offset - sfd->offset) / sample_elapsed;
+	}
+
+	sfd->offset = offset;
+	sfd->round = sample_round;
+	pfd->offset = offset;
+
+	progress_sample(pfd, sample_pid, offset);
+}
+
+
+/*
+ * Print the state of all the relation files currently open, with the progress
+ * through their relation and when it should be done if it is read
+ * sequentially.
+ */
+void
+_sample_print(void)
+{
+	struct sample_fd *sfd;
+	pfd_t *pfd;
+	progress p;
+	char *repr, offset[32], rate[32], eta[32];
+	int fd, percent;
+
+	printf("-- %ld\n", (long)time(NULL));
+
+	for (fd = 0; fd < sample_fd_size; fd++) {
+		sfd = &sample_fds[fd];
+		if (sfd->round != sample_round)
+			continue;
+
+		pfd = pfd_cache_get(fd);
+		if (pfd->filenode == InvalidOid)
+			continue;
+
+		repr = pfd_get_repr(pfd);
+		printf("%s seg=%d offset=%s rate=%s/s", repr, pfd->part,
+				human_size(sfd->offset, offset, sizeof(offset)),
+				human_size(sfd->rate, rate, sizeof(rate)));
+		xfree(repr);
+
+		if (progress_get(pfd, &p) == 0 &&
+				(percent = progress_get_percent(&p)) >= 0) {
+			printf(" progress=%d%%", percent);
+			if (progress_get_eta(&p) >= 0)
+				printf(" eta=%s", human_duration(
+						progress_get_eta(&p), eta,
+						sizeof(eta)));
+		}
+		printf("\n");
+	}
+
+	fflush(stdout);
+}
+
+
+/*
+ * Sample the file descriptors of the process every 'interval' milliseconds,
+ * until it goes away or we are interrupted.
+ */
+void
+sample_run(pid_t pid, int interval)
+{
+	double now, last = 0;
+	int fd;
+
+	sample_pid = pid;
+
+	while (!trace_interrupted) {
+		now = get_monotonic_time();
+		sample_elapsed = last > 0 ? now - last : 0;
+		last = now;
+		sample_round++;
+
+		if (proc_read_fds(pid, _sample_fd) == -1) {
+			if (errno == ENOENT)
+				break;
+			err(1, "unable to read the file descriptors of %d",
+					pid);
+		}
+
+		/* Forget the descriptors closed since the last round. */
+		for (fd = 0; fd < sample_fd_size; fd++) {
+			if (sample_fds[fd].round == 0 ||
+					sample_fds[fd].round == sample_round)
+				continue;
+			pfd_cache_delete(fd);
+			sample_fds[fd].round = 0;
+		}
+
+		_sample_print();
+
+		usleep(interval * 1000);
+	}
+
+	debug("sample: pid %d is gone\n", pid);
+}
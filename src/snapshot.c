@@ -0,0 +1,455 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * On-disk snapshots of the rn_cache, to avoid decoding pg_class every time we
+ * attach to a backend of the same database.
+ *
+ * A snapshot is a header followed by the raw arrays of the rn_cache (records,
+ * hash indexes, relname arena) and the LSN of each pg_class page, each section
+ * aligned on 8 bytes. It's mapped and copied back as-is, nothing is decoded or
+ * hashed. The layout is native (endianness, sizeof(rn_record)), a snapshot is
+ * only meant to be read by the binary that wrote it.
+ *
+ * The snapshot is current if pg_class has the same filenode, size and mtime
+ * as when it was taken. Otherwise it's stale but still useful: with the page
+ * LSNs restored, the next scan only decodes the pages that changed.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <err.h>
+
+#include <postgres.h>
+
+#include "rn_cache.h"
+#include "strlcpy.h"
+#include "utils.h"
+#include "xmalloc.h"
+#include "pg.h"
+#include "snapshot.h"
+
+
+#define SNAPSHOT_ALIGN(x)	(((x) + 7) & ~((size_t)7))
+
+
+enum snapshot_section {
+	SECTION_LSNS,
+	SECTION_RECORDS,
+	SECTION_OID_INDEX,
+	SECTION_FILENODE_INDEX,
+	SECTION_NAME_INDEX,
+	SECTION_NAMES,
+	SECTION_COUNT
+};
+
+
+struct snapshot_header {
+	uint32		 magic;
+	uint32		 version;
+	uint32		 record_size;	/* sizeof(rn_record) */
+	Oid		 database_oid;
+	Oid		 pg_class_filenode;
+	int32		 page_count;
+	int32		 record_count;
+	int32		 index_size;
+	int32		 names_length;
+	int32		 names_count;
+	int64		 pg_class_size;
+	int64		 pg_class_mtime;
+	int64		 taken;
+	char		 cluster_path[MAXPGPATH];
+};
+
+
+extern char *current_cluster_path;
+extern Oid current_database_oid;
+extern Oid pg_class_filenode;
+extern uint64 *pg_class_lsns;
+extern int pg_class_page_count;
+
+
+/*
+ * Build the path of the snapshot of the current cluster and database, the
+ * cluster path is hashed (FNV-1a) to keep the name short.
+ */
+void
+_snapshot_get_path(char *buf, size_t len)
+{
+	snprintf(buf, len, "%s/pg_trace.%08x.%u.snap", SNAPSHOT_DIR,
+			_rn_hash_name(current_cluster_path),
+			current_database_oid);
+}
+
+
+/*
+ * Compute the size and offset of each section, returns the total size.
+ */
+size_t
+_snapshot_layout(struct snapshot_header *hdr, size_t *offsets, size_t *sizes)
+{
+	size_t offset;
+	int i;
+
+	sizes[SECTION_LSNS] = hdr->page_count * sizeof(uint64);
+	sizes[SECTION_RECORDS] = hdr->record_count * sizeof(rn_record);
+	sizes[SECTION_OID_INDEX] = hdr->index_size * sizeof(int);
+	sizes[SECTION_FILENODE_INDEX] = hdr->index_size * sizeof(int);
+	sizes[SECTION_NAME_INDEX] = hdr->index_size * sizeof(int);
+	sizes[SECTION_NAMES] = hdr->names_length;
+
+	offset = SNAPSHOT_ALIGN(sizeof(struct snapshot_header));
+	for (i = 0; i < SECTION_COUNT; i++) {
+		offsets[i] = offset;
+		offset += SNAPSHOT_ALIGN(sizes[i]);
+	}
+
+	return offset;
+}
+
+
+/*
+ * Stat the first segment of pg_class, -1 if we can't.
+ */
+int
+_snapshot_stat_pg_class(struct stat *sb)
+{
+	char *filepath;
+	int ret;
+
+	filepath = pg_get_pg_class_filepath(false);
+	if (filepath == NULL)
+		return -1;
+
+	ret = stat(filepath, sb);
+	xfree(filepath);
+
+	return ret;
+}
+
+
+/*
+ * Check that an Oid index only points at records of the snapshot, and that it
+ * has no more entries than records: the lookups stop on the first empty slot.
+ */
+int
+_snapshot_check_oid_index(int *index, int size, int record_count)
+{
+	int i, used = 0;
+
+	for (i = 0; i < size; i++) {
+		if (index[i] == 0)
+			continue;
+		if (index[i] < 0 || index[i] > record_count)
+			return 0;
+		used++;
+	}
+
+	return used <= record_count;
+}
+
+
+/*
+ * Check that a relname offset is the start of a name of the arena, which is
+ * known to end with a terminated name.
+ */
+int
+_snapshot_is_name(char *names, int names_length, int offset)
+{
+	if (offset < 0 || offset >= names_length)
+		return 0;
+
+	return offset == 0 || names[offset - 1] == '\0';
+}
+
+
+/*
+ * Check every slot of the indexes and every relname offset of the records,
+ * they are used as-is once imported.
+ */
+int
+_snapshot_check_sections(struct snapshot_header *hdr, size_t *offsets)
+{
+	rn_record *records;
+	int *name_index;
+	char *names;
+	int i, used = 0, count = 0;
+
+	records = (rn_record *)((char *)hdr + offsets[SECTION_RECORDS]);
+	name_index = (int *)((char *)hdr + offsets[SECTION_NAME_INDEX]);
+	names = (char *)hdr + offsets[SECTION_NAMES];
+
+	for (i = 0; i < hdr->record_count; i++)
+		if (records[i].relname != -1 && !_snapshot_is_name(names,
+					hdr->names_length, records[i].relname))
+			return 0;
+
+	if (!_snapshot_check_oid_index((int *)((char *)hdr +
+				offsets[SECTION_OID_INDEX]), hdr->index_size,
+				hdr->record_count) ||
+			!_snapshot_check_oid_index((int *)((char *)hdr +
+				offsets[SECTION_FILENODE_INDEX]),
+				hdr->index_size, hdr->record_count))
+		return 0;
+
+	for (i = 0; i < hdr->index_size; i++) {
+		if (name_index[i] == 0)
+			continue;
+		if (!_snapshot_is_name(names, hdr->names_length,
+					name_index[i] - 1))
+			return 0;
+		used++;
+	}
+
+	/* The name index is grown from the count, it has to be right. */
+	for (i = 0; i < hdr->names_length; i++)
+		if (names[i] == '\0')
+			count++;
+
+	return count == hdr->names_count && used == count;
+}
+
+
+/*
+ * Check that a snapshot belongs to the current cluster and database, that its
+ * sections fit in the file and that they only point within themselves.
+ */
+int
+_snapshot_is_valid(struct snapshot_header *hdr, size_t size)
+{
+	size_t offsets[SECTION_COUNT], sizes[SECTION_COUNT];
+
+	if (hdr->magic != SNAPSHOT_MAGIC || hdr->version != SNAPSHOT_VERSION ||
+			hdr->record_size != sizeof(rn_record))
+		return 0;
+
+	if (hdr->database_oid != current_database_oid ||
+			strncmp(hdr->cluster_path, current_cluster_path,
+				sizeof(hdr->cluster_path)) != 0)
+		return 0;
+
+	/* The indexes are a power of two, at most half full. */
+	if (hdr->page_count < 0 || hdr->record_count <= 0 ||
+			hdr->names_length <= 0 || hdr->names_count <= 0 ||
+			hdr->record_count > hdr->index_size / 2 ||
+			hdr->names_count > hdr->index_size / 2 ||
+			(hdr->index_size & (hdr->index_size - 1)) != 0)
+		return 0;
+
+	if (_snapshot_layout(hdr, offsets, sizes) > size)
+		return 0;
+
+	/* The arena must end with a terminated name. */
+	if (((char *)hdr)[offsets[SECTION_NAMES] + hdr->names_length - 1]
+			!= '\0')
+		return 0;
+
+	return _snapshot_check_sections(hdr, offsets);
+}
+
+
+/*
+ * Load the snapshot of the current database in the rn_cache, along with the
+ * page LSNs of pg_class.
+ */
+enum snapshot_state
+snapshot_load(void)
+{
+	struct snapshot_header *hdr;
+	rn_cache_image image;
+	struct stat sb;
+	size_t offsets[SECTION_COUNT], sizes[SECTION_COUNT];
+	char path[MAXPATHLEN], *map;
+	size_t map_size;
+	enum snapshot_state state = SNAPSHOT_STALE;
+	int fd;
+
+	if (current_cluster_path == NULL || current_database_oid == InvalidOid)
+		return SNAPSHOT_NONE;
+
+	_snapshot_get_path(path, sizeof(path));
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1)
+		return SNAPSHOT_NONE;
+
+	/* We run as root, only trust what root wrote. */
+	if (fstat(fd, &sb) == -1 || sb.st_uid != geteuid() ||
+			(sb.st_mode & (S_IWGRP | S_IWOTH)) != 0 ||
+			sb.st_size < (off_t)sizeof(struct snapshot_header)) {
+		debug("snapshot: ignoring %s\n", path);
+		close(fd);
+		return SNAPSHOT_NONE;
+	}
+
+	map_size = sb.st_size;
+	map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return SNAPSHOT_NONE;
+
+	hdr = (struct snapshot_header *)map;
+	if (!_snapshot_is_valid(hdr, map_size)) {
+		debug("snapshot: %s is invalid\n", path);
+		munmap(map, map_size);
+		return SNAPSHOT_NONE;
+	}
+
+	_snapshot_layout(hdr, offsets, sizes);
+
+	image.records = (rn_record *)(map + offsets[SECTION_RECORDS]);
+	image.record_count = hdr->record_count;
+	image.oid_index = (int *)(map + offsets[SECTION_OID_INDEX]);
+	image.filenode_index = (int *)(map + offsets[SECTION_FILENODE_INDEX]);
+	image.name_index = (int *)(map + offsets[SECTION_NAME_INDEX]);
+	image.index_size = hdr->index_size;
+	image.names = map + offsets[SECTION_NAMES];
+	image.names_length = hdr->names_length;
+	image.names_count = hdr->names_count;
+	rn_cache_import(&image);
+
+	pg_class_filenode = hdr->pg_class_filenode;
+	pg_class_page_count = hdr->page_count;
+	if (hdr->page_count > 0) {
+		pg_class_lsns = xrealloc(pg_class_lsns, hdr->page_count,
+				sizeof(uint64));
+		memcpy(pg_class_lsns, map + offsets[SECTION_LSNS],
+				sizes[SECTION_LSNS]);
+	}
+
+	/* The mtime has a one second resolution, a change in the second the
+	 * snapshot was taken would go unnoticed. */
+	if (_snapshot_stat_pg_class(&sb) == 0 &&
+			hdr->pg_class_filenode == pg_get_pg_class_filenode() &&
+			hdr->pg_class_size == sb.st_size &&
+			hdr->pg_class_mtime == sb.st_mtime &&
+			hdr->pg_class_mtime < hdr->taken)
+		state = SNAPSHOT_CURRENT;
+
+	debug("snapshot: loaded %d relations from %s (%s)\n",
+			hdr->record_count, path,
+			state == SNAPSHOT_CURRENT ? "current" : "stale");
+
+	munmap(map, map_size);
+
+	return state;
+}
+
+
+/*
+ * Write one section followed by its padding.
+ */
+void
+_snapshot_write(FILE *fp, void *data, size_t size)
+{
+	static const char zeros[8];
+
+	if (size > 0)
+		fwrite(data, size, 1, fp);
+	fwrite(zeros, SNAPSHOT_ALIGN(size) - size, 1, fp);
+}
+
+
+/*
+ * Save the rn_cache of the current database. The snapshot is written in a
+ * temporary file then renamed, a concurrent pg_trace never sees half of it.
+ */
+void
+snapshot_save(void)
+{
+	struct snapshot_header hdr;
+	rn_cache_image image;
+	struct stat sb;
+	size_t offsets[SECTION_COUNT], sizes[SECTION_COUNT];
+	char path[MAXPATHLEN], tmp_path[MAXPATHLEN + 8];
+	FILE *fp;
+	int fd, failed;
+
+	if (current_cluster_path == NULL || current_database_oid == InvalidOid)
+		return;
+
+	if (_snapshot_stat_pg_class(&sb) == -1)
+		return;
+
+	rn_cache_export(&image);
+	if (image.record_count == 0)
+		return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SNAPSHOT_MAGIC;
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.record_size = sizeof(rn_record);
+	hdr.database_oid = current_database_oid;
+	/* Without any scan (index lookups), the relations are as current as
+	 * the pg_class we have now. */
+	hdr.pg_class_filenode = pg_class_page_count > 0 ? pg_class_filenode :
+		pg_get_pg_class_filenode();
+	hdr.page_count = pg_class_page_count;
+	hdr.record_count = image.record_count;
+	hdr.index_size = image.index_size;
+	hdr.names_length = image.names_length;
+	hdr.names_count = image.names_count;
+	hdr.pg_class_size = sb.st_size;
+	hdr.pg_class_mtime = sb.st_mtime;
+	hdr.taken = time(NULL);
+	strlcpy(hdr.cluster_path, current_cluster_path,
+			sizeof(hdr.cluster_path));
+
+	_snapshot_layout(&hdr, offsets, sizes);
+
+	_snapshot_get_path(path, sizeof(path));
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+
+	fd = mkstemp(tmp_path);
+	if (fd == -1) {
+		warn("snapshot: unable to create %s", tmp_path);
+		return;
+	}
+
+	fp = fdopen(fd, "w");
+	if (fp == NULL)
+		err(1, "snapshot_save:fdopen()");
+
+	_snapshot_write(fp, &hdr, sizeof(hdr));
+	_snapshot_write(fp, pg_class_lsns, sizes[SECTION_LSNS]);
+	_snapshot_write(fp, image.records, sizes[SECTION_RECORDS]);
+	_snapshot_write(fp, image.oid_index, sizes[SECTION_OID_INDEX]);
+	_snapshot_write(fp, image.filenode_index,
+			sizes[SECTION_FILENODE_INDEX]);
+	_snapshot_write(fp, image.name_index, sizes[SECTION_NAME_INDEX]);
+	_snapshot_write(fp, image.names, sizes[SECTION_NAMES]);
+
+	failed = ferror(fp);
+	if (fclose(fp) != 0)
+		failed = 1;
+
+	if (failed || rename(tmp_path, path) == -1) {
+		warn("snapshot: unable to write %s", path);
+		unlink(tmp_path);
+		return;
+	}
+
+	debug("snapshot: saved %d relations to %s\n", hdr.record_count,
+			path);
+}
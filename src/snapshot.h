@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/* Where the snapshots are kept, one per cluster and database. */
+#define SNAPSHOT_DIR		"/var/tmp"
+
+#define SNAPSHOT_MAGIC		0x70677472	/* "pgtr" */
+#define SNAPSHOT_VERSION	2
+
+
+/*
+ * Result of snapshot_load(). A stale snapshot is still used, only the pages
+ * of pg_class that changed since it was taken need to be decoded.
+ */
+enum snapshot_state {
+	SNAPSHOT_NONE,
+	SNAPSHOT_STALE,
+	SNAPSHOT_CURRENT
+};
+
+
+enum snapshot_state	 snapshot_load(void);
+void			 snapshot_save(void);
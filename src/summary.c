@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * Aggregation mode (-c), the system calls only update in-memory counters per
+ * relation fork and per function, a summary table is printed every few
+ * seconds, on SIGUSR1 and when we exit. Without the printf of every call,
+ * the tracer keeps up with much busier backends.
+ *
+ * The records are kept in a reltab. Everything happens on the tracing
+ * thread, the signal handler only raises a flag checked on the next event or
+ * by the idle handler of the event loop. A timer interrupts the loops which
+ * block without a timeout (ptrace's waitpid()), an idle backend still gets
+ * its tables.
+ */
+
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <err.h>
+
+#include <postgres.h>
+
+#include "pfd.h"
+#include "pfd_cache.h"
+#include "trace.h"
+#include "dispatch.h"
+#include "hist.h"
+#include "reltab.h"
+#include "summary.h"
+#include "strlcpy.h"
+#include "utils.h"
+#include "xmalloc.h"
+
+
+reltab summary_table = RELTAB_INITIALIZER(summary);
+
+/* Seconds between two tables, 0 to only print them on demand and at exit. */
+int summary_interval = 0;
+double summary_last = 0.0;
+double summary_started = 0.0;
+
+volatile sig_atomic_t summary_requested = 0;
+
+
+/*
+ * Find the record of a function on a relation fork, create it if this is the
+ * first time we see it. 'pfd' is NULL for the functions without a file
+ * descriptor.
+ */
+summary *
+_summary_get(pfd_t *pfd, enum trace_func func)
+{
+	summary *s;
+	relkey key;
+	bool created;
+
+	memset(&key, 0, sizeof(key));
+	key.filenode = InvalidOid;
+	key.file_type = FILE_TYPE_UNKNOWN;
+	key.func = func;
+
+	if (pfd != NULL && pfd->fd_type == FD_TYPE_REG) {
+		key.database_oid = pfd->database_oid;
+		key.filenode = pfd->filenode;
+		key.file_type = pfd->file_type;
+		key.shared = pfd->shared;
+	}
+
+	s = reltab_get(&summary_table, &key, &created);
+
+	/* Only try once per record, the catalog lookups are not free. */
+	if (created && key.filenode != InvalidOid && pfd->relname == NULL)
+		pfd_update_from_pg(pfd);
+
+	return s;
+}
+
+
+/*
+ * Returns the file descriptor an event is about, -1 if none.
+ */
+int
+_summary_get_fd(trace_event *ev)
+{
+	switch (ev->func) {
+	case TRACE_FUNC_OPEN:
+	case TRACE_FUNC_OPENAT:
+		return (int)ev->result;
+	case TRACE_FUNC_OTHER:
+		return -1;
+	default:
+		return (int)ev->args[0];
+	}
+}
+
+
+/*
+ * Most expensive first, by number of calls when the durations are unknown.
+ */
+int
+_summary_compare(const void *a, const void *b)
+{
+	const summary *sa = a, *sb = b;
+
+	if (sa->time != sb->time)
+		return sa->time < sb->time ? 1 : -1;
+	if (sa->calls != sb->calls)
+		return sa->calls < sb->calls ? 1 : -1;
+
+	return 0;
+}
+
+
+/*
+ * SIGUSR1 asks for a table, printed on the next event or when idle.
+ */
+void
+_summary_sigusr1_handler(int sig)
+{
+	summary_requested = 1;
+}
+
+
+/*
+ * SIGALRM only interrupts the wait of the event loop.
+ */
+void
+_summary_sigalrm_handler(int sig)
+{
+}
+
+
+/*
+ * Print a table if one was asked for or if it is time to.
+ */
+void
+_summary_check(void)
+{
+	double now;
+
+	if (summary_requested) {
+		summary_requested = 0;
+		summary_print();
+	} else if (summary_interval > 0) {
+		now = get_monotonic_time();
+		if (now - summary_last >= summary_interval)
+			summary_print();
+	}
+}
+
+
+/*
+ * Start counting, a table is printed every 'interval' seconds (if not 0) and
+ * at exit.
+ */
+void
+summary_start(int interval)
+{
+	struct sigaction sa;
+	struct itimerval it;
+
+	summary_interval = interval;
+	summary_started = summary_last = get_monotonic_time();
+
+	/* No SA_RESTART, a blocking call of an event loop has to return. */
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = _summary_sigusr1_handler;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	if (interval > 0) {
+		sa.sa_handler = _summary_sigalrm_handler;
+		sigaction(SIGALRM, &sa, NULL);
+
+		memset(&it, 0, sizeof(it));
+		it.it_interval.tv_usec = TRACE_IDLE_TIMEOUT * 1000;
+		it.it_value = it.it_interval;
+		if (setitimer(ITIMER_REAL, &it, NULL) == -1)
+			err(1, "summary: setitimer()");
+	}
+
+	trace_set_idle_handler(_summary_check);
+	atexit(summary_print);
+}
+
+
+/*
+ * Dispatch handler counting every system call. It has to run before close()
+ * forgets the descriptor and after open() learned about it.
+ */
+void
+summary_event(trace_event *ev)
+{
+	summary *s;
+	pfd_t *pfd = NULL;
+	int fd;
+
+	fd = _summary_get_fd(ev);
+	if (fd >= 0)
+		pfd = pfd_cache_get(fd);
+
+	s = _summary_get(pfd, ev->func);
+
+	if (s->name[0] == '\0' && s->key.filenode != InvalidOid &&
+			pfd->relname != NULL)
+		strlcpy(s->name, pfd->relname, sizeof(s->name));
+
+	s->calls++;
+	if (ev->result < 0)
+		s->errors++;
+
+	switch (ev->func) {
+	case TRACE_FUNC_READ:
+	case TRACE_FUNC_WRITE:
+	case TRACE_FUNC_PREAD:
+	case TRACE_FUNC_PWRITE:
+	case TRACE_FUNC_PREADV:
+	case TRACE_FUNC_PWRITEV:
+		if (ev->result > 0)
+			s->bytes += ev->result;
+		break;
+	default:
+		break;
+	}
+
+	if (ev->duration >= 0) {
+		s->time += ev->duration;
+		hist_add(&s->latency, ev->duration);
+	}
+
+	_summary_check();
+}
+
+
+/*
+ * Format a duration in nanoseconds as microseconds.
+ */
+char *
+_summary_format_us(uint64 ns, char *buf, size_t len)
+{
+	snprintf(buf, len, "%.1f", (double)ns / 1000);
+
+	return buf;
+}
+
+
+/*
+ * Print the table of all the records since we started, sorted by time spent.
+ * The percentiles and maximum of the durations are in microseconds, '-' when
+ * the tracer doesn't give us durations. A relation read from the disk stands
+ * out with a p99 orders of magnitude above the one of a relation in cache.
+ */
+void
+summary_print(void)
+{
+	summary *s, total;
+	char name[MAX_RELNAME_LENGTH + 32], bytes[32];
+	char p50[32], p99[32], p999[32], max[32];
+	unsigned long lines, dropped;
+	double now;
+	int i;
+
+	now = get_monotonic_time();
+	summary_last = now;
+
+	if (summary_table.count == 0)
+		return;
+
+	qsort(summary_table.pool, summary_table.count, sizeof(summary),
+			_summary_compare);
+	reltab_reindex(&summary_table);
+
+	memset(&total, 0, sizeof(total));
+
+	printf("\n-- %d records after %.1fs", summary_table.count,
+			now - summary_started);
+	trace_get_counters(&lines, &dropped);
+	if (dropped > 0)
+		printf(", %lu out of %lu lines dropped", dropped, lines);
+	printf("\n");
+	printf("%-*s %-12s %10s %8s %12s %12s %9s %9s %9s %9s\n",
+			SUMMARY_NAME_WIDTH, "relname", "syscall", "calls",
+			"errors", "bytes", "time(s)", "p50(us)", "p99(us)",
+			"p999(us)", "max(us)");
+
+	for (i = 0; i <= summary_table.count; i++) {
+		if (i < summary_table.count) {
+			s = (summary *)summary_table.pool + i;
+			reltab_get_name(&s->key, s->name, name, sizeof(name));
+			total.calls += s->calls;
+			total.errors += s->errors;
+			total.bytes += s->bytes;
+			total.time += s->time;
+			hist_merge(&total.latency, &s->latency);
+		} else {
+			s = &total;
+			strlcpy(name, "total", sizeof(name));
+		}
+
+		if (s->latency.count > 0) {
+			_summary_format_us(hist_get_percentile(&s->latency,
+						50), p50, sizeof(p50));
+			_summary_format_us(hist_get_percentile(&s->latency,
+						99), p99, sizeof(p99));
+			_summary_format_us(hist_get_percentile(&s->latency,
+						99.9), p999, sizeof(p999));
+			_summary_format_us(s->latency.max, max, sizeof(max));
+		} else {
+			strlcpy(p50, "-", sizeof(p50));
+			strlcpy(p99, "-", sizeof(p99));
+			strlcpy(p999, "-", sizeof(p999));
+			strlcpy(max, "-", sizeof(max));
+		}
+
+		printf("%-*.*s %-12s %10llu %8llu %12s %12.6f %9s %9s %9s "
+				"%9s\n",
+				SUMMARY_NAME_WIDTH, SUMMARY_NAME_WIDTH, name,
+				s == &total ? "" :
+				dispatch_get_name(s->key.func),
+				(unsigned long long)s->calls,
+				(unsigned long long)s->errors,
+				human_size(s->bytes, bytes, sizeof(bytes)),
+				(double)s->time / 1e9, p50, p99, p999, max);
+	}
+
+	fflush(stdout);
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/* Width of the relation column. */
+#define SUMMARY_NAME_WIDTH	40
+
+
+/*
+ * Counters of one system call on one relation fork, like strace -c but per
+ * postgres object. The segments of a fork share the same record. The calls
+ * on anything else than a relation are counted on records with an invalid
+ * filenode, one per file_type. 'time' is the total time spent in the calls
+ * that came with a duration, in nanoseconds, 'latency' their distribution.
+ */
+typedef struct _summary {
+	relkey		 key;
+	char		 name[MAX_RELNAME_LENGTH];
+	uint64		 calls;
+	uint64		 errors;
+	uint64		 bytes;
+	uint64		 time;
+	hist		 latency;
+} summary;
+
+
+void		 summary_start(int);
+void		 summary_event(trace_event *);
+void		 summary_print(void);
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ *
+ * Table of the Linux system calls with a handler, shared by the native
+ * tracers (ptrace, tracefs) which only see system call numbers.
+ */
+
+#include <sys/types.h>
+#include <sys/syscall.h>
+
+#include <stdio.h>
+
+#include "trace.h"
+#include "sysent.h"
+#include "xmalloc.h"
+
+
+/*
+ * Some architectures (aarch64) only have the *at() and dup3() variants, what
+ * is missing there is left out.
+ */
+struct sysent sysents[] = {
+	{ SYS_read,		TRACE_FUNC_READ,	"read",		-1 },
+	{ SYS_write,		TRACE_FUNC_WRITE,	"write",	-1 },
+#ifdef SYS_open
+	{ SYS_open,		TRACE_FUNC_OPEN,	"open",		0 },
+#endif
+	{ SYS_openat,		TRACE_FUNC_OPENAT,	"openat",	1 },
+	{ SYS_close,		TRACE_FUNC_CLOSE,	"close",	-1 },
+	{ SYS_lseek,		TRACE_FUNC_LSEEK,	"lseek",	-1 },
+	{ SYS_pread64,		TRACE_FUNC_PREAD,	"pread64",	-1 },
+	{ SYS_pwrite64,		TRACE_FUNC_PWRITE,	"pwrite64",	-1 },
+	{ SYS_preadv,		TRACE_FUNC_PREADV,	"preadv",	-1 },
+	{ SYS_pwritev,		TRACE_FUNC_PWRITEV,	"pwritev",	-1 },
+#ifdef SYS_preadv2
+	{ SYS_preadv2,		TRACE_FUNC_PREADV,	"preadv2",	-1 },
+	{ SYS_pwritev2,		TRACE_FUNC_PWRITEV,	"pwritev2",	-1 },
+#endif
+	{ SYS_fsync,		TRACE_FUNC_FSYNC,	"fsync",	-1 },
+	{ SYS_fdatasync,	TRACE_FUNC_FDATASYNC,	"fdatasync",	-1 },
+	{ SYS_ftruncate,	TRACE_FUNC_FTRUNCATE,	"ftruncate",	-1 },
+	{ SYS_dup,		TRACE_FUNC_DUP,		"dup",		-1 },
+#ifdef SYS_dup2
+	{ SYS_dup2,		TRACE_FUNC_DUP2,	"dup2",		-1 },
+#endif
+	{ SYS_dup3,		TRACE_FUNC_DUP3,	"dup3",		-1 },
+	{ SYS_fcntl,		TRACE_FUNC_FCNTL,	"fcntl",	-1 },
+	{ -1,			TRACE_FUNC_OTHER,	NULL,		-1 }
+};
+
+/*
+ * The entries of sysents[] by system call number, up to the highest one we
+ * handle. Built on the first lookup.
+ */
+struct sysent **sysent_index = NULL;
+long sysent_index_size = 0;
+
+
+/*
+ * Build sysent_index from sysents[].
+ */
+void
+_sysent_build_index(void)
+{
+	struct sysent *se;
+
+	for (se = sysents; se->func_name != NULL; se++)
+		if (se->nr >= sysent_index_size)
+			sysent_index_size = se->nr + 1;
+
+	sysent_index = xcalloc(sysent_index_size, sizeof(struct sysent *));
+	for (se = sysents; se->func_name != NULL; se++)
+		sysent_index[se->nr] = se;
+}
+
+
+/*
+ * Find the entry for a system call number, NULL if we don't handle it. This
+ * is called on every system call, it's a single array access.
+ */
+struct sysent *
+sysent_get(long nr)
+{
+	if (sysent_index == NULL)
+		_sysent_build_index();
+
+	if (nr < 0 || nr >= sysent_index_size)
+		return NULL;
+
+	return sysent_index[nr];
+}
+
+
+/*
+ * Fill a trace_event from a raw system call, as seen in the registers. The
+ * path is left for the caller to fetch, using the raw arguments and
+ * 'path_arg' of the returned entry (NULL for the functions we don't handle).
+ */
+struct sysent *
+sysent_decode(long nr, unsigned long *args, long result, trace_event *ev)
+{
+	struct sysent *se;
+	int i;
+
+	se = sysent_get(nr);
+
+	ev->nr = nr;
+	ev->path = NULL;
+	ev->result = result;
+	ev->pid = 0;
+	ev->duration = -1;
+	ev->line = NULL;
+	ev->func = TRACE_FUNC_OTHER;
+	ev->func_name = NULL;
+
+	if (se != NULL) {
+		ev->func = se->func;
+		ev->func_name = se->func_name;
+	}
+
+	for (i = 0; i < TRACE_EVENT_MAX_ARGS; i++)
+		ev->args[i] = (long)args[i];
+
+	return se;
+}
@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * Top mode, a live ranking of the relations by I/O (the "pg_scopy" of the
+ * TODO). The tracing thread only feeds the relstat counters, this screen is
+ * drawn by its own thread from a copy of them, a slow terminal never slows
+ * down the traced process.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <curses.h>
+#include <err.h>
+
+#include <postgres.h>
+
+#include "pfd.h"
+#include "trace.h"
+#include "reltab.h"
+#include "relstat.h"
+#include "progress.h"
+#include "top.h"
+#include "strlcpy.h"
+#include "utils.h"
+#include "xmalloc.h"
+
+
+/*
+ * A line of the screen: the copy of a relstat record, what we computed since
+ * the previous refresh and the progress of the reads through the relation.
+ */
+struct top_row {
+	relstat		 rs;
+	double		 rate;
+	int		 percent;
+	double		 eta;
+};
+
+pthread_t top_thread;
+volatile int top_running = 0;
+enum top_sort top_sort = TOP_SORT_READ;
+pid_t top_pid = 0;
+int top_pid_count = 0;
+FILE *top_tty = NULL;
+double top_started = 0;
+
+/* Copy of the counters, in relstat order. */
+relstat *top_records = NULL;
+int top_record_size = 0;
+
+/* Copy of the progress of the forks being read. */
+progress *top_progress = NULL;
+int top_progress_size = 0;
+int top_progress_count = 0;
+
+/* Bytes transferred by each record at the previous refresh. */
+uint64 *top_previous = NULL;
+int top_previous_size = 0;
+
+struct top_row *top_rows = NULL;
+int top_row_size = 0;
+int top_row_count = 0;
+
+
+/*
+ * Sort the rows, largest first.
+ */
+int
+_top_row_cmp(const void *a, const void *b)
+{
+	const struct top_row *ra = a, *rb = b;
+	double va, vb;
+
+	switch (top_sort) {
+	case TOP_SORT_WRITE:
+		va = ra->rs.write_bytes;
+		vb = rb->rs.write_bytes;
+		break;
+	case TOP_SORT_RATE:
+		va = ra->rate;
+		vb = rb->rate;
+		break;
+	default:
+		va = ra->rs.read_bytes;
+		vb = rb->rs.read_bytes;
+		break;
+	}
+
+	if (va > vb)
+		return -1;
+	if (va < vb)
+		return 1;
+
+	return 0;
+}
+
+
+/*
+ * Find the progress of the fork a row is part of, NULL if it wasn't read.
+ */
+progress *
+_top_get_progress(relstat *rs)
+{
+	progress *p;
+	int i;
+
+	for (i = 0; i < top_progress_count; i++) {
+		p = &top_progress[i];
+		if (p->filenode == rs->key.filenode &&
+				p->shared == rs->key.shared &&
+				p->database_oid == rs->key.database_oid &&
+				p->file_type == rs->key.file_type)
+			return p;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Copy the counters and compute the rows, 'elapsed' is the time since the
+ * previous refresh in seconds.
+ */
+void
+_top_update(double elapsed)
+{
+	struct top_row *row;
+	progress *p;
+	uint64 bytes;
+	int i, count, old_size;
+
+	count = relstat_copy(&top_records, &top_record_size);
+	top_progress_count = progress_copy(&top_progress, &top_progress_size);
+
+	if (count > top_previous_size) {
+		old_size = top_previous_size;
+		top_previous_size = top_record_size;
+		top_previous = xrealloc(top_previous, top_previous_size,
+				sizeof(uint64));
+		top_rows = xrealloc(top_rows, top_previous_size,
+				sizeof(struct top_row));
+		memset(top_previous + old_size, 0,
+				(top_previous_size - old_size) *
+				sizeof(uint64));
+	}
+
+	for (i = 0; i < count; i++) {
+		row = &top_rows[i];
+		row->rs = top_records[i];
+
+		bytes = row->rs.read_bytes + row->rs.write_bytes;
+		row->rate = elapsed > 0 ?
+			(bytes - top_previous[i]) / elapsed : 0;
+		top_previous[i] = bytes;
+
+		p = _top_get_progress(&row->rs);
+		row->percent = p != NULL ? progress_get_percent(p) : -1;
+		row->eta = p != NULL ? progress_get_eta(p) : -1;
+	}
+	top_row_count = count;
+
+	qsort(top_rows, top_row_count, sizeof(struct top_row), _top_row_cmp);
+}
+
+
+/*
+ * Format a row, or the header if 'row' is NULL.
+ */
+void
+_top_format_row(struct top_row *row, char *buf, size_t len)
+{
+	char name[MAX_RELNAME_LENGTH + 32], read[32], written[32], rate[32];
+	char percent[16], eta[32];
+
+	if (row == NULL) {
+		snprintf(buf, len, "%-*s %12s %12s %12s %8s %8s",
+				TOP_NAME_WIDTH, "relname", "read", "written",
+				"rate/s", "progress", "eta");
+		return;
+	}
+
+	if (row->percent >= 0)
+		snprintf(percent, sizeof(percent), "%d%%", row->percent);
+	else
+		strlcpy(percent, "-", sizeof(percent));
+
+	if (row->eta >= 0)
+		human_duration(row->eta, eta, sizeof(eta));
+	else
+		strlcpy(eta, "-", sizeof(eta));
+
+	snprintf(buf, len, "%-*.*s %12s %12s %12s %8s %8s", TOP_NAME_WIDTH,
+			TOP_NAME_WIDTH,
+			reltab_get_name(&row->rs.key, row->rs.name, name,
+				sizeof(name)),
+			human_size(row->rs.read_bytes, read, sizeof(read)),
+			human_size(row->rs.write_bytes, written,
+				sizeof(written)),
+			human_size(row->rate, rate, sizeof(rate)), percent,
+			eta);
+}
+
+
+/*
+ * Draw the screen from the current rows.
+ */
+void
+_top_draw(void)
+{
+	char line[256];
+	char *sorts[] = { "read", "written", "rate" };
+	unsigned long lines, dropped;
+	int i;
+
+	erase();
+
+	if (top_pid_count > 1)
+		mvprintw(0, 0, "pg_trace - %d processes", top_pid_count);
+	else if (top_pid != 0)
+		mvprintw(0, 0, "pg_trace - pid %d", (int)top_pid);
+	else
+		mvprintw(0, 0, "pg_trace - stdin");
+	printw(", %d relation files, sorted by %s (r/w/t to sort, q to quit)",
+			top_row_count, sorts[top_sort]);
+
+	trace_get_counters(&lines, &dropped);
+	if (dropped > 0)
+		printw(", %lu lines dropped", dropped);
+
+	_top_format_row(NULL, line, sizeof(line));
+	attron(A_REVERSE);
+	mvprintw(2, 0, "%-*s", COLS, line);
+	attroff(A_REVERSE);
+
+	for (i = 0; i < top_row_count && i + 3 < LINES; i++) {
+		_top_format_row(&top_rows[i], line, sizeof(line));
+		mvprintw(i + 3, 0, "%.*s", COLS, line);
+	}
+
+	refresh();
+}
+
+
+/*
+ * Main loop of the drawing thread, refresh the screen every TOP_INTERVAL
+ * milliseconds or when the sort order changes.
+ */
+void *
+_top_run(void *arg)
+{
+	sigset_t set;
+	double now, last;
+	int c;
+
+	/* Interruptions are for the tracing thread, it stops us. */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	last = get_monotonic_time();
+
+	while (top_running) {
+		now = get_monotonic_time();
+		_top_update(now - last);
+		last = now;
+		_top_draw();
+
+		/* Wait for a key until the next refresh. */
+		while (top_running && (c = getch()) != ERR) {
+			/* Stop like on ^C, the tracing thread takes it (we
+			 * block it) and the atexit() handlers run there. */
+			if (c == 'q') {
+				kill(getpid(), SIGINT);
+				continue;
+			}
+			if (c == 'r')
+				top_sort = TOP_SORT_READ;
+			else if (c == 'w')
+				top_sort = TOP_SORT_WRITE;
+			else if (c == 't')
+				top_sort = TOP_SORT_RATE;
+			else
+				continue;
+
+			qsort(top_rows, top_row_count, sizeof(struct top_row),
+					_top_row_cmp);
+			_top_draw();
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Take over the terminal and start drawing. The terminal is used directly,
+ * stdin can be the output of strace. 'pid' is the first of the 'count'
+ * processes traced, 0 for stdin.
+ */
+void
+top_start(pid_t pid, int count)
+{
+	int ret;
+
+	top_pid = pid;
+	top_pid_count = count;
+
+	top_tty = fopen("/dev/tty", "r+");
+	if (top_tty == NULL)
+		err(1, "top: unable to open the terminal");
+
+	if (newterm(NULL, top_tty, top_tty) == NULL)
+		errx(1, "top: unable to initialize the terminal");
+	cbreak();
+	noecho();
+	curs_set(0);
+	timeout(TOP_INTERVAL);
+
+	top_running = 1;
+	top_started = get_monotonic_time();
+	atexit(top_stop);
+
+	ret = pthread_create(&top_thread, NULL, _top_run, NULL);
+	if (ret != 0) {
+		errno = ret;
+		err(1, "pthread_create");
+	}
+}
+
+
+/*
+ * Stop drawing, give the terminal back and print the final ranking on stdout,
+ * with the average rates. This is called when we exit, possibly from the
+ * drawing thread itself (q).
+ */
+void
+top_stop(void)
+{
+	char line[256];
+	int i;
+
+	if (!top_running)
+		return;
+
+	top_running = 0;
+	if (!pthread_equal(pthread_self(), top_thread))
+		pthread_join(top_thread, NULL);
+
+	endwin();
+	fclose(top_tty);
+
+	if (top_previous != NULL)
+		memset(top_previous, 0, top_previous_size * sizeof(uint64));
+	_top_update(get_monotonic_time() - top_started);
+	_top_format_row(NULL, line, sizeof(line));
+	printf("%s\n", line);
+	for (i = 0; i < top_row_count; i++) {
+		_top_format_row(&top_rows[i], line, sizeof(line));
+		printf("%s\n", line);
+	}
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/* Refresh rate of the top mode, in milliseconds. */
+#define TOP_INTERVAL		1000
+
+/* Width of the relation column. */
+#define TOP_NAME_WIDTH		40
+
+
+/*
+ * Order of the relations on the screen, picked with the r, w and t keys.
+ */
+enum top_sort {
+	TOP_SORT_READ,
+	TOP_SORT_WRITE,
+	TOP_SORT_RATE
+};
+
+
+void		 top_start(pid_t, int);
+void		 top_stop(void);
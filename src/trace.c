@@ -18,14 +18,34 @@
  * This file contains all the pieces used to open, read and crudely parse the
  * stream of function calls coming from a system trace program (strace, dtruss,
  * ktrace, etc.)
+ *
+ * The output is drained by a reader thread into a ring buffer and parsed on
+ * the calling thread, a slow handler (catalog lookups, a busy terminal) then
+ * doesn't stall the tracer until the ring is full, at which point the
+ * overload policy decides what goes.
  */
 
+#include <sys/param.h>
+#include <sys/types.h>
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
 #include <err.h>
 
 #include "trace.h"
+#include "trace_scan.h"
+#include "dispatch.h"
+#include "ring.h"
 #include "utils.h"
 #include "which.h"
 #include "xmalloc.h"
@@ -34,6 +54,57 @@
 char *trace_path = NULL;
 int use_dtruss = 0;
 
+enum trace_policy trace_policy = TRACE_POLICY_BLOCK;
+char *trace_policy_names[] = { "block", "drop", "sample" };
+
+/*
+ * Set on SIGINT or SIGTERM, every event loop returns when it sees it and the
+ * program ends normally (atexit() handlers included).
+ */
+volatile sig_atomic_t trace_interrupted = 0;
+
+/*
+ * Called by the event loops on the tracing thread when they had nothing to
+ * do for a while, see trace_set_idle_handler().
+ */
+void (*trace_idle_handler)(void) = NULL;
+
+/*
+ * Output of a tracer, being read by the reader thread. 'buf' holds the
+ * incomplete line at the end of what was read so far.
+ */
+struct trace_source {
+	int		 fd;
+	pid_t		 pid;
+	char		*buf;
+	size_t		 size;
+	size_t		 used;
+};
+
+/* Ring between the reader thread and the parser, and what it reads from. */
+ring *trace_ring = NULL;
+struct trace_source **trace_sources = NULL;
+int trace_source_count = 0;
+
+/*
+ * Lines parsed (written by the parser) and shed (by the reader), read from
+ * any thread with trace_get_counters().
+ */
+unsigned long trace_parsed = 0;
+unsigned long trace_dropped = 0;
+unsigned long trace_sample_count = 0;
+
+/*
+ * Trace output being parsed and its structural characters, unless they are
+ * searched with memchr() ('scan_enabled' is 0).
+ */
+static char *scan_buf = NULL;
+static trace_marks *scan_marks = NULL;
+static size_t scan_marks_count = 0;
+static int scan_enabled = -1;
+
+extern const char trace_mark_chars[];
+
 
 /* Spawn strace (on Linux) */
 void
@@ -41,6 +112,7 @@ trace_spawn_strace(char *pid)
 {
 	if (execl(trace_path, "strace",
 				"-q",		/* quiet */
+				"-T",		/* time spent in each call */
 				"-s", "8",	/* no need for data */
 				"-p", pid,	/* pid to spy on */
 				(char*)NULL) == -1) {
@@ -105,29 +177,126 @@ trace_open(pid_t pid)
 
 
 /*
- * Marks the first parenthesis as a NUL byte to delimite the func_name and
- * return a pointer to the beginning of the arguments.
+ * Find the structural characters of the 'len' bytes at 'buf', the offsets
+ * given to the functions below are relative to 'buf'. Without a scanner
+ * (trace_scan.c), they are searched when needed.
+ */
+void
+_scan(char *buf, size_t len)
+{
+	size_t count;
+
+	scan_buf = buf;
+
+	if (scan_enabled == -1)
+		scan_enabled = trace_scan_is_enabled();
+	if (!scan_enabled)
+		return;
+
+	count = len / TRACE_SCAN_BLOCK + 1;
+	if (count > scan_marks_count) {
+		scan_marks = xrealloc(scan_marks, count, sizeof(trace_marks));
+		scan_marks_count = count;
+	}
+
+	trace_scan(buf, len, scan_marks);
+}
+
+
+/*
+ * Returns the offset of the first 'mark' found between 'from' and 'end', -1 if
+ * there is none. This is a memchr() on the CPUs where the scan doesn't pay.
+ */
+static inline ssize_t
+_next_mark(enum trace_mark mark, size_t from, size_t end)
+{
+	size_t block, pos;
+	uint64_t bits;
+	char *p;
+
+	if (from >= end)
+		return -1;
+
+	if (!scan_enabled) {
+		p = memchr(scan_buf + from, trace_mark_chars[mark], end - from);
+		return p == NULL ? -1 : p - scan_buf;
+	}
+
+	block = from / TRACE_SCAN_BLOCK;
+	bits = scan_marks[block].bits[mark] &
+		(~(uint64_t)0 << (from % TRACE_SCAN_BLOCK));
+
+	while (bits == 0) {
+		block++;
+		if (block * TRACE_SCAN_BLOCK >= end)
+			return -1;
+		bits = scan_marks[block].bits[mark];
+	}
+
+	pos = block * TRACE_SCAN_BLOCK + __builtin_ctzll(bits);
+	if (pos >= end)
+		return -1;
+
+	return (ssize_t)pos;
+}
+
+
+/*
+ * Remember that the character at 'c' terminates a token, it is replaced by a
+ * NUL byte by _apply_cuts(). There is always room, the parser stops past
+ * MAX_FUNCTION_ARGUMENTS arguments.
+ */
+static inline void
+_cut(trace_line *tl, char *c)
+{
+	tl->cuts[tl->cut_count++].p = c;
+}
+
+
+/*
+ * Terminate the tokens found since the last call, the characters they replace
+ * are kept for trace_line_restore().
+ *
+ * The tokens are found on the structural characters from trace_scan(), so the
+ * NUL bytes are only dropped once the arguments are all found. This keeps the
+ * compiler from reloading everything after each byte written in the line.
+ */
+void
+_apply_cuts(trace_line *tl)
+{
+	int i;
+
+	for (i = tl->cut_applied; i < tl->cut_count; i++) {
+		tl->cuts[i].c = *tl->cuts[i].p;
+		*tl->cuts[i].p = '\0';
+	}
+	tl->cut_applied = tl->cut_count;
+}
+
+
+/*
+ * Marks the first parenthesis after 'start' as a NUL byte to delimite the
+ * func_name and return the offset of the beginning of the arguments.
  */
-char *
-_skip_func_name(char *s)
+static inline size_t
+_skip_func_name(trace_line *tl, size_t start, size_t end)
 {
-	char *c;
+	ssize_t c;
 
-	c = strchr(s, '(');
-	if (c == NULL)
-		errx(1, "process_line(): not a function: %s", s);
+	c = _next_mark(TRACE_MARK_LPAREN, start, end);
+	if (c == -1)
+		errx(1, "process_line(): not a function: %s", tl->raw);
 
-	*c = '\0';
-	c++;
+	_cut(tl, scan_buf + c);
 
-	return c;
+	return c + 1;
 }
 
 
 /*
  * Returns 1 if the number of backslashes before the double-quote is odd.
  */
-int
+static inline int
 _is_escaped(char *s)
 {
 	int count = 0;
@@ -145,33 +314,78 @@ _is_escaped(char *s)
 
 
 /*
- * Find the next comma or parenthesis, sets it as NUL byte to delimit the
- * possible previous argument.
+ * Return the offset of the bracket closing the array starting at 'start', -1
+ * if it isn't on the line. Arrays can be nested (the iovecs of preadv) and
+ * their strings can hold anything, those are skipped on the quote marks.
+ */
+static ssize_t
+_find_array_end(size_t start, size_t lineend)
+{
+	char *buf = scan_buf;
+	ssize_t quote;
+	size_t i;
+	int depth = 0;
+
+	for (i = start; i < lineend; i++) {
+		switch (buf[i]) {
+		case '[':
+			depth++;
+			break;
+		case ']':
+			if (--depth == 0)
+				return (ssize_t)i;
+			break;
+		case '"':
+			quote = i;
+			do {
+				quote = _next_mark(TRACE_MARK_QUOTE, quote + 1,
+						lineend);
+			} while (quote != -1 && _is_escaped(buf + quote));
+			if (quote == -1)
+				return -1;
+			i = quote;
+			break;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * Find the next comma or parenthesis after the offset at *startp, sets it as
+ * NUL byte to delimit the possible previous argument. '*done' is set on the
+ * parenthesis closing the list, what follows it (the return value, the error
+ * message in parentheses, the duration) is not an argument.
  *
- * If the first character of *s is a double quote or '{' try to find the
- * matching character.
+ * If the argument starts with a double quote or '{' try to find the matching
+ * character. Arrays are kept whole, brackets included.
  *
  * FIXME: this can be more robust (escape characters?) and we don't do a good
  * job on cropped data (keep stuff at the end...)
  */
-char *
-_extract_argument(char **startp)
+static inline char *
+_extract_argument(trace_line *tl, size_t *startp, size_t lineend, int *done)
 {
-	char *start = *startp;
-	char *end, *valueend;
+	char *buf = scan_buf, *arg;
+	size_t start = *startp, valueend;
+	ssize_t end, rparen;
 
 	/* Strip spaces. */
-	while (*start == ' ')
+	while (start < lineend && buf[start] == ' ')
 		start++;
 
 	/* This is a quoted argument, find the final double-quote. */
-	if (*start == '"') {
+	if (start < lineend && buf[start] == '"') {
 		start++;
 		end = start;
 		for (;;) {
-			end = strchr(end, '"');
-			if (!_is_escaped(end)) {
-				*end = '\0';
+			end = _next_mark(TRACE_MARK_QUOTE, end, lineend);
+			if (end == -1)
+				errx(1, "process_line(): unterminated string: "
+						"%s", tl->raw);
+			if (!_is_escaped(buf + end)) {
+				_cut(tl, buf + end);
 				break;
 			}
 
@@ -179,89 +393,135 @@ _extract_argument(char **startp)
 		}
 
 		/* dtruss leaves escaped-asciid nul bytes, we don't. */
-		if (use_dtruss && strncmp(end - 2, "\\0", 2) == 0) {
-			*(end - 2) = '\0';
+		if (use_dtruss && strncmp(buf + end - 2, "\\0", 2) == 0) {
+			_cut(tl, buf + end - 2);
 		}
 
 		valueend = end + 1;
-	} else if (*start == '{') {
+	} else if (start < lineend && buf[start] == '{') {
 		start++;
-		end = strchr(start, '}');
-		*end = '\0';
+		end = _next_mark(TRACE_MARK_RBRACE, start, lineend);
+		if (end == -1)
+			errx(1, "process_line(): unterminated structure: %s",
+					tl->raw);
+		_cut(tl, buf + end);
+		valueend = end + 1;
+	} else if (start < lineend && buf[start] == '[') {
+		end = _find_array_end(start, lineend);
+		if (end == -1)
+			errx(1, "process_line(): unterminated array: %s",
+					tl->raw);
 		valueend = end + 1;
 	} else {
 		valueend = start;
 	}
 
-	/* More arguments. */
-	end = strchr(valueend, ',');
-	if (end == NULL)
-		end = strchr(valueend, ')');
-	if (end == NULL)
+	/* More arguments, unless the list is closed before the next comma. */
+	end = _next_mark(TRACE_MARK_COMMA, valueend, lineend);
+	rparen = _next_mark(TRACE_MARK_RPAREN, valueend,
+			end == -1 ? lineend : (size_t)end);
+	if (rparen != -1) {
+		end = rparen;
+		*done = 1;
+	}
+	if (end == -1)
 		return NULL;
 
 	/* No arguments left, return NULL. */
-	if (end == start)
-		start = NULL;
+	arg = buf + start;
+	if ((size_t)end == start)
+		arg = NULL;
 
 	/* At this point 'end' should point to a comma or parenthesis. */
-	*end = '\0';
+	_cut(tl, buf + end);
 	*startp = end + 1;
 
-	return start;
+	return arg;
 }
 
 
 /*
- * Parses out the function name and its argument, calling the provided function
- * with the broken down line elements.
+ * Parses out the function name and its arguments from the line between the
+ * offsets 'start' and 'end' of the scanned output. The line is tokenized in
+ * place: no copy, no allocation. The byte at 'end' must be writable if the
+ * line doesn't end with a new-line.
  *
- * Since this function drops NUL bytes everywhere, you shouldn't use line after
- * calling this function.
+ * Since this function drops NUL bytes everywhere, the original line is only
+ * available again after trace_line_restore().
  */
 void
-trace_process_line(char *line,
-		void (*func_handler)(char *, char *, int, char **, char*))
+_parse_line(trace_line *tl, size_t start, size_t end)
 {
-	char *func_name;
-	char *result = NULL;
-	char *argv[MAX_FUNCTION_ARGUMENTS] = { 0 };
-	char *c, *a;
-	char *org_line;
-	int argc = 0;
+	char *buf = scan_buf, *a;
+	size_t c, namelen;
+	ssize_t mark;
+	int done = 0;
 
-	org_line = xstrdup(line);
+	tl->raw = buf + start;
+	tl->len = end - start;
+	tl->argc = 0;
+	tl->result = NULL;
+	tl->duration = NULL;
+	tl->cut_count = 0;
+	tl->cut_applied = 0;
 
-	func_name = line;
+	if (end > start && buf[end - 1] == '\n') {
+		end--;
+		_cut(tl, buf + end);
+		_apply_cuts(tl);
+	} else {
+		buf[end] = '\0';
+	}
+
+	/* The line ends at the first NUL byte, like a string. */
+	mark = _next_mark(TRACE_MARK_NUL, start, end);
+	if (mark != -1)
+		end = mark;
+
+	tl->func_name = buf + start;
 
-	c = _skip_func_name(line);
+	c = _skip_func_name(tl, start, end);
+	namelen = c - 1 - start;
 
 	/* Extract all the arguments. */
-	while ((a = _extract_argument(&c)) != NULL) {
-		argv[argc] = a;
-		argc++;
+	while (!done && (a = _extract_argument(tl, &c, end, &done)) != NULL) {
+		if (tl->argc == MAX_FUNCTION_ARGUMENTS)
+			errx(1, "process_line(): too many arguments: %s",
+					tl->raw);
+		tl->argv[tl->argc] = a;
+		tl->argc++;
 	}
+	_apply_cuts(tl);
 
 	/* Extract a return value if any. */
-	a = strchr(c, '=');
-	if (a != NULL) {
+	mark = _next_mark(TRACE_MARK_EQUAL, c, end);
+	if (mark != -1) {
+		a = buf + mark;
+
 		/* Skip the spaces. */
 		while (*a == ' ' || *a == '=')
 			a++;
 
-		result = a;
+		tl->result = a;
 
 		/*
 		 * Our friends at Apple have two return values. I have no idea
 		 * what the other value is, TODO: figure it out.
 		 */
 		if (use_dtruss && (a = strchr(a, ' ')) != NULL)
-			*a = '\0';
+			_cut(tl, a);
 
-		/* Wipe the new-line. */
-		a = strchr(result, '\n');
-		if (a != NULL)
-			*a = '\0';
+		/* strace -T ends the line with the time spent, <0.000123>. */
+		if (buf[end - 1] == '>') {
+			for (a = buf + end - 2; a > tl->result && *a != '<'; a--)
+				;
+			if (*a == '<') {
+				tl->duration = a + 1;
+				_cut(tl, a > tl->result && *(a - 1) == ' ' ?
+						a - 1 : a);
+				_cut(tl, buf + end - 1);
+			}
+		}
 	}
 
 	/*
@@ -269,37 +529,614 @@ trace_process_line(char *line,
 	 * and name their wrappers with a _nocancel suffix, for the purpose of
 	 * pg_trace, we will ignore them and assume we always have a matching
 	 * system function without _nocancel.
+	 *
+	 * Most names are too short to hold the suffix, don't bother looking.
 	 */
-	if ((c = strstr(func_name, "_nocancel")) != NULL)
-		*c = '\0';
+	if (namelen >= sizeof("_nocancel") - 1 &&
+			(a = strstr(tl->func_name, "_nocancel")) != NULL)
+		_cut(tl, a);
+
+	_apply_cuts(tl);
+}
 
-	func_handler(org_line, func_name, argc, argv, result);
 
-	xfree(org_line);
+/*
+ * Parse a single line of 'len' bytes, see _parse_line().
+ */
+void
+trace_parse_line(trace_line *tl, char *line, size_t len)
+{
+	_scan(line, len);
+	_parse_line(tl, 0, len);
 }
 
 
 /*
- * Read through the file descriptor, passing each parsed line to
- * trace_process_line.
+ * Put back the bytes overwritten by trace_parse_line(), the tokens of the line
+ * are no longer usable after this.
  */
 void
-trace_read_lines(int fd,
-		void (*func_handler)(char *, char *, int, char **, char*))
+trace_line_restore(trace_line *tl)
+{
+	while (tl->cut_applied > 0) {
+		tl->cut_applied--;
+		*tl->cuts[tl->cut_applied].p = tl->cuts[tl->cut_applied].c;
+	}
+	tl->cut_count = 0;
+}
+
+
+/*
+ * Returns 1 if the line is a call changing the descriptors, they are kept by
+ * all the policies, without them the descriptors would point to the wrong
+ * files until the end. The exit of the process is kept for the same reason.
+ */
+int
+_trace_is_essential(char *line, size_t len)
 {
-	FILE *fp;
-	char line[MAX_LINE_LENGTH];
+	char name[32], *p;
+	size_t i;
+
+	if (len >= 3 && memcmp(line, "+++", 3) == 0)
+		return 1;
 
-	fp = fdopen(fd, "r");
-	if (fp == NULL)
-		err(1, "trace_read_lines:fdopen()");
+	for (i = 0; i < len && i < sizeof(name) - 1 && line[i] != '('; i++)
+		name[i] = line[i];
+	if (i == len || line[i] != '(')
+		return 0;
+	name[i] = '\0';
 
-	while (fgets(line, sizeof(line), fp)) {
-		trace_process_line(line, func_handler);
+	if ((p = strstr(name, "_nocancel")) != NULL)
+		*p = '\0';
+
+	switch (dispatch_lookup(name)) {
+	case TRACE_FUNC_OPEN:
+	case TRACE_FUNC_OPENAT:
+	case TRACE_FUNC_CLOSE:
+	case TRACE_FUNC_DUP:
+	case TRACE_FUNC_DUP2:
+	case TRACE_FUNC_DUP3:
+	case TRACE_FUNC_FCNTL:
+		return 1;
+	default:
+		return 0;
 	}
 }
 
 
+/*
+ * Shed the lines of 'buf' we can live without, the lines kept are moved to
+ * its beginning. With 'keep_sampled', one line out of TRACE_SAMPLE_RATE is
+ * kept anyway.
+ *
+ * Returns the number of bytes kept.
+ */
+size_t
+_trace_shed(char *buf, size_t len, int keep_sampled)
+{
+	size_t start, end, kept = 0;
+	unsigned long dropped = 0;
+	char *nl;
+
+	for (start = 0; start < len; start = end) {
+		nl = memchr(buf + start, '\n', len - start);
+		end = nl - buf + 1;
+
+		if (_trace_is_essential(buf + start, end - start) ||
+				(keep_sampled && trace_sample_count++ %
+				 TRACE_SAMPLE_RATE == 0)) {
+			if (kept != start)
+				memmove(buf + kept, buf + start, end - start);
+			kept += end - start;
+		} else {
+			dropped++;
+		}
+	}
+
+	__atomic_store_n(&trace_dropped, trace_dropped + dropped,
+			__ATOMIC_RELAXED);
+
+	return kept;
+}
+
+
+/*
+ * Reserve room in the ring for a record of 'len' bytes of lines, prefixed by
+ * the pid they come from.
+ */
+static inline char *
+_trace_reserve(size_t len, int wait)
+{
+	return ring_reserve(trace_ring, sizeof(pid_t) + len, wait);
+}
+
+
+static inline void
+_trace_commit(char *p, pid_t pid, char *buf, size_t len)
+{
+	memcpy(p, &pid, sizeof(pid_t));
+	if (len > 0)
+		memcpy(p + sizeof(pid_t), buf, len);
+	ring_commit(trace_ring, sizeof(pid_t) + len);
+}
+
+
+/*
+ * Pass 'len' bytes of complete lines of a process to the parser, at most
+ * TRACE_RECORD_MAX. Past the high mark of the ring, the lines are shed
+ * according to the policy. The lines sampled are only kept if there is room,
+ * we only ever wait for the essential ones.
+ */
+void
+_trace_push_lines(pid_t pid, char *buf, size_t len)
+{
+	char *p;
+
+	if (trace_policy == TRACE_POLICY_BLOCK) {
+		p = _trace_reserve(len, 1);
+	} else if (ring_get_used(trace_ring) + len > TRACE_RING_HIGH ||
+			(p = _trace_reserve(len, 0)) == NULL) {
+		len = _trace_shed(buf, len,
+				trace_policy == TRACE_POLICY_SAMPLE);
+		if (len == 0)
+			return;
+
+		p = _trace_reserve(len, 0);
+		if (p == NULL) {
+			len = _trace_shed(buf, len, 0);
+			if (len == 0)
+				return;
+			p = _trace_reserve(len, 1);
+		}
+	}
+
+	_trace_commit(p, pid, buf, len);
+}
+
+
+/*
+ * Pass a single line longer than TRACE_RECORD_MAX to the parser, in pieces.
+ * Only the last one ends with the new-line, that's how the parser tells them
+ * apart from complete lines. Nothing else is pushed in between, the pieces
+ * follow each other in the ring.
+ *
+ * Past the high mark of the ring, the line is dropped by the policies that
+ * shed, unless it is essential.
+ */
+void
+_trace_push_long_line(pid_t pid, char *buf, size_t len)
+{
+	size_t piece;
+
+	if (trace_policy != TRACE_POLICY_BLOCK &&
+			ring_get_used(trace_ring) + len > TRACE_RING_HIGH &&
+			!_trace_is_essential(buf, len)) {
+		__atomic_store_n(&trace_dropped, trace_dropped + 1,
+				__ATOMIC_RELAXED);
+		return;
+	}
+
+	for (; len > 0; buf += piece, len -= piece) {
+		piece = MIN(len, TRACE_RECORD_MAX);
+		_trace_commit(_trace_reserve(piece, 1), pid, buf, piece);
+	}
+}
+
+
+/*
+ * Pass 'len' bytes of complete lines of a process to the parser, cut on the
+ * lines into records of at most TRACE_RECORD_MAX bytes.
+ */
+void
+_trace_push(pid_t pid, char *buf, size_t len)
+{
+	size_t chunk, end;
+	char *nl;
+
+	while (len > 0) {
+		chunk = MIN(len, TRACE_RECORD_MAX);
+
+		/* The last line of the chunk is cut, end on the one before,
+		 * if there is none the line is too long for a record. */
+		if (chunk < len) {
+			for (end = chunk; end > 0 && buf[end - 1] != '\n';
+					end--)
+				;
+			if (end == 0) {
+				nl = memchr(buf + chunk, '\n', len - chunk);
+				chunk = nl - buf + 1;
+				_trace_push_long_line(pid, buf, chunk);
+				buf += chunk;
+				len -= chunk;
+				continue;
+			}
+			chunk = end;
+		}
+
+		_trace_push_lines(pid, buf, chunk);
+		buf += chunk;
+		len -= chunk;
+	}
+}
+
+
+/*
+ * Read what's available from a source and push its complete lines, the
+ * incomplete line at the end of its buffer is moved before the next read. The
+ * buffer grows if a single line doesn't fit.
+ *
+ * At the end of the output, the source is closed and an empty record tells
+ * the parser the process is gone. Returns 0 then, 1 otherwise.
+ */
+int
+_trace_read_source(struct trace_source *src)
+{
+	size_t end;
+	ssize_t count;
+
+	if (src->used == src->size) {
+		src->size *= 2;
+		src->buf = xrealloc(src->buf, 1, src->size + 1);
+	}
+
+	count = read(src->fd, src->buf + src->used, src->size - src->used);
+	if (count == -1) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 1;
+		err(1, "trace_read_lines:read()");
+	}
+
+	if (count == 0) {
+		if (src->used > 0) {
+			src->buf[src->used++] = '\n';
+			_trace_push(src->pid, src->buf, src->used);
+		}
+		_trace_commit(_trace_reserve(0, 1), src->pid, NULL, 0);
+		close(src->fd);
+		src->fd = -1;
+		return 0;
+	}
+
+	src->used += count;
+
+	/* The previous bytes hold no new-line, they were pushed. */
+	for (end = src->used; end > src->used - count; end--)
+		if (src->buf[end - 1] == '\n')
+			break;
+	if (end == src->used - count)
+		return 1;
+
+	_trace_push(src->pid, src->buf, end);
+
+	src->used -= end;
+	if (src->used > 0)
+		memmove(src->buf, src->buf + end, src->used);
+
+	return 1;
+}
+
+
+#ifdef HAVE_EPOLL
+/*
+ * Read all the sources as their output comes, until they are all closed.
+ */
+void
+_trace_poll_sources(void)
+{
+	struct epoll_event ev, events[TRACE_EPOLL_EVENTS];
+	int epfd, i, n, open;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1)
+		err(1, "trace_read_lines:epoll_create1()");
+
+	for (i = 0; i < trace_source_count; i++) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = trace_sources[i];
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, trace_sources[i]->fd,
+					&ev) == -1)
+			err(1, "trace_read_lines:epoll_ctl()");
+	}
+
+	for (open = trace_source_count; open > 0 && !trace_interrupted;) {
+		n = epoll_wait(epfd, events, TRACE_EPOLL_EVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "trace_read_lines:epoll_wait()");
+		}
+
+		/* A closed descriptor leaves the epoll set by itself. */
+		for (i = 0; i < n; i++)
+			if (_trace_read_source(events[i].data.ptr) == 0)
+				open--;
+	}
+
+	close(epfd);
+}
+#endif
+
+
+/*
+ * Reader thread, drain the tracer outputs into the ring as fast as they come.
+ * A single source is simply read until its end, it can then be a regular file
+ * (a trace on stdin), which epoll doesn't take.
+ *
+ * The interruptions are for this thread, its read is what they need to break
+ * (the parser is waiting on the ring), it then closes the ring.
+ */
+void *
+_trace_reader(void *arg)
+{
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+	if (trace_source_count == 1) {
+		while (!trace_interrupted &&
+				_trace_read_source(trace_sources[0]) != 0)
+			;
+	} else {
+#ifdef HAVE_EPOLL
+		_trace_poll_sources();
+#endif
+	}
+
+	ring_close(trace_ring);
+
+	return NULL;
+}
+
+
+/*
+ * Tell how many lines were shed, if any.
+ */
+void
+_trace_report(void)
+{
+	unsigned long lines, dropped;
+
+	trace_get_counters(&lines, &dropped);
+	if (dropped > 0)
+		warnx("%lu out of %lu lines dropped (%s policy)", dropped,
+				lines, trace_policy_names[trace_policy]);
+}
+
+
+/*
+ * Add the output of a tracer to read with trace_read_lines(), 'pid' is the
+ * process it traces.
+ */
+void
+trace_add_source(int fd, pid_t pid)
+{
+	struct trace_source *src;
+
+#ifdef F_SETPIPE_SZ
+	/* More room for the tracer while the reader thread is scheduled. */
+	if (fcntl(fd, F_SETPIPE_SZ, TRACE_PIPE_SIZE) == -1)
+		debug("trace: unable to resize the pipe: %s\n",
+				strerror(errno));
+#endif
+
+	src = xmalloc(sizeof(struct trace_source));
+	src->fd = fd;
+	src->pid = pid;
+	src->size = TRACE_BUFFER_SIZE;
+	src->used = 0;
+
+	/* One spare byte to terminate a last line without new-line. */
+	src->buf = xmalloc(src->size + 1);
+
+	trace_sources = xrealloc(trace_sources, trace_source_count + 1,
+			sizeof(struct trace_source *));
+	trace_sources[trace_source_count++] = src;
+}
+
+
+/*
+ * Handle the lines of strace which are not calls: the signals received
+ * (--- SIGUSR1 {...} ---) are skipped, the exit of the process (+++ exited
+ * with 0 +++) goes to the exit handler right away.
+ *
+ * Returns 1 if the line was one of those.
+ */
+static inline int
+_trace_notice(pid_t pid, char *line, size_t len,
+		void (*exit_handler)(pid_t))
+{
+	if (len < 3)
+		return 0;
+
+	if (memcmp(line, "---", 3) == 0)
+		return 1;
+
+	if (memcmp(line, "+++", 3) == 0) {
+		if (exit_handler != NULL)
+			exit_handler(pid);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Read through the sources, passing each parsed line to the handler with the
+ * pid it comes from, and the pid of each process whose tracer is done to the
+ * exit handler (if not NULL), when strace tells us it exited or at the end
+ * of its output. The sources are closed and forgotten when this returns.
+ *
+ * A reader thread fills the ring with complete lines (see _trace_reader()),
+ * each record is scanned once for all its structural characters
+ * (trace_scan.c) and the lines are parsed straight from the ring. The lines
+ * longer than TRACE_RECORD_MAX come in pieces, they are put back together in
+ * a buffer of their own before being parsed.
+ */
+void
+trace_read_lines(void (*func_handler)(pid_t, trace_line *),
+		void (*exit_handler)(pid_t))
+{
+	trace_line tl;
+	pthread_t reader;
+	sigset_t set, oset;
+	pid_t pid;
+	char *rec, *long_buf = NULL;
+	size_t len, start, long_len = 0, long_size = 0;
+	ssize_t nl;
+	int i, ret;
+
+	if (trace_source_count == 0)
+		return;
+
+#ifndef HAVE_EPOLL
+	if (trace_source_count > 1)
+		errx(1, "tracing several processes requires epoll");
+#endif
+
+	trace_ring = ring_new(TRACE_RING_SIZE);
+
+	if (trace_policy != TRACE_POLICY_BLOCK)
+		atexit(_trace_report);
+
+	/* Blocked here, taken by the reader (which unblocks them). */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+
+	ret = pthread_create(&reader, NULL, _trace_reader, NULL);
+	if (ret != 0) {
+		errno = ret;
+		err(1, "pthread_create");
+	}
+
+	for (;;) {
+		if (!ring_wait(trace_ring, TRACE_IDLE_TIMEOUT)) {
+			trace_idle();
+			continue;
+		}
+
+		if ((rec = ring_peek(trace_ring, &len)) == NULL)
+			break;
+
+		memcpy(&pid, rec, sizeof(pid_t));
+
+		if (len == sizeof(pid_t)) {
+			if (exit_handler != NULL)
+				exit_handler(pid);
+			ring_release(trace_ring, len);
+			continue;
+		}
+
+		/* A piece of a long line, or its last one. */
+		if (rec[len - 1] != '\n' || long_len > 0) {
+			if (long_len + len > long_size) {
+				long_size = long_len + len;
+				long_buf = xrealloc(long_buf, long_size, 1);
+			}
+			memcpy(long_buf + long_len, rec + sizeof(pid_t),
+					len - sizeof(pid_t));
+			long_len += len - sizeof(pid_t);
+			if (rec[len - 1] != '\n') {
+				ring_release(trace_ring, len);
+				continue;
+			}
+			ring_release(trace_ring, len);
+
+			if (!_trace_notice(pid, long_buf, long_len,
+						exit_handler)) {
+				_scan(long_buf, long_len);
+				_parse_line(&tl, 0, long_len);
+				func_handler(pid, &tl);
+			}
+			long_len = 0;
+			__atomic_store_n(&trace_parsed, trace_parsed + 1,
+					__ATOMIC_RELAXED);
+			continue;
+		}
+
+		_scan(rec + sizeof(pid_t), len - sizeof(pid_t));
+
+		start = 0;
+		while ((nl = _next_mark(TRACE_MARK_NEWLINE, start,
+						len - sizeof(pid_t))) != -1) {
+			if (!_trace_notice(pid, rec + sizeof(pid_t) + start,
+						nl + 1 - start, exit_handler)) {
+				_parse_line(&tl, start, nl + 1);
+				func_handler(pid, &tl);
+			}
+			start = nl + 1;
+			__atomic_store_n(&trace_parsed, trace_parsed + 1,
+					__ATOMIC_RELAXED);
+		}
+
+		ring_release(trace_ring, len);
+	}
+
+	pthread_join(reader, NULL);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	ring_free(trace_ring);
+	if (long_buf != NULL)
+		xfree(long_buf);
+	trace_ring = NULL;
+
+	/* Those still open if we were interrupted. */
+	for (i = 0; i < trace_source_count; i++) {
+		if (trace_sources[i]->fd != -1)
+			close(trace_sources[i]->fd);
+		xfree(trace_sources[i]->buf);
+		xfree(trace_sources[i]);
+	}
+	xfree(trace_sources);
+	trace_sources = NULL;
+	trace_source_count = 0;
+}
+
+
+/*
+ * Number of lines read from the tracer so far and how many of those were
+ * shed by the overload policy, safe to call from any thread.
+ */
+void
+trace_get_counters(unsigned long *lines, unsigned long *dropped)
+{
+	*dropped = __atomic_load_n(&trace_dropped, __ATOMIC_RELAXED);
+	*lines = __atomic_load_n(&trace_parsed, __ATOMIC_RELAXED) + *dropped;
+}
+
+
+/*
+ * Set a function called on the tracing thread when its event loop is idle,
+ * at least every TRACE_IDLE_TIMEOUT milliseconds without events, and when a
+ * signal interrupts its wait.
+ */
+void
+trace_set_idle_handler(void (*handler)(void))
+{
+	trace_idle_handler = handler;
+}
+
+
+/*
+ * Call the idle handler, if any.
+ */
+void
+trace_idle(void)
+{
+	if (trace_idle_handler != NULL)
+		trace_idle_handler();
+}
+
+
 /*
  * Resolve the trace path, throwing an error if it is not found.
  */
@@ -21,7 +21,146 @@
  */
 #define MAX_FUNCTION_ARGUMENTS	32
 
+/*
+ * Number of raw arguments a native tracer can decode from the registers.
+ */
+#define TRACE_EVENT_MAX_ARGS	6
+
+/*
+ * Initial size of the buffer the trace output is read into, it is grown when a
+ * single line doesn't fit. Small enough for the buffer and its trace_marks to
+ * still be in the CPU cache when the lines are parsed after the scan.
+ */
+#define TRACE_BUFFER_SIZE	(64 * 1024)
+
+/*
+ * Size of the ring between the thread reading the tracer and the one parsing
+ * its output, and of the pipe itself when it can be resized. Past the high
+ * mark, the lines are shed according to the overload policy.
+ */
+#define TRACE_RING_SIZE		(4 * 1024 * 1024)
+#define TRACE_RING_HIGH		(TRACE_RING_SIZE / 4 * 3)
+#define TRACE_PIPE_SIZE		(1024 * 1024)
+
+/*
+ * Maximum number of bytes of lines in a record of the ring, well under the
+ * half of the ring a record can take. The lines longer than this are split
+ * over several records.
+ */
+#define TRACE_RECORD_MAX	(TRACE_RING_SIZE / 8)
+
+/* One I/O line out of this many is kept by the sample policy. */
+#define TRACE_SAMPLE_RATE	16
+
+/* Longest wait of an event loop before calling the idle handler, in ms. */
+#define TRACE_IDLE_TIMEOUT	250
+
+/* Maximum number of ready tracers handled per epoll_wait(). */
+#define TRACE_EPOLL_EVENTS	16
+
+/*
+ * Number of bytes of a line the parser can overwrite to delimit its tokens:
+ * up to three per argument (including the one found past the maximum), plus
+ * the function name, the return value, the duration (two), the _nocancel
+ * suffix and the new-line.
+ */
+#define TRACE_LINE_MAX_CUTS	((MAX_FUNCTION_ARGUMENTS + 1) * 3 + 6)
+
+
+/*
+ * Functions with a dedicated handler. Everything else is TRACE_FUNC_OTHER and
+ * is only ever printed. See dispatch.c for the name of each.
+ */
+enum trace_func {
+	TRACE_FUNC_READ,
+	TRACE_FUNC_WRITE,
+	TRACE_FUNC_OPEN,
+	TRACE_FUNC_CLOSE,
+	TRACE_FUNC_LSEEK,
+	TRACE_FUNC_OPENAT,
+	TRACE_FUNC_PREAD,
+	TRACE_FUNC_PWRITE,
+	TRACE_FUNC_PREADV,
+	TRACE_FUNC_PWRITEV,
+	TRACE_FUNC_FSYNC,
+	TRACE_FUNC_FDATASYNC,
+	TRACE_FUNC_FTRUNCATE,
+	TRACE_FUNC_DUP,
+	TRACE_FUNC_DUP2,
+	TRACE_FUNC_DUP3,
+	TRACE_FUNC_FCNTL,
+	TRACE_FUNC_OTHER,
+	TRACE_FUNC_COUNT
+};
+
+
+/*
+ * What to do with the tracer output when we can't keep up with it. Blocking
+ * eventually blocks the tracer and the traced process. The other policies
+ * shed the I/O lines, all of them (drop) or all but one out of
+ * TRACE_SAMPLE_RATE (sample), the lines changing the descriptors are always
+ * kept.
+ */
+enum trace_policy {
+	TRACE_POLICY_BLOCK,
+	TRACE_POLICY_DROP,
+	TRACE_POLICY_SAMPLE
+};
+
+
+/*
+ * A line of trace output, parsed in place. The tokens point inside 'raw', the
+ * bytes overwritten to terminate them are kept in 'cuts' so that the original
+ * line can be put back with trace_line_restore(). 'duration' is the time
+ * spent in the call in seconds, as printed by strace -T, NULL without it.
+ */
+typedef struct _trace_line {
+	char		*raw;
+	size_t		 len;
+	char		*func_name;
+	int		 argc;
+	char		*argv[MAX_FUNCTION_ARGUMENTS];
+	char		*result;
+	char		*duration;
+	int		 cut_count;
+	int		 cut_applied;
+	struct {
+		char	*p;
+		char	 c;
+	}		 cuts[TRACE_LINE_MAX_CUTS];
+} trace_line;
+
+
+/*
+ * Typed representation of a system call, as produced by the native tracers
+ * (ptrace) or decoded from a line of strace. The arguments are kept in their
+ * raw register form, 'path' holds the string argument of the functions taking
+ * one (open) and 'nr' is the system call number, only used to print the
+ * unknown functions. 'line' is the strace line the event comes from, NULL
+ * with a native tracer. 'duration' is the time spent in the system call in
+ * nanoseconds, -1 if unknown. 'pid' is the process that made the call, 0 for
+ * a trace read on stdin.
+ */
+typedef struct _trace_event {
+	pid_t		 pid;
+	enum trace_func	 func;
+	char		*func_name;
+	long		 nr;
+	long		 args[TRACE_EVENT_MAX_ARGS];
+	char		*path;
+	long		 result;
+	long		 duration;
+	trace_line	*line;
+} trace_event;
+
 
 int		 trace_open(pid_t);
-void		 trace_read_lines(int, void (*func)(char *, char *, int, char **, char*));
+void		 trace_parse_line(trace_line *, char *, size_t);
+void		 trace_line_restore(trace_line *);
+void		 trace_add_source(int, pid_t);
+void		 trace_read_lines(void (*func)(pid_t, trace_line *),
+		    void (*exit)(pid_t));
+void		 trace_get_counters(unsigned long *, unsigned long *);
 void		 trace_resolve_path(void);
+void		 trace_set_idle_handler(void (*)(void));
+void		 trace_idle(void);
@@ -0,0 +1,341 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Throughput of the strace output ingestion. Parse a recorded strace log
+ * without doing anything with the lines and print the number of lines per
+ * second. With -l, the lines are read and parsed the way pg_trace used to:
+ * fgets() into a MAX_LINE_LENGTH buffer, a copy of each line and strchr()
+ * from one token to the next. With -k, the given tokenizer (avx2 or memchr)
+ * is used instead of the best one available.
+ *
+ * With -c, a checksum of the tokens is printed along, it has to be the same
+ * whatever the tokenizer. With -d, the tokens of each line are printed
+ * instead, one line each: the function, the number of arguments, the
+ * arguments, the result ("(none)" without one) and the duration if any,
+ * separated by tabs.
+ *
+ * 	make bench && ./trace_bench recorded.strace
+ *
+ * 'make check' compares the tokens of the tokenizers with the ones of the
+ * old parser on corpus/strace.log, recorded with:
+ *
+ * 	./trace_bench -l -d corpus/strace.log > corpus/strace.tokens
+ *
+ * The lines the old parser got wrong on purpose (arrays, results with a
+ * parenthesis, durations) are in corpus/strace-changed.log, their tokens were
+ * checked by hand.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <err.h>
+
+#include "trace.h"
+#include "trace_scan.h"
+#include "utils.h"
+#include "xmalloc.h"
+
+
+#define _DEBUG_FLAG
+int debug_flag = 0;
+
+long line_count = 0;
+long byte_count = 0;
+int use_checksum = 0;
+int use_dump = 0;
+uint32_t checksum = 2166136261u;
+
+extern int use_dtruss;
+
+
+/*
+ * FNV-1a of a token and its terminating NUL byte.
+ */
+void
+hash_token(char *s)
+{
+	if (s == NULL)
+		s = "";
+
+	do {
+		checksum = (checksum ^ (unsigned char)*s) * 16777619;
+	} while (*s++ != '\0');
+}
+
+
+void
+count_line(pid_t pid, trace_line *tl)
+{
+	int i;
+
+	line_count++;
+	byte_count += tl->len;
+
+	if (use_dump) {
+		printf("%s\t%d", tl->func_name, tl->argc);
+		for (i = 0; i < tl->argc; i++)
+			printf("\t%s", tl->argv[i]);
+		printf("\t%s", tl->result != NULL ? tl->result : "(none)");
+		if (tl->duration != NULL)
+			printf("\t<%s>", tl->duration);
+		printf("\n");
+	}
+
+	if (!use_checksum)
+		return;
+
+	hash_token(tl->func_name);
+	for (i = 0; i < tl->argc; i++)
+		hash_token(tl->argv[i]);
+	hash_token(tl->result);
+}
+
+
+/*
+ * The original parser, kept as it was as the reference of the tokenizers.
+ */
+char *
+legacy_skip_func_name(char *s)
+{
+	char *c;
+
+	c = strchr(s, '(');
+	if (c == NULL)
+		errx(1, "process_line(): not a function: %s", s);
+
+	*c = '\0';
+	c++;
+
+	return c;
+}
+
+
+int
+legacy_is_escaped(char *s)
+{
+	int count = 0;
+
+	while (*(s - 1) == '\\') {
+		count++;
+		s--;
+	}
+
+	if ((count & 1) == 1)
+		return 1;
+
+	return 0;
+}
+
+
+char *
+legacy_extract_argument(char **startp)
+{
+	char *start = *startp;
+	char *end, *valueend;
+
+	/* Strip spaces. */
+	while (*start == ' ')
+		start++;
+
+	/* This is a quoted argument, find the final double-quote. */
+	if (*start == '"') {
+		start++;
+		end = start;
+		for (;;) {
+			end = strchr(end, '"');
+			if (!legacy_is_escaped(end)) {
+				*end = '\0';
+				break;
+			}
+
+			end++;
+		}
+
+		/* dtruss leaves escaped-asciid nul bytes, we don't. */
+		if (use_dtruss && strncmp(end - 2, "\\0", 2) == 0) {
+			*(end - 2) = '\0';
+		}
+
+		valueend = end + 1;
+	} else if (*start == '{') {
+		start++;
+		end = strchr(start, '}');
+		*end = '\0';
+		valueend = end + 1;
+	} else {
+		valueend = start;
+	}
+
+	/* More arguments. */
+	end = strchr(valueend, ',');
+	if (end == NULL)
+		end = strchr(valueend, ')');
+	if (end == NULL)
+		return NULL;
+
+	/* No arguments left, return NULL. */
+	if (end == start)
+		start = NULL;
+
+	/* At this point 'end' should point to a comma or parenthesis. */
+	*end = '\0';
+	*startp = end + 1;
+
+	return start;
+}
+
+
+void
+legacy_parse_line(trace_line *tl, char *line)
+{
+	char *c, *a;
+
+	memset(tl, 0, sizeof(trace_line));
+	tl->raw = line;
+	tl->len = strlen(line);
+	tl->func_name = line;
+
+	c = legacy_skip_func_name(line);
+
+	/* Extract all the arguments. */
+	while ((a = legacy_extract_argument(&c)) != NULL) {
+		tl->argv[tl->argc] = a;
+		tl->argc++;
+	}
+
+	/* Extract a return value if any. */
+	a = strchr(c, '=');
+	if (a != NULL) {
+		/* Skip the spaces. */
+		while (*a == ' ' || *a == '=')
+			a++;
+
+		tl->result = a;
+
+		if (use_dtruss && (a = strchr(a, ' ')) != NULL)
+			*a = '\0';
+
+		/* Wipe the new-line. */
+		a = strchr(tl->result, '\n');
+		if (a != NULL)
+			*a = '\0';
+	}
+
+	if ((c = strstr(tl->func_name, "_nocancel")) != NULL)
+		*c = '\0';
+}
+
+
+/*
+ * The original stdio reader and parser.
+ */
+void
+read_lines_legacy(int fd)
+{
+	FILE *fp;
+	trace_line tl;
+	char line[MAX_LINE_LENGTH], *copy;
+
+	fp = fdopen(fd, "r");
+	if (fp == NULL)
+		err(1, "fdopen");
+
+	while (fgets(line, sizeof(line), fp)) {
+		copy = xstrdup(line);
+		legacy_parse_line(&tl, line);
+		count_line(0, &tl);
+		xfree(copy);
+	}
+}
+
+
+void
+usage(void)
+{
+	fprintf(stderr, "usage: trace_bench [-cdl] [-k tokenizer] file\n");
+	exit(1);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	struct timespec start, end;
+	double elapsed;
+	int fd, opt, legacy = 0;
+
+	while ((opt = getopt(argc, argv, "cdlk:")) != -1) {
+		switch (opt) {
+		case 'c':
+			use_checksum = 1;
+			break;
+		case 'd':
+			use_dump = 1;
+			break;
+		case 'l':
+			legacy = 1;
+			break;
+		case 'k':
+			if (trace_scan_select(optarg) == -1)
+				errx(1, "unsupported tokenizer: %s", optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		usage();
+
+	fd = open(argv[0], O_RDONLY);
+	if (fd == -1)
+		err(1, "%s", argv[0]);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (legacy)
+		read_lines_legacy(fd);
+	else {
+		trace_add_source(fd, 0);
+		trace_read_lines(count_line, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (use_dump)
+		return 0;
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("%s: %ld lines, %.1f MB in %.3f s: %.0f lines/s, %.1f MB/s\n",
+			legacy ? "legacy" : trace_scan_get_name(),
+			line_count, byte_count / 1e6,
+			elapsed, line_count / elapsed,
+			byte_count / 1e6 / elapsed);
+	if (use_checksum)
+		printf("checksum: %08x\n", checksum);
+
+	return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * Find all the structural characters of the strace output in a single pass.
+ *
+ * The output is cut in blocks of TRACE_SCAN_BLOCK bytes, each block is
+ * compared against all the characters the parser is interested in and the
+ * result is kept as bitmaps. The parser then jumps from one character to the
+ * next, lines included, instead of running memchr() and strchr() over and
+ * over on the same bytes.
+ *
+ * This only pays off with AVX2: glibc's memchr() is already vectorized and
+ * the lines are short, with SSE2 or a loop over the bytes the bitmaps cost
+ * more than they save. Without AVX2 the parser searches each character with
+ * memchr() instead, as it did before, and nothing is scanned here.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <err.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#include "trace_scan.h"
+#include "utils.h"
+
+
+/* The characters behind each trace_mark. */
+const char trace_mark_chars[TRACE_MARK_COUNT] = {
+	[TRACE_MARK_NEWLINE] = '\n',
+	[TRACE_MARK_LPAREN] = '(',
+	[TRACE_MARK_RPAREN] = ')',
+	[TRACE_MARK_COMMA] = ',',
+	[TRACE_MARK_RBRACE] = '}',
+	[TRACE_MARK_QUOTE] = '"',
+	[TRACE_MARK_EQUAL] = '=',
+	[TRACE_MARK_NUL] = '\0',
+};
+
+
+#ifdef HAVE_X86_SIMD
+/*
+ * Two 32 bytes comparisons per character.
+ */
+__attribute__((target("avx2")))
+void
+_scan_block_avx2(char *p, trace_marks *marks)
+{
+	__m256i lo, hi, c;
+	int m;
+
+	lo = _mm256_loadu_si256((__m256i *)p);
+	hi = _mm256_loadu_si256((__m256i *)(p + 32));
+
+	for (m = 0; m < TRACE_MARK_COUNT; m++) {
+		c = _mm256_set1_epi8(trace_mark_chars[m]);
+		marks->bits[m] = (uint32_t)_mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(lo, c)) |
+			(uint64_t)(uint32_t)_mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(hi, c)) << 32;
+	}
+}
+#endif
+
+
+/*
+ * Available implementations, the best first. The last one scans nothing, the
+ * parser uses memchr().
+ */
+static struct {
+	char	*name;
+	void	(*scan_block)(char *, trace_marks *);
+} scanners[] = {
+#ifdef HAVE_X86_SIMD
+	{ "avx2", _scan_block_avx2 },
+#endif
+	{ "memchr", NULL },
+};
+
+#define SCANNER_COUNT	(int)(sizeof(scanners) / sizeof(scanners[0]))
+
+
+/* Index in 'scanners' of the implementation in use, -1 until selected. */
+static int scanner = -1;
+
+
+/*
+ * Returns 1 if the CPU can run the given implementation.
+ */
+int
+_scanner_is_supported(char *name)
+{
+#ifdef HAVE_X86_SIMD
+	if (strcmp(name, "avx2") == 0)
+		return __builtin_cpu_supports("avx2");
+#endif
+	return strcmp(name, "memchr") == 0;
+}
+
+
+/*
+ * Use the implementation named 'name', or the best one supported by the CPU if
+ * 'name' is NULL. Returns -1 if the implementation is unknown or unsupported.
+ */
+int
+trace_scan_select(char *name)
+{
+	int i;
+
+	for (i = 0; i < SCANNER_COUNT; i++) {
+		if (name != NULL && strcmp(name, scanners[i].name) != 0)
+			continue;
+		if (!_scanner_is_supported(scanners[i].name))
+			continue;
+
+		scanner = i;
+		debug("trace_scan: using %s\n", scanners[i].name);
+		return 0;
+	}
+
+	return -1;
+}
+
+
+/*
+ * Name of the implementation in use.
+ */
+char *
+trace_scan_get_name(void)
+{
+	if (scanner == -1)
+		trace_scan_select(NULL);
+
+	return scanners[scanner].name;
+}
+
+
+/*
+ * Returns 1 if the trace output is scanned, 0 if the parser has to look for
+ * each character with memchr().
+ */
+int
+trace_scan_is_enabled(void)
+{
+	if (scanner == -1)
+		trace_scan_select(NULL);
+
+	return scanners[scanner].scan_block != NULL;
+}
+
+
+/*
+ * Fill 'marks' with the structural characters of the 'len' bytes at 'buf',
+ * there must be room for one trace_marks per TRACE_SCAN_BLOCK bytes (rounded
+ * up). The last partial block is padded with spaces, nothing is read past
+ * 'len'.
+ */
+void
+trace_scan(char *buf, size_t len, trace_marks *marks)
+{
+	void (*scan_block)(char *, trace_marks *);
+	char tail[TRACE_SCAN_BLOCK];
+	size_t offset;
+
+	if (!trace_scan_is_enabled())
+		errx(1, "trace_scan: no scanner in use");
+	scan_block = scanners[scanner].scan_block;
+
+	for (offset = 0; offset + TRACE_SCAN_BLOCK <= len;
+			offset += TRACE_SCAN_BLOCK)
+		scan_block(buf + offset, marks++);
+
+	if (offset < len) {
+		memset(tail, ' ', sizeof(tail));
+		memcpy(tail, buf + offset, len - offset);
+		scan_block(tail, marks);
+	}
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/* Number of bytes of a line covered by a trace_marks block. */
+#define TRACE_SCAN_BLOCK	64
+
+
+/*
+ * The structural characters of the strace output. Everything the parser looks
+ * for is one of those, apart from the opening quote and brace of an argument
+ * that are only ever checked where the argument starts.
+ */
+enum trace_mark {
+	TRACE_MARK_NEWLINE,
+	TRACE_MARK_LPAREN,
+	TRACE_MARK_RPAREN,
+	TRACE_MARK_COMMA,
+	TRACE_MARK_RBRACE,
+	TRACE_MARK_QUOTE,
+	TRACE_MARK_EQUAL,
+	TRACE_MARK_NUL,
+	TRACE_MARK_COUNT
+};
+
+
+/*
+ * Position of the structural characters in TRACE_SCAN_BLOCK bytes of trace
+ * output, one bitmap per character, bit n is set if the character is found at
+ * byte n.
+ */
+typedef struct _trace_marks {
+	uint64_t	 bits[TRACE_MARK_COUNT];
+} trace_marks;
+
+
+int		 trace_scan_select(char *);
+char		*trace_scan_get_name(void);
+int		 trace_scan_is_enabled(void);
+void		 trace_scan(char *, size_t, trace_marks *);
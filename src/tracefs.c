@@ -0,0 +1,810 @@
+/*
+ * Copyright (c) 2013 Bertrand Janin <b@janin.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * Linux tracefs (ftrace) backend. Both strace and ptrace stop the backend
+ * twice per system call, this one never does: the kernel records the
+ * raw_syscalls:sys_enter/sys_exit tracepoints of the pid in per-CPU ring
+ * buffers that we read in their binary form (trace_pipe_raw).
+ *
+ * A private tracing instance is created for each run, so we don't step on
+ * anybody else using ftrace, and removed on exit. It is named after our own
+ * pid, the ones left behind by a pg_trace that was killed are removed when
+ * the next one starts.
+ *
+ * The tracepoints only give us the raw registers, the path of an open() is
+ * obtained afterwards from /proc/<pid>/fd/<fd>. If the descriptor is already
+ * closed or reused by the time we look, the path is lost.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <dirent.h>
+#include <errno.h>
+#include <err.h>
+
+#include "trace.h"
+#include "tracefs.h"
+#include "strlcpy.h"
+#include "sysent.h"
+#include "utils.h"
+#include "xmalloc.h"
+
+
+/* Ring buffer event types, see include/linux/ring_buffer.h */
+#define RINGBUF_TYPE_DATA_TYPE_LEN_MAX	28
+#define RINGBUF_TYPE_PADDING		29
+#define RINGBUF_TYPE_TIME_EXTEND	30
+#define RINGBUF_TYPE_TIME_STAMP		31
+
+/* Low bits of the 'commit' field of a page, the rest are flags. */
+#define RINGBUF_COMMIT_MASK		((1 << 27) - 1)
+
+
+/*
+ * Location of a field within a binary event, as described by the 'format'
+ * files of tracefs.
+ */
+struct tracefs_field {
+	int		 offset;
+	int		 size;
+};
+
+struct tracefs_format {
+	int			 id;
+	struct tracefs_field	 common_pid;
+	struct tracefs_field	 nr;
+	struct tracefs_field	 args;
+	struct tracefs_field	 ret;
+};
+
+
+/*
+ * One decoded sys_enter or sys_exit event, waiting to be sorted with the ones
+ * coming from the other CPUs. 'seq' is the order in which it was read, which
+ * is the order of the events of a CPU.
+ */
+struct tracefs_record {
+	uint64_t	 ts;
+	int		 seq;
+	int		 exit;
+	long		 nr;
+	unsigned long	 args[TRACE_EVENT_MAX_ARGS];
+	long		 ret;
+};
+
+
+char *tracefs_root = NULL;
+char tracefs_instance[MAXPATHLEN / 2] = "";
+
+struct tracefs_format tracefs_enter;
+struct tracefs_format tracefs_exit;
+
+/* Layout of the ring buffer pages (events/header_page). */
+int tracefs_commit_offset = 8;
+int tracefs_commit_size = 8;
+int tracefs_data_offset = 16;
+
+/* Per-CPU trace_pipe_raw. */
+struct pollfd *tracefs_pfds = NULL;
+int tracefs_cpu_count = 0;
+
+/* Records collected during one round of reads. */
+struct tracefs_record *tracefs_records = NULL;
+int tracefs_record_count = 0;
+int tracefs_record_size = 0;
+
+extern volatile sig_atomic_t trace_interrupted;
+
+
+/*
+ * Write a value to one of the files of a tracing instance.
+ *
+ * Returns -1 on failure, with errno set.
+ */
+int
+_tracefs_write(char *instance, char *name, char *value)
+{
+	char path[MAXPATHLEN];
+	int fd;
+	ssize_t l;
+
+	snprintf(path, sizeof(path), "%s/%s", instance, name);
+
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd == -1)
+		return -1;
+
+	l = write(fd, value, strlen(value));
+	close(fd);
+
+	if (l == -1)
+		return -1;
+
+	return 0;
+}
+
+
+/*
+ * Read an integer value following 'key' in a tracefs format line, -1 if it
+ * can't be found.
+ */
+int
+_tracefs_get_int(char *line, char *key)
+{
+	char *c;
+
+	c = strstr(line, key);
+	if (c == NULL)
+		return -1;
+
+	return atoi(c + strlen(key));
+}
+
+
+/*
+ * Parse one 'field:' line of a format file, returns the name of the field
+ * (stripped from its type and array size) in 'name'.
+ */
+void
+_tracefs_parse_field(char *line, char *name, size_t len,
+		struct tracefs_field *field)
+{
+	char *start, *end;
+
+	name[0] = '\0';
+
+	end = strchr(line, ';');
+	if (end == NULL)
+		return;
+
+	/* The name is the last word before the first semicolon. */
+	start = end;
+	while (start > line && *(start - 1) != ' ' && *(start - 1) != '\t')
+		start--;
+
+	strlcpy(name, start, MIN(len, (size_t)(end - start + 1)));
+	if ((end = strchr(name, '[')) != NULL)
+		*end = '\0';
+
+	field->offset = _tracefs_get_int(line, "offset:");
+	field->size = _tracefs_get_int(line, "size:");
+}
+
+
+/*
+ * Load the id and the interesting field offsets of an event. Both events
+ * have the syscall number, sys_enter has its arguments and sys_exit ('exit'
+ * set) its return value.
+ */
+void
+_tracefs_load_format(char *event, struct tracefs_format *fmt, int exit)
+{
+	FILE *fp;
+	char path[MAXPATHLEN], line[MAX_LINE_LENGTH], name[64];
+	struct tracefs_field field;
+
+	memset(fmt, 0, sizeof(*fmt));
+	fmt->id = -1;
+	fmt->common_pid.offset = -1;
+	fmt->nr.offset = -1;
+	fmt->args.offset = -1;
+	fmt->ret.offset = -1;
+
+	snprintf(path, sizeof(path), "%s/events/%s/format", tracefs_root, event);
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		err(1, "tracefs: unable to open %s", path);
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, "ID:", 3) == 0) {
+			fmt->id = atoi(line + 3);
+			continue;
+		}
+
+		if (strstr(line, "field:") == NULL)
+			continue;
+
+		_tracefs_parse_field(line, name, sizeof(name), &field);
+
+		if (strcmp(name, "common_pid") == 0)
+			fmt->common_pid = field;
+		else if (strcmp(name, "id") == 0)
+			fmt->nr = field;
+		else if (strcmp(name, "args") == 0)
+			fmt->args = field;
+		else if (strcmp(name, "ret") == 0)
+			fmt->ret = field;
+	}
+
+	fclose(fp);
+
+	if (fmt->id == -1)
+		errx(1, "tracefs: no event id in %s", path);
+
+	if (fmt->nr.offset < 0 || (fmt->nr.size != 4 && fmt->nr.size != 8))
+		errx(1, "tracefs: no syscall number in %s", path);
+
+	if (exit && (fmt->ret.offset < 0 ||
+				(fmt->ret.size != 4 && fmt->ret.size != 8)))
+		errx(1, "tracefs: no return value in %s", path);
+
+	if (!exit && (fmt->args.offset < 0 || fmt->args.size <
+				(int)(TRACE_EVENT_MAX_ARGS * sizeof(long))))
+		errx(1, "tracefs: no arguments in %s", path);
+}
+
+
+/*
+ * Load the layout of the ring buffer pages, the defaults are the ones of
+ * 64-bit kernels.
+ */
+void
+_tracefs_load_header_page(void)
+{
+	FILE *fp;
+	char path[MAXPATHLEN], line[MAX_LINE_LENGTH], name[64];
+	struct tracefs_field field;
+
+	snprintf(path, sizeof(path), "%s/events/header_page", tracefs_root);
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (strstr(line, "field:") == NULL)
+			continue;
+
+		_tracefs_parse_field(line, name, sizeof(name), &field);
+
+		if (strcmp(name, "commit") == 0) {
+			tracefs_commit_offset = field.offset;
+			tracefs_commit_size = field.size;
+		} else if (strcmp(name, "data") == 0) {
+			tracefs_data_offset = field.offset;
+		}
+	}
+
+	fclose(fp);
+}
+
+
+/*
+ * Find where tracefs is mounted, either on its own or within debugfs.
+ */
+char *
+_tracefs_find_root(void)
+{
+	struct stat sb;
+
+	if (stat("/sys/kernel/tracing/events", &sb) == 0)
+		return "/sys/kernel/tracing";
+
+	if (stat("/sys/kernel/debug/tracing/events", &sb) == 0)
+		return "/sys/kernel/debug/tracing";
+
+	return NULL;
+}
+
+
+/*
+ * Disable the events of a tracing instance and remove it.
+ *
+ * Returns -1 on failure, with errno set.
+ */
+int
+_tracefs_remove_instance(char *instance)
+{
+	_tracefs_write(instance, "events/raw_syscalls/sys_enter/enable", "0");
+	_tracefs_write(instance, "events/raw_syscalls/sys_exit/enable", "0");
+
+	return rmdir(instance);
+}
+
+
+/*
+ * Remove the instances of the pg_trace processes which are gone without
+ * cleaning up after themselves (SIGKILL, crash).
+ */
+void
+_tracefs_remove_stale(void)
+{
+	DIR *dir;
+	struct dirent *de;
+	char path[MAXPATHLEN], *end;
+	long owner;
+
+	snprintf(path, sizeof(path), "%s/instances", tracefs_root);
+
+	dir = opendir(path);
+	if (dir == NULL)
+		return;
+
+	while ((de = readdir(dir)) != NULL) {
+		if (strncmp(de->d_name, "pg_trace.", 9) != 0)
+			continue;
+
+		owner = strtol(de->d_name + 9, &end, 10);
+		if (*end != '\0' || owner <= 0 || owner == (long)getpid())
+			continue;
+
+		if (kill((pid_t)owner, 0) == 0 || errno != ESRCH)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/instances/%s", tracefs_root,
+				de->d_name);
+		if (_tracefs_remove_instance(path) == -1)
+			warn("tracefs: unable to remove %s", path);
+		else
+			debug("tracefs: removed stale instance %s\n", path);
+	}
+
+	closedir(dir);
+}
+
+
+/*
+ * Create a tracing instance recording the system calls of the given pid and
+ * open its per-CPU buffers.
+ *
+ * Returns -1 if tracefs is not available.
+ */
+int
+tracefs_open(pid_t pid)
+{
+	char path[MAXPATHLEN], value[32];
+	int cpu;
+
+	tracefs_root = _tracefs_find_root();
+	if (tracefs_root == NULL)
+		return -1;
+
+	_tracefs_remove_stale();
+
+	snprintf(tracefs_instance, sizeof(tracefs_instance),
+			"%s/instances/pg_trace.%d", tracefs_root, (int)getpid());
+
+	if (mkdir(tracefs_instance, 0700) == -1 && errno != EEXIST)
+		return -1;
+
+	atexit(tracefs_close);
+
+	_tracefs_load_header_page();
+	_tracefs_load_format("raw_syscalls/sys_enter", &tracefs_enter, 0);
+	_tracefs_load_format("raw_syscalls/sys_exit", &tracefs_exit, 1);
+
+	snprintf(value, sizeof(value), "%d", TRACEFS_BUFFER_SIZE_KB);
+	if (_tracefs_write(tracefs_instance, "buffer_size_kb", value) == -1)
+		warn("tracefs: unable to resize the buffers");
+
+	/*
+	 * The events of all the CPUs are merged on their timestamps, the
+	 * default 'local' clock is not synchronized between CPUs.
+	 */
+	if (_tracefs_write(tracefs_instance, "trace_clock", "mono") == -1 &&
+			_tracefs_write(tracefs_instance, "trace_clock",
+				"global") == -1)
+		err(1, "tracefs: unable to set a cross-cpu trace_clock");
+
+	snprintf(value, sizeof(value), "%d", (int)pid);
+	if (_tracefs_write(tracefs_instance, "set_event_pid", value) == -1)
+		err(1, "tracefs: unable to set the pid filter");
+
+	if (_tracefs_write(tracefs_instance,
+				"events/raw_syscalls/sys_enter/enable",
+				"1") == -1 ||
+			_tracefs_write(tracefs_instance,
+				"events/raw_syscalls/sys_exit/enable",
+				"1") == -1)
+		err(1, "tracefs: unable to enable raw_syscalls");
+
+	/* Open the per-CPU buffers, until we run out of CPUs. */
+	for (cpu = 0;; cpu++) {
+		snprintf(path, sizeof(path), "%s/per_cpu/cpu%d/trace_pipe_raw",
+				tracefs_instance, cpu);
+		if (access(path, R_OK) == -1)
+			break;
+
+		tracefs_pfds = xrealloc(tracefs_pfds, cpu + 1,
+				sizeof(struct pollfd));
+		tracefs_pfds[cpu].fd = open(path, O_RDONLY | O_NONBLOCK);
+		if (tracefs_pfds[cpu].fd == -1)
+			err(1, "tracefs: unable to open %s", path);
+		tracefs_pfds[cpu].events = POLLIN;
+		tracefs_cpu_count++;
+	}
+
+	if (tracefs_cpu_count == 0)
+		errx(1, "tracefs: no per-cpu buffers found");
+
+	debug("tracefs: tracing pid %d on %d cpus from %s\n", pid,
+			tracefs_cpu_count, tracefs_instance);
+
+	return 0;
+}
+
+
+/*
+ * Disable the events and drop our tracing instance. This is registered with
+ * atexit() since leaving it behind would keep recording forever, SIGINT and
+ * SIGTERM stop our event loop and end the program normally.
+ */
+void
+tracefs_close(void)
+{
+	int i;
+
+	if (tracefs_instance[0] == '\0')
+		return;
+
+	for (i = 0; i < tracefs_cpu_count; i++)
+		close(tracefs_pfds[i].fd);
+	tracefs_cpu_count = 0;
+
+	if (_tracefs_remove_instance(tracefs_instance) == -1)
+		warn("tracefs: unable to remove %s", tracefs_instance);
+
+	tracefs_instance[0] = '\0';
+}
+
+
+/*
+ * Read an unsigned value of 'size' bytes (4 or 8) from a buffer.
+ */
+uint64_t
+_tracefs_read_uint(char *p, int size)
+{
+	uint32_t u32;
+	uint64_t u64;
+
+	if (size == 4) {
+		memcpy(&u32, p, sizeof(u32));
+		return u32;
+	}
+
+	memcpy(&u64, p, sizeof(u64));
+	return u64;
+}
+
+
+/*
+ * Return the next free record, growing the pool as needed.
+ */
+struct tracefs_record *
+_tracefs_next_record(void)
+{
+	if (tracefs_record_count == tracefs_record_size) {
+		tracefs_record_size += 1024;
+		tracefs_records = xrealloc(tracefs_records,
+				tracefs_record_size,
+				sizeof(struct tracefs_record));
+	}
+
+	tracefs_records[tracefs_record_count].seq = tracefs_record_count;
+
+	return &tracefs_records[tracefs_record_count++];
+}
+
+
+/*
+ * Decode the payload of one event, keeping only the system calls.
+ */
+void
+_tracefs_parse_event(char *data, int len, uint64_t ts)
+{
+	struct tracefs_record *rec;
+	struct tracefs_format *fmt;
+	uint16_t type;
+	int i;
+
+	if (len < (int)sizeof(type))
+		return;
+
+	memcpy(&type, data, sizeof(type));
+
+	if (type == tracefs_enter.id)
+		fmt = &tracefs_enter;
+	else if (type == tracefs_exit.id)
+		fmt = &tracefs_exit;
+	else
+		return;
+
+	/* An event shorter than its format is dropped. */
+	if (fmt->nr.offset + fmt->nr.size > len)
+		return;
+	if (fmt == &tracefs_exit &&
+			fmt->ret.offset + fmt->ret.size > len)
+		return;
+	if (fmt == &tracefs_enter && fmt->args.offset +
+			(int)(TRACE_EVENT_MAX_ARGS * sizeof(long)) > len)
+		return;
+
+	rec = _tracefs_next_record();
+	rec->ts = ts;
+	rec->exit = (fmt == &tracefs_exit);
+	rec->nr = (long)_tracefs_read_uint(data + fmt->nr.offset, fmt->nr.size);
+	rec->ret = 0;
+
+	if (rec->exit) {
+		rec->ret = (long)_tracefs_read_uint(data + fmt->ret.offset,
+				fmt->ret.size);
+		return;
+	}
+
+	for (i = 0; i < TRACE_EVENT_MAX_ARGS; i++) {
+		rec->args[i] = _tracefs_read_uint(data + fmt->args.offset +
+				i * sizeof(long), sizeof(long));
+	}
+}
+
+
+/*
+ * Walk the events of one ring buffer page. The page starts with a header
+ * (timestamp and committed length), followed by a sequence of events, each
+ * with a 32-bit header: 5 bits of type/length and 27 bits of time delta.
+ */
+void
+_tracefs_parse_page(char *page, ssize_t len)
+{
+	uint64_t ts, commit;
+	uint32_t header, type_len, delta, array0;
+	char *c, *end;
+	int length;
+
+	if (len < tracefs_data_offset)
+		return;
+
+	ts = _tracefs_read_uint(page, 8);
+	commit = _tracefs_read_uint(page + tracefs_commit_offset,
+			tracefs_commit_size) & RINGBUF_COMMIT_MASK;
+
+	c = page + tracefs_data_offset;
+	end = c + MIN((ssize_t)commit, len - tracefs_data_offset);
+
+	while (c + 4 <= end) {
+		memcpy(&header, c, sizeof(header));
+		type_len = header & 0x1f;
+		delta = header >> 5;
+
+		array0 = 0;
+		if (c + 8 <= end)
+			memcpy(&array0, c + 4, sizeof(array0));
+
+		switch (type_len) {
+		case RINGBUF_TYPE_PADDING:
+			/* A null padding means the rest of the page is empty. */
+			if (delta == 0)
+				return;
+			c += 4 + array0;
+			break;
+		case RINGBUF_TYPE_TIME_EXTEND:
+			ts += delta + ((uint64_t)array0 << 27);
+			c += 8;
+			break;
+		case RINGBUF_TYPE_TIME_STAMP:
+			ts = delta + ((uint64_t)array0 << 27);
+			c += 8;
+			break;
+		case 0:
+			/* Large event, the length follows the header. */
+			ts += delta;
+			length = (int)array0 - 4;
+			if (length < 0 || c + 8 + length > end)
+				return;
+			_tracefs_parse_event(c + 8, length, ts);
+			c += 8 + length;
+			break;
+		default:
+			ts += delta;
+			length = type_len * 4;
+			if (c + 4 + length > end)
+				return;
+			_tracefs_parse_event(c + 4, length, ts);
+			c += 4 + length;
+			break;
+		}
+	}
+}
+
+
+/*
+ * Sort records by timestamp, keeping the per-CPU order for equal ones (qsort
+ * is not stable).
+ */
+int
+_tracefs_record_cmp(const void *a, const void *b)
+{
+	const struct tracefs_record *ra = a, *rb = b;
+
+	if (ra->ts < rb->ts)
+		return -1;
+	if (ra->ts > rb->ts)
+		return 1;
+	return ra->seq - rb->seq;
+}
+
+
+/*
+ * Read a NUL-terminated string from the memory of the traced process.
+ *
+ * Returns -1 if it can't be read.
+ */
+int
+_tracefs_read_string(pid_t pid, unsigned long addr, char *buf, size_t len)
+{
+	char path[MAXPATHLEN];
+	ssize_t l;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/mem", (int)pid);
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	/* A short read is fine, the string can end right before a hole. */
+	l = pread(fd, buf, len - 1, (off_t)addr);
+	close(fd);
+
+	if (l <= 0 || memchr(buf, '\0', l) == NULL)
+		return -1;
+
+	return 0;
+}
+
+
+/*
+ * Find the path behind a freshly opened file descriptor, from /proc. By the
+ * time we look, the descriptor may have been closed and reused for another
+ * file, so the file it points to is compared with the one named by the
+ * system call (relative to the cwd or the directory descriptor of openat).
+ *
+ * Returns NULL if the path is unknown or doesn't match.
+ */
+char *
+_tracefs_get_fd_path(pid_t pid, struct sysent *se,
+		struct tracefs_record *enter, long fd, char *buf, size_t len)
+{
+	char path[MAXPATHLEN], name[MAXPATHLEN / 2];
+	struct stat sb_fd, sb_name;
+	ssize_t l;
+
+	snprintf(path, sizeof(path), "/proc/%d/fd/%ld", (int)pid, fd);
+
+	if (stat(path, &sb_fd) == -1)
+		return NULL;
+
+	l = readlink(path, buf, len - 1);
+	if (l == -1)
+		return NULL;
+	buf[l] = '\0';
+
+	if (_tracefs_read_string(pid, enter->args[se->path_arg], name,
+				sizeof(name)) == -1) {
+		debug("tracefs: unable to read the path of fd %ld\n", fd);
+		return NULL;
+	}
+
+	if (name[0] == '/')
+		strlcpy(path, name, sizeof(path));
+	else if (se->path_arg > 0 && (int)enter->args[0] != AT_FDCWD)
+		snprintf(path, sizeof(path), "/proc/%d/fd/%d/%s", (int)pid,
+				(int)enter->args[0], name);
+	else
+		snprintf(path, sizeof(path), "/proc/%d/cwd/%s", (int)pid,
+				name);
+
+	if (stat(path, &sb_name) == -1 || sb_fd.st_dev != sb_name.st_dev ||
+			sb_fd.st_ino != sb_name.st_ino) {
+		debug("tracefs: fd %ld is not %s anymore\n", fd, name);
+		return NULL;
+	}
+
+	return buf;
+}
+
+
+/*
+ * Poll the per-CPU buffers, merge their events in time order and pair each
+ * sys_enter with its sys_exit to pass complete system calls to the handler.
+ * This returns when the traced process is gone or when interrupted.
+ *
+ * The merge is done on everything available at each round. An event
+ * committed on a CPU right after we drained it can come out of order, it
+ * would need the backend to migrate within that window.
+ */
+void
+tracefs_read_events(pid_t pid, void (*func_handler)(trace_event *))
+{
+	struct tracefs_record *rec, enter;
+	struct sysent *se;
+	trace_event ev;
+	char *page, path[MAXPATHLEN];
+	long page_size;
+	ssize_t l;
+	int i, in_syscall = 0;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	page = xmalloc(page_size);
+
+	while (!trace_interrupted) {
+		if (poll(tracefs_pfds, tracefs_cpu_count,
+					TRACEFS_POLL_TIMEOUT) == -1
+				&& errno != EINTR)
+			err(1, "tracefs_read_events:poll()");
+
+		tracefs_record_count = 0;
+
+		for (i = 0; i < tracefs_cpu_count; i++) {
+			while ((l = read(tracefs_pfds[i].fd, page,
+							page_size)) > 0)
+				_tracefs_parse_page(page, l);
+
+			if (l == -1 && errno != EAGAIN && errno != EINTR)
+				err(1, "tracefs_read_events:read()");
+		}
+
+		qsort(tracefs_records, tracefs_record_count,
+				sizeof(struct tracefs_record),
+				_tracefs_record_cmp);
+
+		for (i = 0; i < tracefs_record_count; i++) {
+			rec = &tracefs_records[i];
+
+			if (!rec->exit) {
+				enter = *rec;
+				in_syscall = 1;
+				continue;
+			}
+
+			if (!in_syscall || enter.nr != rec->nr)
+				continue;
+			in_syscall = 0;
+
+			se = sysent_decode(enter.nr, enter.args, rec->ret, &ev);
+			ev.pid = pid;
+			ev.duration = (long)(rec->ts - enter.ts);
+			if (se != NULL && se->path_arg != -1 &&
+					rec->ret >= 0)
+				ev.path = _tracefs_get_fd_path(pid, se,
+						&enter, rec->ret, path,
+						sizeof(path));
+
+			func_handler(&ev);
+		}
+
+		if (tracefs_record_count == 0)
+			trace_idle();
+
+		if (kill(pid, 0) == -1 && errno == ESRCH)
+			break;
+	}
+
+	xfree(page);
+
+	debug("tracefs: pid %d is gone\n", pid);
+}
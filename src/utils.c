@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <string.h>
+#include <time.h>
 #include <err.h>
 
 #include "xmalloc.h"
@@ -102,3 +103,62 @@ xitoa(int i)
 
 	return xstrdup(buf);
 }
+
+
+/*
+ * Returns the current time in seconds from a monotonic clock.
+ */
+double
+get_monotonic_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Format a number of bytes in a human readable way (e.g. "1.14 MiB") into the
+ * provided buffer, which is returned for convenience.
+ */
+char *
+human_size(double bytes, char *buf, size_t len)
+{
+	char *units[] = { "B", "KiB", "MiB", "GiB", "TiB", "PiB" };
+	int i = 0;
+
+	while ((bytes >= 1024 || bytes <= -1024) &&
+			i < (int)(sizeof(units) / sizeof(units[0])) - 1) {
+		bytes /= 1024;
+		i++;
+	}
+
+	if (i == 0)
+		snprintf(buf, len, "%.0f %s", bytes, units[i]);
+	else
+		snprintf(buf, len, "%.2f %s", bytes, units[i]);
+
+	return buf;
+}
+
+
+/*
+ * Format a duration in seconds in a human readable way (e.g. "1h02m") into
+ * the provided buffer, which is returned for convenience.
+ */
+char *
+human_duration(double seconds, char *buf, size_t len)
+{
+	long s = (long)seconds;
+
+	if (s >= 3600)
+		snprintf(buf, len, "%ldh%02ldm", s / 3600, s % 3600 / 60);
+	else if (s >= 60)
+		snprintf(buf, len, "%ldm%02lds", s / 60, s % 60);
+	else
+		snprintf(buf, len, "%lds", s);
+
+	return buf;
+}
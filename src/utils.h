@@ -34,4 +34,7 @@ extern int debug_flag;
 int		 xatoi(char *);
 int		 xatoi_or_zero(char *);
 char		*xitoa(int);
+double		 get_monotonic_time(void);
+char		*human_size(double, char *, size_t);
+char		*human_duration(double, char *, size_t);
 